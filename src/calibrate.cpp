@@ -0,0 +1,251 @@
+#include "calibrate.hpp"
+#include "settings.hpp"
+#include "hx20-transport.hpp"
+#include "hx20-link-stats.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <chrono>
+#include <vector>
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+//what the round trips are measured with: an ACK and a header frame
+uint8_t const probeByte[1] = { 0x06 };
+uint8_t const probeFrame[7] = { 0x01, 0x01, 0x20, 0x30, 0x92, 0x00, 0x1c };
+
+//the adapters hold bytes back for 16 ms at worst
+constexpr int ROUND_TIMEOUT_MS = 500;
+
+struct Measurement {
+    HdrHistogram byte;
+    HdrHistogram frame;
+    uint64_t lost = 0;
+};
+
+QString tuningKey(std::string const &path) {
+    //slashes would nest groups in the settings
+    return QString::fromStdString(path).replace('/', '_');
+}
+
+bool writeAll(HX20Transport &t, uint8_t const *buf, size_t size) {
+    while(size > 0) {
+        ssize_t res = t.write(buf, size);
+        if(res < 0) {
+            if(errno == EINTR)
+                continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                return false;
+            struct pollfd pfd = { t.getFd(), POLLOUT, 0 };
+            ::poll(&pfd, 1, ROUND_TIMEOUT_MS);
+            continue;
+        }
+        buf += res;
+        size -= res;
+    }
+    return true;
+}
+
+bool readAll(HX20Transport &t, uint8_t *buf, size_t size,
+             Clock::time_point deadline) {
+    while(size > 0) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>
+                    (deadline - Clock::now()).count();
+        if(left < 0)
+            return false;
+        struct pollfd pfd = { t.getFd(), POLLIN, 0 };
+        if(::poll(&pfd, 1, left + 1) <= 0)
+            continue;
+        ssize_t res = ::read(t.getFd(), buf, size);
+        if(res < 0 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+            return false;
+        if(res > 0) {
+            buf += res;
+            size -= res;
+        }
+    }
+    return true;
+}
+
+//us from writing size bytes to having them back, -1 if they got lost
+int64_t roundTrip(HX20TtyTransport &port, HX20TtyTransport *echo,
+                  uint8_t const *probe, size_t size) {
+    uint8_t buf[sizeof(probeFrame)];
+    //leftovers of a lost round would end this one early
+    tcflush(port.getFd(), TCIFLUSH);
+    if(echo)
+        tcflush(echo->getFd(), TCIFLUSH);
+    auto start = Clock::now();
+    auto deadline = start + std::chrono::milliseconds(ROUND_TIMEOUT_MS);
+    if(!writeAll(port, probe, size))
+        return -1;
+    if(echo && (!readAll(*echo, buf, size, deadline) ||
+                !writeAll(*echo, buf, size)))
+        return -1;
+    if(!readAll(port, buf, size, deadline) || memcmp(buf, probe, size) != 0)
+        return -1;
+    return std::chrono::duration_cast<std::chrono::microseconds>
+           (Clock::now() - start).count();
+}
+
+Measurement measure(HX20TtyTransport &port, HX20TtyTransport *echo, int rounds) {
+    Measurement m;
+    for(int i = 0; i < rounds; i++) {
+        int64_t us = roundTrip(port, echo, probeByte, sizeof(probeByte));
+        if(us < 0)
+            m.lost++;
+        else
+            m.byte.record(us);
+        us = roundTrip(port, echo, probeFrame, sizeof(probeFrame));
+        if(us < 0)
+            m.lost++;
+        else
+            m.frame.record(us);
+    }
+    return m;
+}
+
+/* VMIN and VTIME are not among them: the kernel ignores them for
+ * non-blocking reads, which is all the connection and measure do, so
+ * every setting of them would measure the same.
+ */
+std::vector<HX20TtyTuning> candidates(HX20TtyTransport const &port) {
+    std::vector<HX20TtyTuning> res;
+    static int const timers[] = { 1, 2, 4, 8, 16 };
+    HX20TtyTuning t;
+    if(port.hasLatencyTimer()) {
+        for(int timer : timers) {
+            t.latencyTimer = timer;
+            res.push_back(t);
+        }
+        t.latencyTimer = -1;
+    } else {
+        res.push_back(t);
+    }
+    //low latency mode picks its own latency timer
+    if(port.hasLowLatency()) {
+        t.lowLatency = true;
+        res.push_back(t);
+    }
+    return res;
+}
+
+void printRow(char const *label, HX20TtyTuning const &t, Measurement const &m) {
+    char timer[16];
+    if(t.latencyTimer < 0)
+        snprintf(timer, sizeof(timer), "-");
+    else
+        snprintf(timer, sizeof(timer), "%d", t.latencyTimer);
+    printf("%-8s %4d %5d %6s %5s  %7llu %7llu %7llu  %7llu %7llu %7llu %5llu\n",
+           label, t.vmin, t.vtime, t.lowLatency ? "on" : "off", timer,
+           (unsigned long long)m.byte.percentile(0.5),
+           (unsigned long long)m.byte.percentile(0.9),
+           (unsigned long long)m.byte.percentile(0.99),
+           (unsigned long long)m.frame.percentile(0.5),
+           (unsigned long long)m.frame.percentile(0.9),
+           (unsigned long long)m.frame.percentile(0.99),
+           (unsigned long long)m.lost);
+    fflush(stdout);
+}
+
+//lower is better: no losses, then the typical frame round trip
+bool better(Measurement const &a, Measurement const &b) {
+    if((a.lost == 0) != (b.lost == 0))
+        return a.lost == 0;
+    if(a.frame.percentile(0.9) != b.frame.percentile(0.9))
+        return a.frame.percentile(0.9) < b.frame.percentile(0.9);
+    return a.byte.percentile(0.9) < b.byte.percentile(0.9);
+}
+
+}
+
+int runCalibration(Settings::Group *settingsRoot, CalibrationOptions const &options) {
+    std::unique_ptr<HX20Transport> transport =
+        HX20Transport::open(options.device.toLocal8Bit().data());
+    HX20TtyTransport *port = dynamic_cast<HX20TtyTransport *>(transport.get());
+    if(!port) {
+        fprintf(stderr, "%s is not a serial port\n",
+                options.device.toLocal8Bit().constData());
+        return 1;
+    }
+    std::unique_ptr<HX20TtyTransport> echo;
+    if(!options.echo.isEmpty())
+        echo = std::make_unique<HX20TtyTransport>(options.echo.toLocal8Bit().data());
+
+    HX20TtyTuning original = port->tuning();
+    printf("round trips through %s%s, %d rounds each, in us\n",
+           port->description().c_str(),
+           echo ? (" and " + echo->description()).c_str() : " and a loopback plug",
+           options.rounds);
+    printf("%-8s %4s %5s %6s %5s  %7s %7s %7s  %7s %7s %7s %5s\n",
+           "", "vmin", "vtime", "lowlat", "timer",
+           "1B p50", "p90", "p99", "7B p50", "p90", "p99", "lost");
+
+    Measurement best = measure(*port, echo.get(), options.rounds);
+    HX20TtyTuning bestTuning = original;
+    printRow("current", original, best);
+    if(best.byte.count() == 0 && best.frame.count() == 0) {
+        fprintf(stderr, "Nothing came back, is the loopback plug or the echo port connected?\n");
+        return 1;
+    }
+
+    for(auto &t : candidates(*port)) {
+        try {
+            port->applyTuning(t);
+        } catch(IOError &e) {
+            printf("%-8s %s: %s\n", "skipped", t.toString().c_str(), e.what());
+            continue;
+        }
+        Measurement m = measure(*port, echo.get(), options.rounds);
+        printRow("", t, m);
+        if(better(m, best)) {
+            best = std::move(m);
+            bestTuning = t;
+        }
+    }
+
+    try {
+        port->applyTuning(original);
+    } catch(IOError &e) {
+        fprintf(stderr, "Restoring %s failed: %s\n",
+                original.toString().c_str(), e.what());
+    }
+
+    printf("best: %s, 7 byte round trip p90 %llu us\n", bestTuning.toString().c_str(),
+           (unsigned long long)best.frame.percentile(0.9));
+    if(options.save) {
+        settingsRoot->group("tty_tuning")->setValue(tuningKey(port->devicePath()),
+                QString::fromStdString(bestTuning.toString()));
+        printf("saved, it is applied whenever %s is connected\n",
+               port->devicePath().c_str());
+    }
+    return 0;
+}
+
+std::unique_ptr<HX20Transport> openTunedTransport(Settings::Group const *settingsRoot,
+                                                  QString const &url) {
+    std::unique_ptr<HX20Transport> transport =
+        HX20Transport::open(url.toLocal8Bit().data());
+    HX20TtyTransport *port = dynamic_cast<HX20TtyTransport *>(transport.get());
+    if(!port)
+        return transport;
+    QString saved = settingsRoot->group("tty_tuning")->
+                    value(tuningKey(port->devicePath())).toString();
+    HX20TtyTuning tuning;
+    if(saved.isEmpty() || !HX20TtyTuning::fromString(saved.toStdString(), tuning))
+        return transport;
+    //an adapter that has changed is no reason not to connect
+    try {
+        port->applyTuning(tuning);
+    } catch(IOError &e) {
+        fprintf(stderr, "Applying the saved tuning to %s failed: %s\n",
+                port->devicePath().c_str(), e.what());
+    }
+    return transport;
+}
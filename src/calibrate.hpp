@@ -0,0 +1,34 @@
+#pragma once
+
+#include <QString>
+#include <memory>
+
+#include "hx20-transport.hpp"
+
+namespace Settings {
+class Group;
+};
+
+struct CalibrationOptions {
+    //the port the hx-20 is connected to
+    QString device;
+    //the other end of a null modem cable from device, echoing everything
+    //back. Without it, device needs a loopback plug.
+    QString echo;
+    int rounds = 100;
+    //keep the best tuning in the settings, for every later connection
+    bool save = false;
+};
+
+/* Measures the round trip of single bytes and header sized frames
+ * through the serial port under each tuning it supports, starting with
+ * the current one, and prints their percentiles. The port is left as it
+ * was. Returns the exit code.
+ */
+int runCalibration(Settings::Group *settingsRoot, CalibrationOptions const &options);
+
+/* Opens url like HX20Transport::open. Serial ports get the tuning saved
+ * for them by runCalibration.
+ */
+std::unique_ptr<HX20Transport> openTunedTransport(Settings::Group const *settingsRoot,
+                                                  QString const &url);
@@ -2559,6 +2559,9 @@ CommsDebugWindow::CommsDebugWindow(QWidget *parent, Qt::WindowFlags f)
     : QDockWidget(parent, f), conn(nullptr), scrollToNewest(true),
       packetlist(new QTreeView(this)), packetdecode(new QTreeView(this)),
       rawdecode(new QTreeView(this)), rawDecoder(std::make_unique<RawDecoder>()) {
+    stagedbytes.reserve(65536);
+    staged.reserve(4096);
+
     QSplitter *w = new QSplitter(this);
     w->setOrientation(Qt::Orientation::Vertical);
     w->addWidget(packetlist);
@@ -2678,14 +2681,7 @@ CommsDebugWindow::CommsDebugWindow(QWidget *parent, Qt::WindowFlags f)
     });
 
     connect(insertTimer, &QTimer::timeout,
-    this, [this]() {
-        packetlistmodel->beforeAddPackets();
-        for(auto &pi : insertpackets) {
-            packets.push_back(pi);
-        }
-        packetlistmodel->afterAddPackets();
-        insertpackets.clear();
-    });
+    this, &CommsDebugWindow::flushStaged);
 }
 
 CommsDebugWindow::~CommsDebugWindow() {
@@ -2711,42 +2707,56 @@ void CommsDebugWindow::setConnection(HX20SerialConnection *conn) {
         conn->registerMonitor(this);
 }
 
-void CommsDebugWindow::monitorInput(InputPacketState state,
-                                    std::vector<uint8_t> const &bytes) {
-    RawDecodePacketInfo pi;
-    pi.time = QDateTime::currentDateTime();
-    pi.dir = RawDecodePacketInfo::MasterToSlave;
-    pi.raw = bytes;
-
-    DecodeLocation loc;
-    loc.base = pi.raw.data();
-    loc.begin = 0;
-    loc.end = pi.raw.size();
-    rawDecoder->decodePacket(pi, loc);
-
-    insertpackets.push_back(pi);
+void CommsDebugWindow::stageBytes(RawDecodePacketInfo::Direction dir,
+                                  uint8_t const *bytes, size_t size,
+                                  Timestamp time) {
+    StagedBytes sb;
+    sb.dir = dir;
+    sb.offset = stagedbytes.size();
+    sb.size = size;
+    sb.time = time;
+    stagedbytes.insert(stagedbytes.end(), bytes, bytes + size);
+    staged.push_back(sb);
 
     if(!insertTimer->isActive())
         insertTimer->start();
 }
 
-void CommsDebugWindow::monitorOutput(OutputPacketState state,
-                                     std::vector<uint8_t> const &bytes) {
-    RawDecodePacketInfo pi;
-    pi.time = QDateTime::currentDateTime();
-    pi.dir = RawDecodePacketInfo::SlaveToMaster;
-    pi.raw = bytes;
-
-    DecodeLocation loc;
-    loc.base = pi.raw.data();
-    loc.begin = 0;
-    loc.end = pi.raw.size();
-    rawDecoder->decodePacket(pi, loc);
-
-    insertpackets.push_back(pi);
-
-    if(!insertTimer->isActive())
-        insertTimer->start();
+void CommsDebugWindow::flushStaged() {
+    //the monitor timestamps are from the monotonic clock
+    QDateTime now = QDateTime::currentDateTime();
+    Timestamp steadynow = std::chrono::steady_clock::now();
+
+    packetlistmodel->beforeAddPackets();
+    for(auto &sb : staged) {
+        RawDecodePacketInfo pi;
+        pi.time = now.addMSecs(-std::chrono::duration_cast<std::chrono::milliseconds>
+                               (steadynow - sb.time).count());
+        pi.dir = sb.dir;
+        pi.raw.assign(stagedbytes.begin() + sb.offset,
+                      stagedbytes.begin() + sb.offset + sb.size);
+
+        DecodeLocation loc;
+        loc.base = pi.raw.data();
+        loc.begin = 0;
+        loc.end = pi.raw.size();
+        rawDecoder->decodePacket(pi, loc);
+
+        packets.push_back(std::move(pi));
+    }
+    packetlistmodel->afterAddPackets();
+    staged.clear();
+    stagedbytes.clear();
 }
 
+void CommsDebugWindow::monitorInput(InputPacketState state,
+                                    uint8_t const *bytes, size_t size,
+                                    Timestamp time) {
+    stageBytes(RawDecodePacketInfo::MasterToSlave, bytes, size, time);
+}
 
+void CommsDebugWindow::monitorOutput(OutputPacketState state,
+                                     uint8_t const *bytes, size_t size,
+                                     Timestamp time) {
+    stageBytes(RawDecodePacketInfo::SlaveToMaster, bytes, size, time);
+}
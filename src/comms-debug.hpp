@@ -117,7 +117,19 @@ class CommsDebugWindow : public QDockWidget, public HX20SerialMonitor {
     Q_OBJECT;
 private:
     std::deque<RawDecodePacketInfo> packets;
-    std::deque<RawDecodePacketInfo> insertpackets;
+    //the monitor callbacks only copy the bytes here, decoding happens
+    //when insertTimer fires. Both keep their capacity between flushes.
+    struct StagedBytes {
+        RawDecodePacketInfo::Direction dir;
+        size_t offset;
+        size_t size;
+        Timestamp time;
+    };
+    std::vector<uint8_t> stagedbytes;
+    std::vector<StagedBytes> staged;
+    void stageBytes(RawDecodePacketInfo::Direction dir,
+                    uint8_t const *bytes, size_t size, Timestamp time);
+    void flushStaged();
     HX20SerialConnection *conn;
     bool scrollToNewest;
 
@@ -134,9 +146,11 @@ protected:
     virtual void showEvent(QShowEvent *event) override;
 
     virtual void monitorInput(InputPacketState state,
-                              std::vector<uint8_t> const &bytes) override;
+                              uint8_t const *bytes, size_t size,
+                              Timestamp time) override;
     virtual void monitorOutput(OutputPacketState state,
-                               std::vector<uint8_t> const &bytes) override;
+                               uint8_t const *bytes, size_t size,
+                               Timestamp time) override;
 
 public:
     CommsDebugWindow(QWidget *parent = nullptr, Qt::WindowFlags f = Qt::WindowFlags());
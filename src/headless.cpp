@@ -0,0 +1,157 @@
+#include "headless.hpp"
+#include "mainwindow.hpp"
+#include "settings.hpp"
+#include "hx20-reactor.hpp"
+#include "calibrate.hpp"
+#include "hx20-ser-proto.hpp"
+#include "hx20-devices/crt/hx20-crt-dev.hpp"
+#include "hx20-devices/disk/hx20-disk-dev.hpp"
+
+#include <stdio.h>
+#include <signal.h>
+#include <string.h>
+#include <stdexcept>
+
+#include <QSettings>
+#include <QStringList>
+#include <QTemporaryDir>
+
+HeadlessLink HeadlessLink::parse(QString const &spec) {
+    HeadlessLink link;
+    QStringList parts = spec.split(',');
+    link.device = parts.takeFirst();
+    if(link.device.isEmpty())
+        throw std::runtime_error("Link without a device");
+    for(auto &p : parts) {
+        int eq = p.indexOf('=');
+        QString key = p.left(eq);
+        QString value = eq < 0 ? QString() : p.mid(eq+1);
+        if(eq < 0 || value.isEmpty())
+            throw std::runtime_error(("Missing value for " + key).toStdString());
+        if(key.size() == 5 && key.startsWith("disk") &&
+                key[4] >= '1' && key[4] <= '4')
+            link.disks[key[4].toLatin1() - '1'] = value;
+        else if(key == "capture")
+            link.capture = value;
+        else if(key == "bridge")
+            link.bridge = value;
+        else
+            throw std::runtime_error(("Unknown link option " + key).toStdString());
+    }
+    return link;
+}
+
+namespace {
+
+struct Link {
+    QString device;
+    std::unique_ptr<HX20CrtDevice> crt_dev;
+    std::array<std::unique_ptr<HX20DiskDevice>, 2> disk_devs;
+    std::unique_ptr<HX20SerialConnection> conn;
+    bool failed;
+};
+
+HX20Reactor *runningReactor;
+
+void stopReactor(int) {
+    if(runningReactor)
+        runningReactor->stop();
+}
+
+void printLinkStats(Link const &link) {
+    HX20LinkStats stats = link.conn->linkStats().snapshot();
+    HX20LinkCounters const &c = stats.total.counters;
+    HdrHistogram const &r = stats.total.responseLatency;
+    printf("%s: %llu packets in, %llu out, %llu naks, %llu timeouts, "
+           "%llu failures, response p50 %llu us, p99 %llu us%s\n",
+           link.device.toLocal8Bit().constData(),
+           (unsigned long long)c.packetsReceived,
+           (unsigned long long)c.packetsSent,
+           (unsigned long long)c.naks,
+           (unsigned long long)c.timeouts,
+           (unsigned long long)c.failures,
+           (unsigned long long)r.percentile(0.5),
+           (unsigned long long)r.percentile(0.99),
+           link.failed ? ", failed" : "");
+}
+
+}
+
+int runHeadless(std::vector<HeadlessLink> const &configs) {
+    //the devices keep their configuration in Settings. Headless links
+    //start from the defaults every time and share the presets.
+    QTemporaryDir settingsDir;
+    if(!settingsDir.isValid())
+        throw std::runtime_error("Could not create a directory for the settings");
+    QSettings settings(settingsDir.filePath("headless.ini"), QSettings::IniFormat);
+    Settings::Container settingsContainer(settings);
+    Settings::Group settingsRoot(settingsContainer);
+    Settings::Group *settingsPresetRoot = settingsRoot.group("Presets");
+    //except for the serial port tunings saved by --calibrate
+    QSettings userSettings(QSettings::Scope::UserScope);
+    Settings::Container userSettingsContainer(userSettings);
+    Settings::Group userSettingsRoot(userSettingsContainer);
+
+    HX20Reactor reactor;
+    std::vector<std::unique_ptr<Link> > links;
+    for(size_t i = 0; i < configs.size(); i++) {
+        HeadlessLink const &cfg = configs[i];
+        Settings::Group *config = settingsRoot.array("Link", i);
+
+        auto link = std::make_unique<Link>();
+        link->device = cfg.device;
+        link->failed = false;
+        link->crt_dev = std::make_unique<HX20CrtDevice>();
+        link->crt_dev->setSettings(config->group("crt_dev"),
+                                   settingsPresetRoot->group("crt_dev"));
+        for(int d = 0; d < 2; d++) {
+            link->disk_devs[d] = std::make_unique<HX20DiskDevice>(d);
+            link->disk_devs[d]->setSettings(config->group(QString("disk_dev%1").arg(d+1)),
+                                            settingsPresetRoot->group("disk_dev"));
+        }
+        for(int d = 0; d < 4; d++) {
+            if(!cfg.disks[d].isEmpty())
+                MainWindow::setupDrive(link->disk_devs[d / 2], d % 2 + 1, cfg.disks[d]);
+        }
+
+        link->conn = std::make_unique<HX20SerialConnection>(
+                     openTunedTransport(&userSettingsRoot, cfg.device));
+        link->conn->registerDevice(link->crt_dev.get());
+        for(auto &dd : link->disk_devs)
+            link->conn->registerDevice(dd.get());
+        if(!cfg.bridge.isEmpty())
+            link->conn->setBridge(HX20Transport::open(cfg.bridge.toLocal8Bit().data()));
+        if(!cfg.capture.isEmpty())
+            link->conn->startCapture(cfg.capture.toLocal8Bit().data());
+
+        Link *l = link.get();
+        reactor.addConnection(link->conn.get(), [l]() {
+            fprintf(stderr, "%s: IO on the connection failed, dropping it\n",
+                    l->device.toLocal8Bit().constData());
+            l->failed = true;
+        });
+        links.push_back(std::move(link));
+    }
+
+    runningReactor = &reactor;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stopReactor;
+    sigemptyset(&sa.sa_mask);
+    struct sigaction oldInt, oldTerm;
+    sigaction(SIGINT, &sa, &oldInt);
+    sigaction(SIGTERM, &sa, &oldTerm);
+
+    reactor.run();
+
+    sigaction(SIGINT, &oldInt, nullptr);
+    sigaction(SIGTERM, &oldTerm, nullptr);
+    runningReactor = nullptr;
+
+    bool anyFailed = false;
+    for(auto &link : links) {
+        printLinkStats(*link);
+        anyFailed |= link->failed;
+    }
+    return anyFailed ? 1 : 0;
+}
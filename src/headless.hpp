@@ -0,0 +1,24 @@
+#pragma once
+
+#include <QString>
+#include <array>
+#include <vector>
+
+/* One hx-20 served in headless mode: its connection and the disks for
+ * the two emulated disk devices, same forms as --disk1 and friends.
+ */
+struct HeadlessLink {
+    QString device;
+    std::array<QString, 4> disks;
+    QString capture;
+    QString bridge;
+    //<device>[,disk1=<disk>]...[,disk4=<disk>][,capture=<file>][,bridge=<device>]
+    static HeadlessLink parse(QString const &spec);
+};
+
+/* Runs a crt and two disk devices for each of the links, without any
+ * windows, all of them from one thread with one HX20Reactor. Needs a
+ * QApplication for the devices, but not its event loop. Returns when
+ * interrupted or when all links have failed.
+ */
+int runHeadless(std::vector<HeadlessLink> const &links);
@@ -0,0 +1,187 @@
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fstream>
+#include <iterator>
+#include <algorithm>
+#include <stdexcept>
+
+#include "hx20-capture.hpp"
+#include "hx20-ser-proto.hpp"
+
+static const char captureMagic[8] = { 'H', 'X', '2', '0', 'C', 'A', 'P', 1 };
+
+HX20CaptureWriter::HX20CaptureWriter(std::string const &path) {
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if(fd == -1)
+        throw IOError(errno, std::system_category(), "Could not open capture file");
+    buffer.reserve(65536 + 32);
+    buffer.insert(buffer.end(), captureMagic, captureMagic + sizeof(captureMagic));
+    last = std::chrono::steady_clock::now();
+}
+
+HX20CaptureWriter::~HX20CaptureWriter() {
+    flush();
+    close(fd);
+}
+
+void HX20CaptureWriter::putVarint(uint64_t v) {
+    while(v >= 0x80) {
+        buffer.push_back(v | 0x80);
+        v >>= 7;
+    }
+    buffer.push_back(v);
+}
+
+void HX20CaptureWriter::record(HX20CaptureDirection dir,
+                               uint8_t const *bytes, size_t size,
+                               std::chrono::steady_clock::time_point time) {
+    if(size == 0)
+        return;
+    uint64_t delta = 0;
+    if(time > last)
+        delta = std::chrono::duration_cast<std::chrono::nanoseconds>(time - last).count();
+    last = time;
+    putVarint(delta << 1 | (uint64_t)dir);
+    putVarint(size);
+    buffer.insert(buffer.end(), bytes, bytes + size);
+    if(buffer.size() >= 65536)
+        flush();
+}
+
+//a capture cut short by a failing disk is still useful, so errors only
+//end the writing.
+void HX20CaptureWriter::flush() {
+    size_t pos = 0;
+    while(pos < buffer.size()) {
+        ssize_t res = write(fd, buffer.data() + pos, buffer.size() - pos);
+        if(res < 0) {
+            if(errno == EINTR)
+                continue;
+            break;
+        }
+        pos += res;
+    }
+    buffer.clear();
+}
+
+static bool getVarint(std::vector<uint8_t> const &in, size_t &pos, uint64_t &v) {
+    v = 0;
+    for(int shift = 0; shift < 64; shift += 7) {
+        if(pos >= in.size())
+            return false;
+        uint8_t b = in[pos++];
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if(!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+HX20CaptureReader::HX20CaptureReader(std::string const &path) {
+    std::ifstream f(path, std::ios::binary);
+    if(!f)
+        throw IOError(errno, std::system_category(), "Could not open capture file");
+    std::vector<uint8_t> file((std::istreambuf_iterator<char>(f)),
+                              std::istreambuf_iterator<char>());
+    if(file.size() < sizeof(captureMagic) ||
+            memcmp(file.data(), captureMagic, sizeof(captureMagic)) != 0)
+        throw std::runtime_error("Not a capture file");
+
+    size_t pos = sizeof(captureMagic);
+    uint64_t time = 0;
+    while(pos < file.size()) {
+        uint64_t tagged, size;
+        if(!getVarint(file, pos, tagged) || !getVarint(file, pos, size) ||
+                size > file.size() - pos)
+            break;//truncated, keep what we have
+        time += tagged >> 1;
+        HX20CaptureRecord r;
+        r.dir = (tagged & 1) ? HX20CaptureDirection::ToHX20 : HX20CaptureDirection::FromHX20;
+        r.timeNs = time;
+        r.offset = data.size();
+        r.size = size;
+        data.insert(data.end(), file.begin() + pos, file.begin() + pos + size);
+        records.push_back(r);
+        pos += size;
+    }
+}
+
+ssize_t HX20ReplayTransport::readv(struct iovec const *iov, int iovcnt) {
+    errno = EAGAIN;
+    return -1;
+}
+
+ssize_t HX20ReplayTransport::write(uint8_t const *buf, size_t size) {
+    sent.insert(sent.end(), buf, buf + size);
+    return size;
+}
+
+std::string HX20ReplayTransport::description() const {
+    return "replay";
+}
+
+HX20ReplayResult replayCapture(HX20CaptureReader const &capture,
+                               HX20SerialConnection &conn,
+                               HX20ReplayTransport &transport) {
+    HX20ReplayResult res;
+    res.inputBytes = 0;
+    res.firstMismatch = -1;
+    res.mismatchRecord = -1;
+    res.ioError = false;
+
+    std::vector<uint8_t> expected;
+    size_t checked = 0;
+    auto compare = [&](int64_t record) {
+        size_t n = std::min(expected.size(), transport.sent.size());
+        for(; checked < n; checked++) {
+            if(expected[checked] != transport.sent[checked]) {
+                res.firstMismatch = checked;
+                res.mismatchRecord = record;
+                return;
+            }
+        }
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    for(size_t i = 0; i < capture.records.size(); i++) {
+        HX20CaptureRecord const &r = capture.records[i];
+        uint8_t const *bytes = capture.data.data() + r.offset;
+        if(r.dir == HX20CaptureDirection::ToHX20) {
+            expected.insert(expected.end(), bytes, bytes + r.size);
+            continue;
+        }
+        //our side is synchronous, so the responses to everything fed
+        //so far are complete. If some are missing, the capture went on
+        //after a timeout.
+        if(transport.sent.size() < expected.size() &&
+                conn.forceTimeout() < 0) {
+            res.ioError = true;
+            break;
+        }
+        if(res.firstMismatch < 0)
+            compare(i);
+        res.inputBytes += r.size;
+        if(conn.feedBytes(bytes, r.size) < 0) {
+            res.ioError = true;
+            break;
+        }
+    }
+    res.seconds = std::chrono::duration<double>(
+                  std::chrono::steady_clock::now() - start).count();
+
+    if(res.firstMismatch < 0) {
+        compare(capture.records.size());
+        if(res.firstMismatch < 0 && expected.size() != transport.sent.size()) {
+            res.firstMismatch = checked;
+            res.mismatchRecord = capture.records.size();
+        }
+    }
+    res.expectedBytes = expected.size();
+    res.sentBytes = transport.sent.size();
+    return res;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdint.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "hx20-transport.hpp"
+
+class HX20SerialConnection;
+
+/* Capture files start with the magic "HX20CAP" and a version byte,
+ * followed by records of
+ *   varint: nanoseconds since the previous record << 1 | direction
+ *   varint: number of bytes
+ *   the bytes
+ * Varints are 7 bits per byte, least significant first, with bit 7 set
+ * on all but the last byte.
+ */
+enum class HX20CaptureDirection {
+    FromHX20 = 0,
+    ToHX20 = 1
+};
+
+class HX20CaptureWriter {
+private:
+    int fd;
+    std::vector<uint8_t> buffer;
+    std::chrono::steady_clock::time_point last;
+    void putVarint(uint64_t v);
+public:
+    HX20CaptureWriter(std::string const &path);
+    ~HX20CaptureWriter();
+    void record(HX20CaptureDirection dir, uint8_t const *bytes, size_t size,
+                std::chrono::steady_clock::time_point time);
+    void flush();
+};
+
+struct HX20CaptureRecord {
+    HX20CaptureDirection dir;
+    //since the start of the capture
+    uint64_t timeNs;
+    size_t offset;//into HX20CaptureReader::data
+    size_t size;
+};
+
+class HX20CaptureReader {
+public:
+    std::vector<uint8_t> data;
+    std::vector<HX20CaptureRecord> records;
+    HX20CaptureReader(std::string const &path);
+};
+
+//collects what the connection sends during a replay, never has input
+class HX20ReplayTransport : public HX20Transport {
+public:
+    std::vector<uint8_t> sent;
+    virtual ssize_t readv(struct iovec const *iov, int iovcnt) override;
+    virtual ssize_t write(uint8_t const *buf, size_t size) override;
+    virtual std::string description() const override;
+};
+
+struct HX20ReplayResult {
+    uint64_t inputBytes;
+    uint64_t expectedBytes;
+    uint64_t sentBytes;
+    //offset into the sent bytes of the first difference, and the capture
+    //record the input was at. Both are -1 when the responses matched.
+    int64_t firstMismatch;
+    int64_t mismatchRecord;
+    double seconds;
+    bool ioError;
+};
+
+/* Feeds the bytes the hx-20 sent in the capture into conn, as fast as
+ * possible, and compares everything conn sends through transport with
+ * the capture. conn must not run its own thread. Where the capture has
+ * more responses than conn sent, the retry timeout is assumed to have
+ * expired.
+ */
+HX20ReplayResult replayCapture(HX20CaptureReader const &capture,
+                               HX20SerialConnection &conn,
+                               HX20ReplayTransport &transport);
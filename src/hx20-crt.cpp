@@ -2,8 +2,15 @@
 #include <QApplication>
 #include <QCommandLineParser>
 #include <QCommandLineOption>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
 
 #include "mainwindow.hpp"
+#include "hx20-trace.hpp"
+#include "headless.hpp"
+#include "calibrate.hpp"
+#include "settings.hpp"
 
 int main(int argc, char **argv) {
 //    Q_INIT_RESOURCE(application);
@@ -11,6 +18,12 @@ int main(int argc, char **argv) {
     QApplication::setAttribute(Qt::AA_EnableHighDpiScaling);
 #endif
 
+    //the devices need widgets, but headless there is nothing to show them on
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--headless") == 0 && !getenv("QT_QPA_PLATFORM"))
+            setenv("QT_QPA_PLATFORM", "offscreen", 1);
+    }
+
     QApplication app(argc, argv);
     QCoreApplication::setOrganizationName("Pirsoft.de");
     QCoreApplication::setOrganizationDomain("pirsoft.de");
@@ -21,16 +34,84 @@ int main(int argc, char **argv) {
     parser.setApplicationDescription(QCoreApplication::applicationName());
     parser.addHelpOption();
     parser.addVersionOption();
-    parser.addOption(QCommandLineOption("device", "Use <device> for communication.", "device"));
+    parser.addOption(QCommandLineOption("device", "Use <device> for communication. Either a tty path or one of tty://<path>, pty://[<link>], unix://<path>, tcp://<host>:<port>.", "device"));
     parser.addOption(QCommandLineOption("disk1", "Use <directory> for the first disk drive.", "directory"));
     parser.addOption(QCommandLineOption("disk2", "Use <directory> for the second disk drive.", "directory"));
     parser.addOption(QCommandLineOption("disk3", "Use <directory> for the third disk drive.", "directory"));
     parser.addOption(QCommandLineOption("disk4", "Use <directory> for the fourth disk drive.", "directory"));
+    parser.addOption(QCommandLineOption("capture", "Capture all bytes going over the connection to <file>.", "file"));
+    parser.addOption(QCommandLineOption("bridge", "Pass packets for device ids without an emulated device on to the real device at <device>, same forms as --device.", "device"));
+    parser.addOption(QCommandLineOption("replay", "Replay <capture> through the devices without a connection, check the responses and exit. Combine with -platform offscreen to run headless.", "capture"));
+    parser.addOption(QCommandLineOption("trace", "Trace what the protocol and the devices do at the levels in <spec>, e.g. \"info,disk=debug\". Categories are proto, crt, disk and drive, levels error, warning, info, debug and verbose. Overrides the HX20_TRACE environment variable.", "spec"));
+    parser.addOption(QCommandLineOption("headless", "Run without windows, serving --device and every --link from one thread until interrupted."));
+    parser.addOption(QCommandLineOption("link", "With --headless, serve another hx-20 as described by <spec>: <device>[,disk1=<disk>]...[,disk4=<disk>][,capture=<file>][,bridge=<device>]. Disks are given like for --disk1, rofile://<image> shares one read-only copy of the image between all links using it.", "spec"));
+    parser.addOption(QCommandLineOption("calibrate", "Measure the round trip latency through the serial port --device under the low latency and FTDI latency timer settings it supports, then exit. Needs a loopback plug or --calibrate-echo."));
+    parser.addOption(QCommandLineOption("calibrate-echo", "With --calibrate, echo everything through <device>, the other end of a null modem cable from --device, instead of a loopback plug.", "device"));
+    parser.addOption(QCommandLineOption("calibrate-rounds", "With --calibrate, measure <n> round trips per setting, default 100.", "n"));
+    parser.addOption(QCommandLineOption("calibrate-save", "With --calibrate, keep the best settings for the port, to be applied whenever it is connected."));
     parser.addOption(QCommandLineOption("config", "Use <config> As configuration set. The other command line options override any option from the configuration set.", "config"));
     parser.process(app);
 
     setlocale(LC_NUMERIC, "C");
 
+    if(parser.isSet("trace") &&
+            !HX20Trace::configure(parser.value("trace").toLocal8Bit().constData())) {
+        fprintf(stderr, "Invalid trace specification \"%s\"\n",
+                parser.value("trace").toLocal8Bit().constData());
+        return 1;
+    }
+
+    if(parser.isSet("calibrate")) {
+        if(!parser.isSet("device")) {
+            fprintf(stderr, "Calibration needs --device\n");
+            return 1;
+        }
+        CalibrationOptions options;
+        options.device = parser.value("device");
+        options.echo = parser.value("calibrate-echo");
+        if(parser.isSet("calibrate-rounds"))
+            options.rounds = parser.value("calibrate-rounds").toInt();
+        if(options.rounds <= 0) {
+            fprintf(stderr, "Invalid number of calibration rounds\n");
+            return 1;
+        }
+        options.save = parser.isSet("calibrate-save");
+        QSettings settings(QSettings::Scope::UserScope);
+        Settings::Container settingsContainer(settings);
+        Settings::Group settingsRoot(settingsContainer);
+        try {
+            return runCalibration(&settingsRoot, options);
+        } catch(std::exception &e) {
+            fprintf(stderr, "Calibration failed: %s\n", e.what());
+            return 1;
+        }
+    }
+
+    if(parser.isSet("headless")) {
+        try {
+            std::vector<HeadlessLink> links;
+            if(parser.isSet("device")) {
+                HeadlessLink link;
+                link.device = parser.value("device");
+                for(int d = 0; d < 4; d++)
+                    link.disks[d] = parser.value(QString("disk%1").arg(d+1));
+                link.capture = parser.value("capture");
+                link.bridge = parser.value("bridge");
+                links.push_back(link);
+            }
+            for(auto &spec : parser.values("link"))
+                links.push_back(HeadlessLink::parse(spec));
+            if(links.empty()) {
+                fprintf(stderr, "Headless mode needs --device or --link\n");
+                return 1;
+            }
+            return runHeadless(links);
+        } catch(std::exception &e) {
+            fprintf(stderr, "Headless mode failed: %s\n", e.what());
+            return 1;
+        }
+    }
+
     MainWindow mainWin;
 
     if(parser.isSet("config")) {
@@ -56,6 +137,19 @@ int main(int argc, char **argv) {
         mainWin.setDiskFromCommandline(1,2,parser.value("disk4"));
     }
 
+    if(parser.isSet("replay")) {
+        try {
+            return mainWin.replayCapture(parser.value("replay"));
+        } catch(std::exception &e) {
+            fprintf(stderr, "Replay failed: %s\n", e.what());
+            return 1;
+        }
+    }
+    if(parser.isSet("capture"))
+        mainWin.capture_file = parser.value("capture");
+    if(parser.isSet("bridge"))
+        mainWin.bridge_device = parser.value("bridge");
+
     //if a device is supplied use that, now that the configuration is complete
     //otherwise, use the one from the configuration
     if(parser.isSet("device")) {
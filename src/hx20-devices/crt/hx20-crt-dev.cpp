@@ -1,24 +1,34 @@
 
 #include "hx20-crt-dev.hpp"
 
-#include <QTextEdit>
+#include <string.h>
+#include <algorithm>
+
 #include <QMainWindow>
+#include <QAction>
+#include <QApplication>
+#include <QClipboard>
+#include <QPaintEvent>
 #include <QDockWidget>
 #include <QPainter>
+#include <QTimer>
+#include <QVector>
 #include <QMenu>
 #include "../../dockwidgettitlebar.hpp"
 #include "hx20-crt-dev-gfx-cfg.hpp"
 #include "hx20-crt-dev-text-cfg.hpp"
+#include "hx20-crt-expand.hpp"
 #include "../../settings.hpp"
+#include "../../hx20-trace.hpp"
 
 HX20CrtGraphicsView::HX20CrtGraphicsView(QWidget *parent, Qt::WindowFlags f)
     : QWidget(parent, f), width(128), height(96), zoom(1.0) {
-    image = std::make_unique<QImage>(width, height, QImage::Format::Format_RGB32);
     image_data.resize(width * height);
     border_color = qRgb(0,0,0);
     //this is a color map for background colors;
     //depending on the color set, this would use either the first or the
     //second half for pixels.
+    color_map.fill(qRgb(0,0,0));
     color_map[0] = qRgb(0x00, 0xff, 0x00);
     color_map[1] = qRgb(0xff, 0xff, 0x00);
     color_map[2] = qRgb(0x00, 0x00, 0xff);
@@ -27,131 +37,303 @@ HX20CrtGraphicsView::HX20CrtGraphicsView(QWidget *parent, Qt::WindowFlags f)
     color_map[5] = qRgb(0x00, 0xff, 0xff);
     color_map[6] = qRgb(0xff, 0x00, 0xff);
     color_map[7] = qRgb(0xff, 0x7f, 0x00);
+    makeImage();
 }
 
 HX20CrtGraphicsView::~HX20CrtGraphicsView() =default;
 
-void HX20CrtGraphicsView::updateImage() {
-    if(width != image->width() || height != image->height()) {
-        image = std::make_unique<QImage>(width, height, QImage::Format::Format_RGB32);
-        if(image_data.size() < (unsigned)(width * height))
-            image_data.resize(width * height);
-    }
-    for(int y = 0; y < height; y++) {
-        QRgb *line_ptr = reinterpret_cast<QRgb *>(image->scanLine(y));
-        for(int x = 0; x < width; x++) {
-            *line_ptr = color_map[image_data[x+y*width]];
-            line_ptr++;
-        }
-    }
+//image paints straight from image_data through color_map, it has to be
+//made again whenever image_data moves
+void HX20CrtGraphicsView::makeImage() {
+    image = std::make_unique<QImage>(image_data.data(), width, height, width,
+                                     QImage::Format::Format_Indexed8);
+    image->setColorTable(QVector<QRgb>(color_map.begin(), color_map.end()));
+}
+
+//only the table changes, the pixels are looked up again when painted
+void HX20CrtGraphicsView::updateColors() {
+    image->setColorTable(QVector<QRgb>(color_map.begin(), color_map.end()));
     update();
 }
 
-void HX20CrtGraphicsView::paintEvent(QPaintEvent *event) {
-    QPainter p(this);
-    p.fillRect(rect(), border_color);
+void HX20CrtGraphicsView::markDirty(QRect const &r) {
+    dirty |= r & QRect(0, 0, width, height);
+}
+
+//the largest whole multiple of the image that fits, in device pixels
+int HX20CrtGraphicsView::frameScale() const {
+    qreal dpr = devicePixelRatioF();
+    int scale = std::min(int(rect().width() * dpr) / width,
+                         int(rect().height() * dpr) / height);
+    return std::max(1, scale);
+}
+
+//where the image ends up in the widget
+QRect HX20CrtGraphicsView::imageRect() const {
     QRect dst = image->rect();
     dst.setWidth(dst.width()*zoom);
     dst.setHeight(dst.height()*zoom);
     dst.moveCenter(rect().center());
-    p.drawImage(dst, *image.get());
+    return dst;
+}
+
+void HX20CrtGraphicsView::updateImage() {
+    if(image_data.size() < (unsigned)(width * height))
+        image_data.resize(width * height);
+    if(width != image->width() || height != image->height() ||
+            image->constBits() != image_data.data()) {
+        makeImage();
+        zoom = frameScale() / devicePixelRatioF();
+        dirty = QRect();
+        update();
+        return;
+    }
+    if(dirty.isEmpty())
+        return;
+    QRect dst = imageRect();
+    //rounded outwards, the scaled pixels need not fall on whole ones
+    update(QRect(dst.left() + int(dirty.left() * zoom) - 1,
+                 dst.top() + int(dirty.top() * zoom) - 1,
+                 int(dirty.width() * zoom) + 3,
+                 int(dirty.height() * zoom) + 3));
+    dirty = QRect();
+}
+
+/* The repainted part of image is expanded at the whole zoom factor and
+ * copied 1:1, a strip of rows at a time. Nothing scaled is kept between
+ * paints, so image_data stays the only copy of the pixels and a colour
+ * set change costs no more than repainting what is visible.
+ */
+void HX20CrtGraphicsView::paintEvent(QPaintEvent *event) {
+    int scale = frameScale();
+    qreal dpr = devicePixelRatioF();
+    zoom = scale / dpr;
+    QPainter p(this);
+    QRect dst = imageRect();
+    if(!dst.contains(event->rect()))
+        p.fillRect(event->rect(), border_color);
+    QRect part = event->rect() & dst;
+    if(part.isEmpty())
+        return;
+    //the image pixels under part, rounded outwards
+    QRect src(QPoint(int((part.left() - dst.left()) / zoom),
+                     int((part.top() - dst.top()) / zoom)),
+              QPoint(int((part.right() - dst.left()) / zoom),
+                     int((part.bottom() - dst.top()) / zoom)));
+    src &= QRect(0, 0, width, height);
+    if(src.isEmpty())
+        return;
+    int rows = std::min(src.height(), 16);
+    QImage strip(src.width() * scale, rows * scale, QImage::Format::Format_RGB32);
+    strip.setDevicePixelRatio(dpr);
+    int x = src.left();
+    int count = src.width();
+    for(int top = src.top(); top <= src.bottom(); top += rows) {
+        int n = std::min(rows, src.bottom() + 1 - top);
+        for(int y = 0; y < n; y++) {
+            uint32_t *row = reinterpret_cast<uint32_t *>(strip.scanLine(y * scale));
+            expandPixels(row, &image_data[x + (top + y) * width], count, scale,
+                         color_map.data());
+            for(int i = 1; i < scale; i++)
+                memcpy(strip.scanLine(y * scale + i), row,
+                       count * scale * sizeof(uint32_t));
+        }
+        p.drawImage(QPointF(dst.left() + x * zoom, dst.top() + top * zoom), strip,
+                    QRectF(0, 0, strip.width(), n * scale));
+    }
 }
 
 void HX20CrtGraphicsView::resizeEvent(QResizeEvent *event) {
+    zoom = frameScale() / devicePixelRatioF();
     update();
 }
 
 QSize HX20CrtGraphicsView::sizeHint() const {
-    return image->size();
+    return QSize(width, height);
 }
 
-int HX20CrtDevice::getDeviceID() const {
-    return 0x30;
+HX20CrtTextView::HX20CrtTextView(QWidget *parent, Qt::WindowFlags f)
+    : QWidget(parent, f), columns(0), rows(0), cursor_x(-1), cursor_y(-1),
+      text_colors({QColor(Qt::green), QColor("orange")}),
+      background(Qt::black), border(Qt::black), color_set(0) {
+    QFont textfont = font();
+    textfont.setFamilies({"Courier", "Mono"});
+    textfont.setFixedPitch(true);
+    setFont(textfont);
+    fontChanged();
+    //every pixel is painted, by the cells or the border
+    setAttribute(Qt::WA_OpaquePaintEvent);
+
+    QAction *copy = new QAction(tr("Copy text"), this);
+    connect(copy, &QAction::triggered, this, [this]() {
+        QApplication::clipboard()->setText(text());
+    });
+    addAction(copy);
+    setContextMenuPolicy(Qt::ActionsContextMenu);
 }
 
-//some bresenham, with clipping
-static void
-draw_line(uint8_t *image, int width, int height,
-          int x1, int y1, int x2, int y2, uint8_t color) {
-    int dx = x2 - x1;
-    int dy = y2 - y1;
-    int px = x1;
-    int py = y1;
-    if(dx > dy) {
-        if(dx < 0) {
-            px += dx;
-            dx = -dx;
-            py += dy;
-            dy = -dy;
-        }
-        int end = px + dx + 1;
-        if(end > width)
-            end = width;
-        int frac = dx / 2;
-        while((px < 0 || py >= height || py < 0) &&
-                px != end) {
-            frac += dy;
-            if(frac > dx) {
-                frac -= dx;
-                py++;
-            }
-            if(frac < 0) {
-                frac += dx;
-                py--;
-            }
-            px++;
-        }
-        while(px != end && py >= 0 && py < height) {
-            image[px+py*width] = color;
-            frac += dy;
-            if(frac > dx) {
-                frac -= dx;
-                py++;
-            }
-            if(frac < 0) {
-                frac += dx;
-                py--;
-            }
-            px++;
-        }
-    } else {
-        if(dy < 0) {
-            px += dx;
-            dx = -dx;
-            py += dy;
-            dy = -dy;
-        }
-        int end = py + dy + 1;
-        if(end > height)
-            end = height;
-        int frac = dy / 2;
-        while((py < 0 || px >= width || px < 0) &&
-                py != end) {
-            frac += dx;
-            if(frac > dy) {
-                frac -= dy;
-                px++;
-            }
-            if(frac < 0) {
-                frac += dy;
-                px--;
-            }
-            py++;
-        }
-        while(py != end && px >= 0 && px < width) {
-            image[px+py*width] = color;
-            frac += dx;
-            if(frac > dy) {
-                frac -= dy;
-                px++;
-            }
-            if(frac < 0) {
-                frac += dy;
-                px--;
-            }
-            py++;
+HX20CrtTextView::~HX20CrtTextView() =default;
+
+void HX20CrtTextView::fontChanged() {
+    QFontMetrics fm(font());
+    cell = QSize(fm.horizontalAdvance('M'), fm.height());
+    atlas = std::array<QImage, 2>();
+    updateGeometry();
+    update();
+}
+
+//the grid is centered, the border color fills the rest
+QPoint HX20CrtTextView::origin() const {
+    return QPoint((width() - columns * cell.width()) / 2,
+                  (height() - rows * cell.height()) / 2);
+}
+
+QRect HX20CrtTextView::cellRect(int x, int y) const {
+    return QRect(origin() + QPoint(x * cell.width(), y * cell.height()), cell);
+}
+
+void HX20CrtTextView::updateCell(int x, int y) {
+    if(x >= 0 && x < columns && y >= 0 && y < rows)
+        update(cellRect(x, y));
+}
+
+QImage const &HX20CrtTextView::glyphs() {
+    QImage &img = atlas[color_set];
+    qreal dpr = devicePixelRatioF();
+    if(!img.isNull() && img.devicePixelRatio() == dpr)
+        return img;
+    img = QImage(QSize(16 * cell.width(), 16 * cell.height()) * dpr,
+                 QImage::Format_ARGB32_Premultiplied);
+    img.setDevicePixelRatio(dpr);
+    img.fill(background);
+    QPainter p(&img);
+    p.setFont(font());
+    p.setPen(text_colors[color_set]);
+    for(int i = 0; i < 256; i++) {
+        QRect r(QPoint((i % 16) * cell.width(), (i / 16) * cell.height()), cell);
+        p.drawText(r, Qt::AlignCenter, char_map[i]);
+    }
+    return img;
+}
+
+void HX20CrtTextView::setCharMap(std::array<QString, 256> const &map) {
+    if(map == char_map)
+        return;
+    char_map = map;
+    atlas = std::array<QImage, 2>();
+    update();
+}
+
+void HX20CrtTextView::setColors(QColor const &color1, QColor const &color2,
+                                QColor const &background, QColor const &border) {
+    if(color1 == text_colors[0] && color2 == text_colors[1] &&
+            background == this->background && border == this->border)
+        return;
+    text_colors = { color1, color2 };
+    this->background = background;
+    this->border = border;
+    atlas = std::array<QImage, 2>();
+    update();
+}
+
+void HX20CrtTextView::setColorSet(int color_set) {
+    //anything but 0 picks the second text colour
+    color_set = (color_set == 0) ? 0 : 1;
+    if(color_set == this->color_set)
+        return;
+    this->color_set = color_set;
+    update();
+}
+
+void HX20CrtTextView::setScreen(uint8_t const *const *lines,
+                                int columns, int rows,
+                                int cursor_x, int cursor_y) {
+    if(columns != this->columns || rows != this->rows) {
+        this->columns = columns;
+        this->rows = rows;
+        cells.resize(columns * rows);
+        for(int y = 0; y < rows; y++)
+            memcpy(&cells[y * columns], lines[y], columns);
+        this->cursor_x = cursor_x;
+        this->cursor_y = cursor_y;
+        updateGeometry();
+        update();
+        return;
+    }
+    for(int y = 0; y < rows; y++) {
+        uint8_t *row = &cells[y * columns];
+        if(memcmp(row, lines[y], columns) == 0)
+            continue;
+        memcpy(row, lines[y], columns);
+        update(QRect(cellRect(0, y).topLeft(), QSize(columns * cell.width(), cell.height())));
+    }
+    if(cursor_x != this->cursor_x || cursor_y != this->cursor_y) {
+        updateCell(this->cursor_x, this->cursor_y);
+        this->cursor_x = cursor_x;
+        this->cursor_y = cursor_y;
+        updateCell(cursor_x, cursor_y);
+    }
+}
+
+QString HX20CrtTextView::text() const {
+    QString res;
+    for(int y = 0; y < rows; y++) {
+        for(int x = 0; x < columns; x++)
+            res += char_map[cells[y * columns + x]];
+        res += '\n';
+    }
+    return res;
+}
+
+QSize HX20CrtTextView::sizeHint() const {
+    return QSize(columns * cell.width(), rows * cell.height());
+}
+
+void HX20CrtTextView::paintEvent(QPaintEvent *event) {
+    QPainter p(this);
+    QRect dirty = event->rect();
+    QPoint o = origin();
+    QRect grid(o, QSize(columns * cell.width(), rows * cell.height()));
+    if(!grid.contains(dirty))
+        p.fillRect(dirty, border);
+    dirty &= grid;
+    if(dirty.isEmpty())
+        return;
+
+    QImage const &g = glyphs();
+    qreal dpr = g.devicePixelRatio();
+    int x0 = (dirty.left() - o.x()) / cell.width();
+    int x1 = (dirty.right() - o.x()) / cell.width();
+    int y0 = (dirty.top() - o.y()) / cell.height();
+    int y1 = (dirty.bottom() - o.y()) / cell.height();
+    for(int y = y0; y <= y1; y++) {
+        for(int x = x0; x <= x1; x++) {
+            uint8_t ch = cells[y * columns + x];
+            QRectF src((ch % 16) * cell.width() * dpr, (ch / 16) * cell.height() * dpr,
+                       cell.width() * dpr, cell.height() * dpr);
+            p.drawImage(cellRect(x, y).topLeft(), g, src);
         }
     }
+    if(cursor_x >= x0 && cursor_x <= x1 && cursor_y >= y0 && cursor_y <= y1) {
+        QRect r = cellRect(cursor_x, cursor_y);
+        int thickness = std::max(1, cell.height() / 12);
+        p.fillRect(QRect(r.left(), r.bottom() - thickness, r.width(), thickness),
+                   text_colors[color_set]);
+    }
+}
+
+void HX20CrtTextView::resizeEvent(QResizeEvent *event) {
+    update();
+}
+
+void HX20CrtTextView::changeEvent(QEvent *event) {
+    if(event->type() == QEvent::FontChange)
+        fontChanged();
+    QWidget::changeEvent(event);
+}
+
+int HX20CrtDevice::getDeviceID() const {
+    return 0x30;
 }
 
 static char const *char_map[256] = {
@@ -535,26 +717,54 @@ static char const *char_map_no[256] = {
 };
 
 void HX20CrtDevice::redrawText() {
-    QString new_text;
-    QColor text_color = ((color_set==0)?text_color_1:text_color_2);
-    new_text += QString("<span style=\"color: %1; background-color: %2;\">").
-                arg(text_color.name()).
-                arg(text_background.name());
-    for(int y = win_y; y < win_y + win_height; y++) {
-        for(int x = win_x; x < win_x + win_width; x++) {
-            if(y == cur_y && x == cur_x) {
-                new_text += "<u>";
-            }
-            uint8_t ch = char_data[y*virt_width+x];
-            new_text += text_char_map[ch].toHtmlEscaped();
-            if(y == cur_y && x == cur_x) {
-                new_text += "</u>";
-            }
+    textview->setColorSet(color_set);
+    //the lines of the virtual screen are not in order in memory
+    uint8_t const *lines[256];
+    int columns = std::max(0, std::min<int>(win_width, virt_width - win_x));
+    int rows = std::max(0, std::min<int>(win_height, virt_height - win_y));
+    for(int y = 0; y < rows; y++)
+        lines[y] = screen.row(win_y + y) + win_x;
+    textview->setScreen(lines, columns, rows, cur_x - win_x, cur_y - win_y);
+}
+
+//changes only mark the screens dirty. They are redrawn at most once a
+//frame, and only once the response is out, with all the changes up to then.
+void HX20CrtDevice::textChanged() {
+    textDirty = true;
+    scheduleFrame();
+}
+
+void HX20CrtDevice::graphicsChanged() {
+    graphicsDirty = true;
+    scheduleFrame();
+}
+
+//image_data moves when the graphics are resized
+void HX20CrtDevice::rasterTarget() {
+    raster.setTarget(graphicsview->image_data.data(), graph_width, graph_height);
+}
+
+void HX20CrtDevice::scheduleFrame() {
+    if(!frameTimer->isActive() && !framePending)
+        frameTimer->start();
+}
+
+void HX20CrtDevice::frameDue() {
+    framePending = true;
+    deferUntilResponded([this]() {
+        framePending = false;
+        if(textDirty) {
+            textDirty = false;
+            redrawText();
         }
-        new_text += "<br>\n";
-    }
-    new_text += "</span>";
-    textview->setText(new_text);
+        if(graphicsDirty) {
+            graphicsDirty = false;
+            int left, top, right, bottom;
+            if(raster.takeDirty(left, top, right, bottom))
+                graphicsview->markDirty(QRect(left, top, right - left, bottom - top));
+            graphicsview->updateImage();
+        }
+    });
 }
 
 bool HX20CrtDevice::windowFollowCursor() {
@@ -604,7 +814,8 @@ bool HX20CrtDevice::windowFollowCursor() {
 void HX20CrtDevice::processCharacter(uint8_t ch) {
     //see tms15-17.pdf: Technical Manual, Section 2: Software,
     // Chapter 15: Virtual screen, 15.4: Virtual Screen Control
-    printf("processing %c(%02x)\n",(char)((ch >= 0x20 && ch < 0x7f)?ch:'?'),(int)ch);
+    HX20_TRACE(Crt, Debug, "processing %c(%02x)\n",
+               (char)((ch >= 0x20 && ch < 0x7f)?ch:'?'), (int)ch);
     switch(ch) {
     case 0x00:
     case 0x02:
@@ -619,16 +830,16 @@ void HX20CrtDevice::processCharacter(uint8_t ch) {
     case 0x18:
     case 0x19:
     case 0x1b:
-        printf("unhandled ctl code %02x\n",(int)ch);
+        HX20_TRACE(Crt, Warning, "unhandled ctl code %02x\n", (int)ch);
         break;
     case 0x01:
         if(win_x != 0) {
             win_x = 0;
             cur_x = 9;
-            redrawText();
+            textChanged();
         } else if(cur_x != 9) {
             cur_x = 9;
-            redrawText();
+            textChanged();
         }
         break;
     case 0x04:
@@ -636,11 +847,11 @@ void HX20CrtDevice::processCharacter(uint8_t ch) {
             win_x += horizontal_scroll_step;
             cur_x = win_x + 9;
             windowFollowCursor();
-            redrawText();
+            textChanged();
         } else if(win_x + win_width < virt_width) {
             win_x = virt_width - win_width;
             cur_x = win_x + 9;
-            redrawText();
+            textChanged();
         }
         break;
     case 0x05: {
@@ -648,43 +859,43 @@ void HX20CrtDevice::processCharacter(uint8_t ch) {
         x = cur_x;
         y = cur_y;
         while(y < virt_height) {
-            char_data[x+y*virt_height] = 0x20;
+            screen.at(x+y*virt_width) = 0x20;
             x++;
             if(x >= virt_width) {
                 y++;
-                if(y >= virt_height || !line_cont[y])
+                if(y >= virt_height || !screen.cont(y))
                     break;
                 x = 0;
             }
         }
         windowFollowCursor();
-        redrawText();
+        textChanged();
         break;
     }
     case 0x06:
         if(win_x + win_width != virt_width && !list_flag) {
             win_x = virt_width - win_width;
             cur_x = win_x + 9;
-            redrawText();
+            textChanged();
         } else if(cur_x != win_x + 9 && !list_flag) {
             cur_x = win_x + 9;
-            redrawText();
+            textChanged();
         }
         break;
     case 0x08: {
-        if(cur_x == 0 && (!line_cont[cur_y] || cur_y == 0))
+        if(cur_x == 0 && (!screen.cont(cur_y) || cur_y == 0))
             cur_x++;
 
         int y;
         y = cur_y;
-        while(y < virt_height && line_cont[y+1]) {
+        while(y < virt_height && screen.cont(y+1)) {
             y++;
         }
-        memmove(&char_data[cur_x-1+cur_y*virt_width],
-                &char_data[cur_x+cur_y*virt_width],
-                virt_width-cur_x+
-                (y-cur_y)*virt_width);
-        char_data[virt_width*(y+1)-1] = 0x20;
+        screen.move(cur_x-1+cur_y*virt_width,
+                    cur_x+cur_y*virt_width,
+                    virt_width-cur_x+
+                    (y-cur_y)*virt_width);
+        screen.at(virt_width*(y+1)-1) = 0x20;
 
         if(cur_x == 0) {
             cur_x = virt_width -1;
@@ -693,7 +904,7 @@ void HX20CrtDevice::processCharacter(uint8_t ch) {
             cur_x--;
 
         windowFollowCursor();
-        redrawText();
+        textChanged();
         break;
     }
     case 0x09: {
@@ -710,22 +921,13 @@ void HX20CrtDevice::processCharacter(uint8_t ch) {
             cur_x = new_x;
         }
         windowFollowCursor();
-        redrawText();
+        textChanged();
         break;
     }
     case 0x0a:
         if(cur_y+1 >= virt_height) {
             cur_y = virt_height - 1;
-            memmove(&char_data[0],&char_data[virt_width],
-                    virt_width*(virt_height-1));
-            memmove(&char_data[0],
-                    &char_data[virt_width],
-                    virt_width*(virt_height - 1));
-            memset(&char_data[virt_width*(virt_height-1)],
-                   0x20,
-                   virt_width);
-            memmove(&line_cont[0], &line_cont[1], virt_height-1);
-            line_cont[virt_height-1] = 0;
+            screen.scroll();
         } else if(cur_y+1 >= win_y + win_height) {
             cur_y++;
             win_y = cur_y - win_height + 1;
@@ -733,7 +935,7 @@ void HX20CrtDevice::processCharacter(uint8_t ch) {
             cur_y++;
         }
         windowFollowCursor();
-        redrawText();
+        textChanged();
         break;
     case 0x0b:
         if(win_x != 0 || win_y != 0) {
@@ -741,21 +943,21 @@ void HX20CrtDevice::processCharacter(uint8_t ch) {
             cur_y = 0;
             win_x = 0;
             win_y = 0;
-            redrawText();
+            textChanged();
         } else if(cur_x != 0 || cur_y != 0) {
             cur_x = 0;
             cur_y = 0;
             windowFollowCursor();
-            redrawText();
+            textChanged();
         }
         break;
     case 0x0c:
-        memset(char_data.data(), 0x20, virt_width*virt_height);
+        screen.fill(0, 0x20, screen.size());
         cur_x = 0;
         cur_y = 0;
         win_x = 0;
         win_y = 0;
-        redrawText();
+        textChanged();
         break;
     case 0x0d:
         if(win_x != 0) {
@@ -764,9 +966,8 @@ void HX20CrtDevice::processCharacter(uint8_t ch) {
         } else {
             cur_x = 0;
         }
-        if(cur_y < virt_height)
-            line_cont[cur_y+1] = 0;
-        redrawText();
+        screen.setCont(cur_y+1, 0);
+        textChanged();
         break;
     case 0x10:
         if(win_y >= vertical_scroll_step) {
@@ -774,17 +975,17 @@ void HX20CrtDevice::processCharacter(uint8_t ch) {
             //cur_x = 9;
             cur_y -= vertical_scroll_step;
             windowFollowCursor();
-            redrawText();
+            textChanged();
         } else if(win_y != 0) {
             cur_y -= win_y;
             win_y = 0;
             //cur_x = 9;
             windowFollowCursor();
-            redrawText();
+            textChanged();
         } /*else if(cur_x != 9) {
             cur_x = 9;
             windowFollowCursor();
-            redrawText();
+            textChanged();
         }*/
         break;
     case 0x11:
@@ -793,51 +994,50 @@ void HX20CrtDevice::processCharacter(uint8_t ch) {
             cur_y += vertical_scroll_step;
             //cur_x = 9;
             windowFollowCursor();
-            redrawText();
+            textChanged();
         } else if(win_y + win_height != virt_height) {
             cur_y += virt_height - win_height - win_y;
             win_y = virt_height - win_height;
             //cur_x = 9;
             windowFollowCursor();
-            redrawText();
+            textChanged();
         }/* else if(cur_x != 9) {
             cur_x = 9;
             windowFollowCursor();
-            redrawText();
+            textChanged();
         }*/
         break;
     case 0x12: {
         int ly = cur_y;
-        while(ly+1 < virt_height && line_cont[ly+1])
+        while(ly+1 < virt_height && screen.cont(ly+1))
             ly++;
-        if(char_data[virt_width*(ly+1)-1] != 0x20) {
+        if(screen.at(virt_width*(ly+1)-1) != 0x20) {
             if(ly < virt_height-1) {
-                memmove(&char_data[virt_width*(ly+2)],
-                        &char_data[virt_width*(ly+1)],
-                        virt_width*(virt_height-ly-2));
-                memset(&char_data[virt_width*(ly+1)],0x20,
-                       virt_width);
-                line_cont[ly+1] = 0xff;
+                screen.move(virt_width*(ly+2),
+                            virt_width*(ly+1),
+                            virt_width*(virt_height-ly-2));
+                screen.fill(virt_width*(ly+1), 0x20,
+                            virt_width);
+                screen.setCont(ly+1, 0xff);
             } else {
-                memmove(&char_data[0],
-                        &char_data[virt_width],
-                        virt_width*(virt_height-1));
-                memset(&char_data[virt_width*(virt_height-1)],
-                       0x20, virt_width);
+                //the line moved up, it continues into the new last one
+                screen.scroll();
                 cur_y--;
+                ly--;
+                screen.setCont(ly+1, 0xff);
                 if(cur_y < win_y)
                     win_y = cur_y;
             }
-            memmove(&char_data[virt_width*cur_y+cur_x+1],
-                    &char_data[virt_width*cur_y+cur_x],
-                    virt_width*(ly-cur_y+1)-cur_x);
+            screen.move(virt_width*cur_y+cur_x+1,
+                        virt_width*cur_y+cur_x,
+                        virt_width*(ly-cur_y+1)-cur_x);
         } else {
-            memmove(&char_data[virt_width*cur_y+cur_x+1],
-                    &char_data[virt_width*cur_y+cur_x],
-                    virt_width*(ly-cur_y+1)-cur_x-1);
+            screen.move(virt_width*cur_y+cur_x+1,
+                        virt_width*cur_y+cur_x,
+                        virt_width*(ly-cur_y+1)-cur_x-1);
         }
         windowFollowCursor();
-        redrawText();
+        textChanged();
         break;
     }
     case 0x13:
@@ -845,19 +1045,19 @@ void HX20CrtDevice::processCharacter(uint8_t ch) {
             win_x -= horizontal_scroll_step;
             cur_x = win_x + 9;
             windowFollowCursor();
-            redrawText();
+            textChanged();
         } else if(win_x > 0) {
             win_x = 0;
             cur_x = win_x + 9;
             windowFollowCursor();
-            redrawText();
+            textChanged();
         }
         break;
     case 0x1a:
-        memset(&line_cont[cur_y+1], 0x00, virt_height-cur_y-1);
-        memset(&char_data[virt_width*cur_y+cur_x], 0x20,
-               virt_width*(virt_height-cur_y)-cur_x);
-        redrawText();
+        screen.clearConts(cur_y+1);
+        screen.fill(virt_width*cur_y+cur_x, 0x20,
+                    virt_width*(virt_height-cur_y)-cur_x);
+        textChanged();
         break;
     case 0x1c:
         cur_x++;
@@ -868,7 +1068,7 @@ void HX20CrtDevice::processCharacter(uint8_t ch) {
                 cur_y = virt_height-1;
         }
         windowFollowCursor();
-        redrawText();
+        textChanged();
         break;
     case 0x1d:
         if(cur_x < 1) {
@@ -880,7 +1080,7 @@ void HX20CrtDevice::processCharacter(uint8_t ch) {
         } else
             cur_x--;
         windowFollowCursor();
-        redrawText();
+        textChanged();
         break;
     case 0x1e:
         if(cur_y > 0) {
@@ -889,7 +1089,7 @@ void HX20CrtDevice::processCharacter(uint8_t ch) {
                 win_y = cur_y;
             }
             windowFollowCursor();
-            redrawText();
+            textChanged();
         }
         break;
     case 0x1f:
@@ -899,41 +1099,34 @@ void HX20CrtDevice::processCharacter(uint8_t ch) {
                 win_y = cur_y - win_height + 1;
             }
             windowFollowCursor();
-            redrawText();
+            textChanged();
         }
         break;
     default:
-        char_data[cur_x+cur_y*virt_width] = ch;
+        screen.at(cur_x+cur_y*virt_width) = ch;
         cur_x++;
         if(cur_x >= virt_width) {
             cur_y++;
             cur_x = 0;
             if(cur_y >= virt_height) {
                 cur_y = virt_height - 1;
-                memmove(&char_data[0],
-                        &char_data[virt_width],
-                        virt_width*(virt_height - 1));
-                memset(&char_data[virt_width*(virt_height-1)],
-                       0x20,
-                       virt_width);
-                memmove(&line_cont[0], &line_cont[1], virt_height-1);
-                line_cont[virt_height-1] = 0;
+                screen.scroll();
             }
-            line_cont[cur_y] = 0xff;
+            screen.setCont(cur_y, 0xff);
         }
         windowFollowCursor();
-        redrawText();
+        textChanged();
         break;
     }
 
     if(win_x + win_width > virt_width)
-        printf("win_x out of bounds\n");
+        HX20_TRACE(Crt, Warning, "win_x out of bounds\n");
     if(win_y + win_height > virt_height)
-        printf("win_y out of bounds\n");
+        HX20_TRACE(Crt, Warning, "win_y out of bounds\n");
     if(cur_x >= virt_width)
-        printf("cur_x out of bounds\n");
+        HX20_TRACE(Crt, Warning, "cur_x out of bounds\n");
     if(cur_y >= virt_height)
-        printf("cur_y out of bounds\n");
+        HX20_TRACE(Crt, Warning, "cur_y out of bounds\n");
 }
 
 int HX20CrtDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
@@ -947,14 +1140,14 @@ int HX20CrtDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         //Screen device select
         //Not seen.
         b = 0;
-        return conn->sendPacket(did, sid, fnc, 1, &b);
+        return conn->sendPacket(replies.get(did, sid, fnc, 1, &b));
     }
     case 0x85: {
         //Initialization of the Display controller
         //takes and ignores one byte.
         //Not seen.
         b = 0;
-        return conn->sendPacket(did, sid, fnc, 1, &b);
+        return conn->sendPacket(replies.get(did, sid, fnc, 1, &b));
     }
     case 0x87: {
         //set character display virtual screen size
@@ -965,8 +1158,7 @@ int HX20CrtDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         //Not seen.
         virt_width = inbuf[0];
         virt_height = inbuf[1];
-        char_data.resize(virt_width * virt_height);
-        line_cont.resize(virt_height);
+        screen.resize(virt_width, virt_height);
         if(win_x + win_width > virt_width)
             win_x = virt_width - win_width;
         if(win_y + win_height > virt_height)
@@ -976,7 +1168,7 @@ int HX20CrtDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         if(cur_y > virt_height)
             cur_y = virt_height-1;
         b = 0;
-        return conn->sendPacket(did, sid, fnc, 1, &b);
+        return conn->sendPacket(replies.get(did, sid, fnc, 1, &b));
     }
     case 0x88: {
         //get character display virtual screen size
@@ -985,7 +1177,7 @@ int HX20CrtDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         uint8_t buf[2];
         buf[0] = virt_width-1;
         buf[1] = virt_height-1;
-        return conn->sendPacket(did, sid, fnc, 2, buf);
+        return conn->sendPacket(replies.get(did, sid, fnc, 2, buf));
     }
     case 0x89: {
         //get character display window size
@@ -994,7 +1186,7 @@ int HX20CrtDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         uint8_t buf[2];
         buf[0] = win_width-1;
         buf[1] = win_height-1;
-        return conn->sendPacket(did, sid, fnc, 2, buf);
+        return conn->sendPacket(replies.get(did, sid, fnc, 2, buf));
     }
     case 0x8a: {
         //get character display window position
@@ -1004,7 +1196,7 @@ int HX20CrtDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         uint8_t buf[2];
         buf[0] = win_x;
         buf[1] = win_y;
-        return conn->sendPacket(did, sid, fnc, 2, buf);
+        return conn->sendPacket(replies.get(did, sid, fnc, 2, buf));
     }
     case 0x8c: {
         //get character display cursor position
@@ -1021,7 +1213,7 @@ int HX20CrtDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         //Not seen.
         uint8_t buf[1];
         buf[0] = cursor_margin;
-        return conn->sendPacket(did, sid, fnc, 1, buf);
+        return conn->sendPacket(replies.get(did, sid, fnc, 1, buf));
     }
     case 0x8e: {
         //get character display scroll steps
@@ -1031,7 +1223,7 @@ int HX20CrtDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         uint8_t buf[2];
         buf[0] = horizontal_scroll_step;
         buf[1] = vertical_scroll_step;
-        return conn->sendPacket(did, sid, fnc, 2, buf);
+        return conn->sendPacket(replies.get(did, sid, fnc, 2, buf));
     }
     case 0x8f: {
         //get graphics pixel data at x,y
@@ -1048,7 +1240,7 @@ int HX20CrtDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
             b = graphicsview->image_data[x+y*graph_width];
         else
             b = 0;
-        return conn->sendPacket(did, sid, fnc, 1, &b);
+        return conn->sendPacket(replies.get(did, sid, fnc, 1, &b));
     }
     case 0x91: {
         //get the range of the current character display logical line at the cursor
@@ -1060,14 +1252,14 @@ int HX20CrtDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         uint8_t buf[4];
         buf[1] = cur_y;
         buf[3] = cur_y;
-        while(line_cont[buf[1]] && buf[1] > 0)
+        while(screen.cont(buf[1]) && buf[1] > 0)
             buf[1]--;
-        while(buf[3] < virt_height-1 && line_cont[buf[3]+1])
+        while(buf[3] < virt_height-1 && screen.cont(buf[3]+1))
             buf[3]++;
         buf[0] = 0;
         buf[2] = virt_width-1;
-        printf("0x91: %02x %02x %02x %02x\n",
-               buf[0], buf[1], buf[2], buf[3]);
+        HX20_TRACE(Crt, Debug, "0x91: %02x %02x %02x %02x\n",
+                   buf[0], buf[1], buf[2], buf[3]);
         return conn->sendPacket(did, sid, fnc, 4, buf);
     }
     case 0x92: {
@@ -1079,8 +1271,8 @@ int HX20CrtDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         uint8_t buf[2];
         buf[0] = cur_x;
         buf[1] = cur_y;
-        printf("0x92: %02x %02x\n",
-               buf[0], buf[1]);
+        HX20_TRACE(Crt, Debug, "0x92: %02x %02x\n",
+                   buf[0], buf[1]);
         return conn->sendPacket(did, sid, fnc, 2, buf);
     }
     case 0x93: {
@@ -1091,7 +1283,7 @@ int HX20CrtDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         //we ignore the rest, doing all modes at the same time
         background_color = inbuf[2];
         b = 0;
-        return conn->sendPacket(did, sid, fnc, 1, &b);
+        return conn->sendPacket(replies.get(did, sid, fnc, 1, &b));
     }
     case 0x95: {
         //get one character on character display
@@ -1100,8 +1292,8 @@ int HX20CrtDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         //outbuf[1]: color code(background color code)
         uint8_t buf[2];
         if(access_x+access_y*virt_width >= 0 &&
-                (unsigned)(access_x+access_y*virt_width) < char_data.size())
-            buf[0] = char_data[access_x+access_y*virt_width];
+                access_x+access_y*virt_width < screen.size())
+            buf[0] = screen.at(access_x+access_y*virt_width);
         else
             buf[0] = 0;
         buf[1] = background_color;
@@ -1113,10 +1305,11 @@ int HX20CrtDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         //inbuf[1]: read start y coordinate
         //inbuf[2]: number of characters to read
         //outbuf[...]: character codes
-        printf("sending %d char(s) from %d,%d\n",
-               inbuf[2], inbuf[0], inbuf[1]);
-        uint8_t *b = &char_data[inbuf[0]+inbuf[1]*virt_width];
-        return conn->sendPacket(did, sid, fnc, inbuf[2], b);
+        HX20_TRACE(Crt, Debug, "sending %d char(s) from %d,%d\n",
+                   inbuf[2], inbuf[0], inbuf[1]);
+        uint8_t buf[256];
+        screen.read(inbuf[0]+inbuf[1]*virt_width, buf, inbuf[2]);
+        return conn->sendPacket(did, sid, fnc, inbuf[2], buf);
     }
     case 0x98: {
         //display one character on virtual screen
@@ -1131,12 +1324,12 @@ int HX20CrtDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         buf[1] = cur_y;
         buf[2] = cur_y;
         buf[3] = cur_y;
-        while(line_cont[buf[2]] && buf[2] > 0)
+        while(screen.cont(buf[2]) && buf[2] > 0)
             buf[2]--;
-        while(buf[3] < virt_height-1 && line_cont[buf[3]+1])
+        while(buf[3] < virt_height-1 && screen.cont(buf[3]+1))
             buf[3]++;
-        printf("0x98: %02x %02x %02x %02x\n",
-               buf[0], buf[1], buf[2], buf[3]);
+        HX20_TRACE(Crt, Debug, "0x98: %02x %02x %02x %02x\n",
+                   buf[0], buf[1], buf[2], buf[3]);
         return conn->sendPacket(did, sid, fnc, 4, buf);
     }
     //hx20 does not want answer if bit 6 is set
@@ -1154,7 +1347,7 @@ int HX20CrtDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         if(win_x +  win_width > virt_width)
             win_x = virt_width - win_width;
         windowFollowCursor();
-        redrawText();
+        textChanged();
         return 0;
     }
     case 0xc2:
@@ -1190,7 +1383,7 @@ int HX20CrtDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
                 if(win_x +  win_width > virt_width)
                     win_x = virt_width - win_width;
             }
-            redrawText();
+            textChanged();
         }
         return 0;
     case 0xc3: {
@@ -1202,7 +1395,7 @@ int HX20CrtDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         //Not seen
         cursor_margin = inbuf[0];
         if(windowFollowCursor())
-            redrawText();
+            textChanged();
         return 0;
     }
     case 0xc4: {
@@ -1220,7 +1413,7 @@ int HX20CrtDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         list_flag = true;//keep virt_x == 0;
         if(win_x != 0) {
             win_x = 0;
-            redrawText();
+            textChanged();
         }
         return 0;
     case 0xc6:
@@ -1228,7 +1421,7 @@ int HX20CrtDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         //no inputs
         list_flag = false;
         if(windowFollowCursor())
-            redrawText();
+            textChanged();
         return 0;
     case 0xc7: {
         //set graphics display pixel at position
@@ -1241,8 +1434,9 @@ int HX20CrtDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         uint16_t y = (inbuf[2] << 8) | inbuf[3];
         if(x < graph_width &&
                 y < graph_height) {
-            graphicsview->image_data[x+y*graph_width] = inbuf[4];
-            graphicsview->updateImage();
+            rasterTarget();
+            raster.pixel(x, y, inbuf[4]);
+            graphicsChanged();
         }
         return 0;
     }
@@ -1261,21 +1455,23 @@ int HX20CrtDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         uint16_t y1 = (inbuf[2] << 8) | inbuf[3];
         uint16_t x2 = (inbuf[4] << 8) | inbuf[5];
         uint16_t y2 = (inbuf[6] << 8) | inbuf[7];
-        draw_line(graphicsview->image_data.data(), graph_width, graph_height,
-                  x1, y1, x2, y2, inbuf[8]);
-        graphicsview->updateImage();
+        rasterTarget();
+        raster.line(x1, y1, x2, y2, inbuf[8]);
+        graphicsChanged();
         return 0;
     }
     case 0xc9:
         //termination of the logical single line on character display
         //inbuf[0]: line number
-        if(inbuf[0] < virt_height)
-            line_cont[inbuf[0]] = 0;
+        screen.setCont(inbuf[0], 0);
         return 0;
     case 0xca: {
         //clear graphics display screen
         //inbuf[0]: background color: 0: green, 1: yellow, 2: blue, 3: red, 4: white, 5: cyan, 6: magenta, 7: orange
         //Not seen
+        rasterTarget();
+        raster.clear(inbuf[0]);
+        graphicsChanged();
         return 0;
     }
     case 0xcb: {
@@ -1289,9 +1485,9 @@ int HX20CrtDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         //inbuf[0]: character code
         //Not seen
         if(access_x+access_y*virt_width >= 0 &&
-                (unsigned)(access_x+access_y*virt_width) < char_data.size())
-            char_data[access_x+access_y*virt_width] = inbuf[0];
-        redrawText();
+                access_x+access_y*virt_width < screen.size())
+            screen.at(access_x+access_y*virt_width) = inbuf[0];
+        textChanged();
         return 0;
     }
     case 0xce: {
@@ -1310,9 +1506,9 @@ int HX20CrtDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         //set color set
         //inbuf[0]: color set; 0: green, yellow, blue, red
         //                     1: white, cyan, magenta, orange
-        printf("select color set %d\n",inbuf[0]);
+        HX20_TRACE(Crt, Info, "select color set %d\n", inbuf[0]);
         color_set = inbuf[0];
-        redrawText();
+        textChanged();
         updateGraphicsColors();
         return 0;
     case 0xd4://screen new?
@@ -1320,7 +1516,8 @@ int HX20CrtDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
     default:
         break;
     }
-    printf("HX20CrtDevice: unknown function %02x\n", fnc);
+    HX20_TRACE(Crt, Error, "HX20CrtDevice: unknown function %02x\n", fnc);
+    HX20Trace::flush();
     exit(1);
 }
 
@@ -1340,7 +1537,7 @@ void HX20CrtDevice::updateGraphicsColors() {
         set->value(idText, QColor(Qt::black)).value<QColor>().rgb();
     }
 
-    graphicsview->updateImage();
+    graphicsview->updateColors();
 }
 
 HX20CrtDevice::HX20CrtDevice() :
@@ -1367,37 +1564,38 @@ HX20CrtDevice::HX20CrtDevice() :
     horizontal_scroll_step(16),
     vertical_scroll_step(16),
     list_flag(false),
+    textDirty(false),
+    graphicsDirty(false),
+    framePending(false),
     settingsConfig(nullptr),
     settingsPresets(nullptr) {
 
     graphicsview = new HX20CrtGraphicsView();
-    textview = new QTextEdit();
+    textview = new HX20CrtTextView();
+
+    frameTimer = new QTimer(this);
+    frameTimer->setSingleShot(true);
+    frameTimer->setTimerType(Qt::PreciseTimer);
+    frameTimer->setInterval(1000 / 60);
+    connect(frameTimer, &QTimer::timeout, this, &HX20CrtDevice::frameDue);
 
     graphicsview->width = graph_width;
     graphicsview->height = graph_height;
     graphicsview->updateImage();
 
-    textview->setReadOnly(false);
-    QFont textfont = textview->font();
-    textfont.setFamilies({"Courier", "Mono"});
-    textfont.setFixedPitch(true);
-    textview->setFont(textfont);
-    textview->setTextInteractionFlags(Qt::TextSelectableByMouse);
-
-    char_data.resize(virt_width*virt_height);
-    line_cont.resize(virt_height);
+    screen.resize(virt_width, virt_height);
 
     memset(graphicsview->image_data.data(), 0, graph_width*graph_height);
-    memset(char_data.data(), 0x20, virt_width*virt_height);
-    memset(line_cont.data(), 0, virt_height);
+    screen.fill(0, 0x20, screen.size());
+    screen.clearConts(0);
 
     for(int i = 0; i < 256; i++) {
         text_char_map[i] = QString::fromUtf8(char_map_de[i]);
     }
-    for(int i = 0; i < 128-32+32 && i/16*virt_width+(i%16) < (int)char_data.size(); i++) {
+    for(int i = 0; i < 128-32+32 && i/16*virt_width+(i%16) < screen.size(); i++) {
         int x = i % 16;
         int y = i / 16;
-        char_data[y*virt_width+x] = i+32;
+        screen.at(y*virt_width+x) = i+32;
     }
     redrawText();
 }
@@ -1569,9 +1767,10 @@ void HX20CrtDevice::updateFromConfig() {
     text_color_2 = settingsConfig->value("text/color2", text_color_2, true).value<QColor>();
     text_background = settingsConfig->value("text/background", text_background, true).value<QColor>();
     text_border = settingsConfig->value("text/border", text_border, true).value<QColor>();
+    int frame_rate = settingsConfig->value("frameRate", 60, true).toInt();
+    frameTimer->setInterval(1000 / std::max(1, std::min(frame_rate, 1000)));
 
-    char_data.resize(virt_width * virt_height);
-    line_cont.resize(virt_height);
+    screen.resize(virt_width, virt_height);
     if(win_x + win_width > virt_width)
         win_x = virt_width - win_width;
     if(win_y + win_height > virt_height)
@@ -1581,9 +1780,7 @@ void HX20CrtDevice::updateFromConfig() {
     if(cur_y > virt_height)
         cur_y = virt_height-1;
 
-    QPalette pal = textview->palette();
-    pal.setColor(QPalette::ColorRole::Base, text_border);
-    textview->setPalette(pal);
+    textview->setColors(text_color_1, text_color_2, text_background, text_border);
 
     if(settingsPresets->arraySize("text/charsets") >
             settingsConfig->value("text/charset", 2, true).toInt()) {
@@ -1593,6 +1790,7 @@ void HX20CrtDevice::updateFromConfig() {
             text_char_map[i] = set->value(QString("%1").arg(i)).toString();
         }
     }
+    textview->setCharMap(text_char_map);
 
     redrawText();
 
@@ -1601,6 +1799,8 @@ void HX20CrtDevice::updateFromConfig() {
 
     graphicsview->width = graph_width;
     graphicsview->height = graph_height;
+    //resizes image_data before anything is drawn into it
+    graphicsview->updateImage();
 
     if(settingsPresets->arraySize("gfx/colorsets") >
             settingsConfig->value("gfx/bordercolorset", 2, true).toInt()) {
@@ -3,15 +3,18 @@
 
 #include <stdint.h>
 #include <QWidget>
+#include <QImage>
 #include <array>
 
 #include "../../hx20-ser-proto.hpp"
+#include "hx20-crt-raster.hpp"
+#include "hx20-crt-screen.hpp"
 
 QT_BEGIN_NAMESPACE
 
 class QMainWindow;
-class QTextEdit;
 class QMenu;
+class QTimer;
 
 QT_END_NAMESPACE
 
@@ -21,24 +24,82 @@ class Group;
 
 class HX20CrtGraphicsView : public QWidget {
     Q_OBJECT;
+private:
+    void makeImage();
+    int frameScale() const;
 public:
     int width;
     int height;
     float zoom;
     std::vector<uint8_t> image_data;
     std::array<QRgb, 256> color_map;
+    //an indexed view of image_data, color_map is its colour table
     std::unique_ptr<QImage> image;
     QRgb border_color;
+    //in image pixels, what updateImage still has to repaint
+    QRect dirty;
     HX20CrtGraphicsView(QWidget *parent = nullptr, Qt::WindowFlags f = Qt::WindowFlags());
     ~HX20CrtGraphicsView();
     virtual QSize sizeHint() const override;
+    void markDirty(QRect const &r);
+    QRect imageRect() const;
+    //makes color_map take effect
+    void updateColors();
 public slots:
+    //repaints the dirty part of image_data
     void updateImage();
 protected:
     virtual void paintEvent(QPaintEvent *event) override;
     virtual void resizeEvent(QResizeEvent *event) override;
 };
 
+/* The text window as a grid of fixed pitch cells, painted from glyph
+ * atlases that are rendered once per charset and colour set. Only the
+ * rows that changed and the cells the cursor left and entered get
+ * repainted.
+ */
+class HX20CrtTextView : public QWidget {
+    Q_OBJECT;
+private:
+    int columns;
+    int rows;
+    std::vector<uint8_t> cells;
+    //in the window, may be outside of it
+    int cursor_x;
+    int cursor_y;
+    std::array<QString, 256> char_map;
+    std::array<QColor, 2> text_colors;
+    QColor background;
+    QColor border;
+    int color_set;
+    QSize cell;
+    //16x16 glyphs for each colour set, rendered when first needed
+    std::array<QImage, 2> atlas;
+
+    QPoint origin() const;
+    QRect cellRect(int x, int y) const;
+    QImage const &glyphs();
+    void updateCell(int x, int y);
+    void fontChanged();
+public:
+    HX20CrtTextView(QWidget *parent = nullptr, Qt::WindowFlags f = Qt::WindowFlags());
+    ~HX20CrtTextView();
+    void setCharMap(std::array<QString, 256> const &map);
+    void setColors(QColor const &color1, QColor const &color2,
+                   QColor const &background, QColor const &border);
+    void setColorSet(int color_set);
+    //takes the window of the virtual screen, lines[y] points to the
+    //columns characters of its line y
+    void setScreen(uint8_t const *const *lines, int columns, int rows,
+                   int cursor_x, int cursor_y);
+    QString text() const;
+    virtual QSize sizeHint() const override;
+protected:
+    virtual void paintEvent(QPaintEvent *event) override;
+    virtual void resizeEvent(QResizeEvent *event) override;
+    virtual void changeEvent(QEvent *event) override;
+};
+
 class HX20CrtDevice : public QObject, public HX20SerialDevice {
     Q_OBJECT;
 public:
@@ -70,16 +131,30 @@ private:
     uint8_t horizontal_scroll_step;
     uint8_t vertical_scroll_step;
 
-    std::vector<uint8_t> char_data;
-    std::vector<uint8_t> line_cont;
+    HX20CrtScreen screen;
+    //the status and size answers, the cursor moves too much to cache it
+    HX20PreparedPacketCache replies;
     bool list_flag;
+    bool textDirty;
+    bool graphicsDirty;
+    //draws the graphics, collecting what changed until the next frame
+    HX20CrtRaster raster;
+    //the frame timer fired, the redraw waits for the response
+    bool framePending;
+    //paces the redraws, at the "frameRate" setting
+    QTimer *frameTimer;
 
     HX20CrtGraphicsView *graphicsview;
-    QTextEdit *textview;
+    HX20CrtTextView *textview;
     Settings::Group *settingsConfig;
     Settings::Group *settingsPresets;
 
     void redrawText();
+    void textChanged();
+    void graphicsChanged();
+    void rasterTarget();
+    void scheduleFrame();
+    void frameDue();
     void processCharacter(uint8_t ch);
     bool windowFollowCursor();
     void updateGraphicsColors();
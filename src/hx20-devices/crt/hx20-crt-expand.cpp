@@ -0,0 +1,118 @@
+#include "hx20-crt-expand.hpp"
+
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HX20_EXPAND_X86
+#endif
+
+namespace {
+
+typedef void (*ExpandFn)(uint32_t *dst, uint8_t const *src, int count, int scale,
+                         uint32_t const *palette);
+
+void expandScalar(uint32_t *dst, uint8_t const *src, int count, int scale,
+                  uint32_t const *palette) {
+    if(scale == 1) {
+        for(int i = 0; i < count; i++)
+            dst[i] = palette[src[i]];
+        return;
+    }
+    for(int i = 0; i < count; i++) {
+        std::fill_n(dst, scale, palette[src[i]]);
+        dst += scale;
+    }
+}
+
+#ifdef HX20_EXPAND_X86
+
+__attribute__((target("sse2")))
+void expandSSE2(uint32_t *dst, uint8_t const *src, int count, int scale,
+                uint32_t const *palette) {
+    //there is no gather, the lookups stay scalar and the stores get wide
+    int i = 0;
+    for(; i + 4 <= count && scale <= 2; i += 4) {
+        __m128i v = _mm_set_epi32(palette[src[i+3]], palette[src[i+2]],
+                                  palette[src[i+1]], palette[src[i]]);
+        if(scale == 1) {
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst), v);
+            dst += 4;
+        } else {
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst),
+                             _mm_unpacklo_epi32(v, v));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 4),
+                             _mm_unpackhi_epi32(v, v));
+            dst += 8;
+        }
+    }
+    for(; i < count; i++) {
+        __m128i v = _mm_set1_epi32(palette[src[i]]);
+        int j = 0;
+        for(; j + 4 <= scale; j += 4)
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + j), v);
+        for(; j < scale; j++)
+            dst[j] = palette[src[i]];
+        dst += scale;
+    }
+}
+
+__attribute__((target("avx2")))
+void expandAVX2(uint32_t *dst, uint8_t const *src, int count, int scale,
+                uint32_t const *palette) {
+    int const *table = reinterpret_cast<int const *>(palette);
+    int i = 0;
+    if(scale <= 2) {
+        __m256i const lo = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+        __m256i const hi = _mm256_setr_epi32(4, 4, 5, 5, 6, 6, 7, 7);
+        for(; i + 8 <= count; i += 8) {
+            __m128i idx8 = _mm_loadl_epi64(reinterpret_cast<__m128i const *>(src + i));
+            __m256i v = _mm256_i32gather_epi32(table, _mm256_cvtepu8_epi32(idx8), 4);
+            if(scale == 1) {
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst), v);
+                dst += 8;
+            } else {
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst),
+                                    _mm256_permutevar8x32_epi32(v, lo));
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + 8),
+                                    _mm256_permutevar8x32_epi32(v, hi));
+                dst += 16;
+            }
+        }
+    }
+    for(; i < count; i++) {
+        __m256i v = _mm256_set1_epi32(palette[src[i]]);
+        int j = 0;
+        for(; j + 8 <= scale; j += 8)
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + j), v);
+        if(j + 4 <= scale) {
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + j),
+                             _mm256_castsi256_si128(v));
+            j += 4;
+        }
+        for(; j < scale; j++)
+            dst[j] = palette[src[i]];
+        dst += scale;
+    }
+}
+
+#endif
+
+ExpandFn pickExpand() {
+#ifdef HX20_EXPAND_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        return expandAVX2;
+    if(__builtin_cpu_supports("sse2"))
+        return expandSSE2;
+#endif
+    return expandScalar;
+}
+
+}
+
+void expandPixels(uint32_t *dst, uint8_t const *src, int count, int scale,
+                  uint32_t const *palette) {
+    static ExpandFn const fn = pickExpand();
+    fn(dst, src, count, scale, palette);
+}
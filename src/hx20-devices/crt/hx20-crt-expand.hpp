@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Looks count palette indices from src up in palette and writes each of
+ * them scale times to dst, which needs room for count * scale pixels.
+ * Uses AVX2 or SSE2 where the cpu has them, picked on the first call.
+ */
+void expandPixels(uint32_t *dst, uint8_t const *src, int count, int scale,
+                  uint32_t const *palette);
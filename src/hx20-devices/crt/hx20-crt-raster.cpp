@@ -0,0 +1,206 @@
+#include "hx20-crt-raster.hpp"
+
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <utility>
+
+HX20CrtRaster::HX20CrtRaster()
+    : image(nullptr), width(0), height(0),
+      left(0), top(0), right(0), bottom(0) {
+}
+
+void HX20CrtRaster::setTarget(uint8_t *image, int width, int height) {
+    if(width != this->width || height != this->height) {
+        //a box from the old size would not fit anymore
+        left = top = right = bottom = 0;
+    }
+    this->image = image;
+    this->width = width;
+    this->height = height;
+}
+
+void HX20CrtRaster::addDirty(int x, int y) {
+    if(left >= right) {
+        left = x;
+        top = y;
+        right = x + 1;
+        bottom = y + 1;
+        return;
+    }
+    left = std::min(left, x);
+    top = std::min(top, y);
+    right = std::max(right, x + 1);
+    bottom = std::max(bottom, y + 1);
+}
+
+bool HX20CrtRaster::takeDirty(int &left, int &top, int &right, int &bottom) {
+    if(this->left >= this->right)
+        return false;
+    left = this->left;
+    top = this->top;
+    right = this->right;
+    bottom = this->bottom;
+    this->left = this->top = this->right = this->bottom = 0;
+    return true;
+}
+
+void HX20CrtRaster::pixel(int x, int y, uint8_t color) {
+    if(x < 0 || x >= width || y < 0 || y >= height)
+        return;
+    image[x + y * width] = color;
+    addDirty(x, y);
+}
+
+void HX20CrtRaster::clear(uint8_t color) {
+    if(width <= 0 || height <= 0)
+        return;
+    memset(image, color, width * height);
+    addDirty(0, 0);
+    addDirty(width - 1, height - 1);
+}
+
+void HX20CrtRaster::hline(int x1, int x2, int y, uint8_t color) {
+    if(y < 0 || y >= height)
+        return;
+    if(x1 > x2)
+        std::swap(x1, x2);
+    x1 = std::max(x1, 0);
+    x2 = std::min(x2, width - 1);
+    if(x1 > x2)
+        return;
+    memset(image + x1 + y * width, color, x2 - x1 + 1);
+    addDirty(x1, y);
+    addDirty(x2, y);
+}
+
+void HX20CrtRaster::vline(int x, int y1, int y2, uint8_t color) {
+    if(x < 0 || x >= width)
+        return;
+    if(y1 > y2)
+        std::swap(y1, y2);
+    y1 = std::max(y1, 0);
+    y2 = std::min(y2, height - 1);
+    if(y1 > y2)
+        return;
+    uint8_t *p = image + x + y1 * width;
+    for(int y = y1; y <= y2; y++) {
+        *p = color;
+        p += width;
+    }
+    addDirty(x, y1);
+    addDirty(x, y2);
+}
+
+/* The pixels of the old draw_line, clipped to the image before they are
+ * rasterized. draw_line took x as the major axis m when dx > dy and y
+ * otherwise, walked from the end with the lower m, started its error term
+ * at dm / 2 and stepped n whenever that went over dm or below 0. So step
+ * i of dm puts the pixel at m1 + i, n1 + sn * q(i), with
+ *   q(i) = max(0, floor((i * dn + c) / dm)),
+ * c = dm / 2 - 1 stepping n up and dm - 1 - dm / 2 stepping it down.
+ * q is monotonic, so clipping n to the image is a range of i,
+ * found by solving q(i) >= qa and q(i) <= qb for i, in the manner of
+ * Liang-Barsky but in integers. Rasterizing starts at the first i on the
+ * image, with the error term draw_line had there.
+ */
+void HX20CrtRaster::line(int x1, int y1, int x2, int y2, uint8_t color) {
+    if(!image)
+        return;
+    //entirely on one side of the image, as Cohen-Sutherland rejects it
+    if((x1 < 0 && x2 < 0) || (y1 < 0 && y2 < 0) ||
+            (x1 >= width && x2 >= width) || (y1 >= height && y2 >= height))
+        return;
+    if(x1 == x2 && y1 == y2) {
+        pixel(x1, y1, color);
+        return;
+    }
+    //with its longer axis running left or up, draw_line took the shorter
+    //one as m and drew a diagonal; from the other end it picks the right one
+    int adx = abs(x2 - x1);
+    int ady = abs(y2 - y1);
+    if((adx > ady && x2 < x1) || (ady > adx && y2 < y1)) {
+        std::swap(x1, x2);
+        std::swap(y1, y2);
+    }
+    if(y1 == y2) {
+        hline(x1, x2, y1, color);
+        return;
+    }
+    if(x1 == x2) {
+        vline(x1, y1, y2, color);
+        return;
+    }
+    bool xmajor = x2 - x1 > y2 - y1;
+    int m1, n1, m2, n2, msize, nsize;
+    long mstride, nstride;
+    if(xmajor) {
+        m1 = x1; n1 = y1; m2 = x2; n2 = y2;
+        msize = width; nsize = height;
+        mstride = 1; nstride = width;
+    } else {
+        m1 = y1; n1 = x1; m2 = y2; n2 = x2;
+        msize = height; nsize = width;
+        mstride = width; nstride = 1;
+    }
+    if(m2 < m1) {
+        std::swap(m1, m2);
+        std::swap(n1, n2);
+    }
+    int64_t dm = m2 - m1;
+    int64_t dn = abs(n2 - n1);
+    int sn = n2 < n1 ? -1 : 1;
+    //0 < dn <= dm from here on, the lines without either are done above
+    int64_t c = sn > 0 ? dm / 2 - 1 : dm - 1 - dm / 2;
+
+    //the major axis is clipped like a span
+    int64_t i0 = std::max<int64_t>(0, -m1);
+    int64_t i1 = std::min<int64_t>(dm, msize - 1 - (int64_t)m1);
+    //the minor one through q: the range it may take to stay on the image
+    int64_t qa, qb;
+    if(sn > 0) {
+        qa = -(int64_t)n1;
+        qb = nsize - 1 - (int64_t)n1;
+    } else {
+        qa = n1 - (int64_t)(nsize - 1);
+        qb = n1;
+    }
+    if(qb < 0 || qa > dn)
+        return;
+    //q(i) >= qa  <=>  i >= ceil((dm * qa - c) / dn), q(0) is 0
+    if(qa > 0)
+        i0 = std::max(i0, (dm * qa - c + dn - 1) / dn);
+    //q(i) <= qb  <=>  i * dn + c < dm * (qb + 1)
+    i1 = std::min(i1, (dm * (qb + 1) - c - 1) / dn);
+    if(i0 > i1)
+        return;
+
+    //num = i * dn + c = q * dm + err, err stepping like draw_line's frac
+    int64_t num = i0 * dn + c;
+    int64_t q = num < 0 ? 0 : num / dm;
+    int64_t err = num - q * dm;
+    int64_t m = m1 + i0;
+    int64_t n = n1 + sn * q;
+    uint8_t *p = image + (xmajor ? m + n * width : n + m * width);
+    long nstep = sn * nstride;
+    for(int64_t count = i1 - i0 + 1; count > 0; count--) {
+        *p = color;
+        p += mstride;
+        err += dn;
+        if(err >= dm) {
+            err -= dm;
+            p += nstep;
+        }
+    }
+    //the line is monotonic on both axes, its ends span the box
+    int64_t numlast = i1 * dn + c;
+    int64_t nlast = n1 + sn * (numlast < 0 ? 0 : numlast / dm);
+    int64_t mlast = m1 + i1;
+    if(xmajor) {
+        addDirty(m, n);
+        addDirty(mlast, nlast);
+    } else {
+        addDirty(n, m);
+        addDirty(nlast, mlast);
+    }
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Draws into the 8 bit graphics image of the crt device and keeps the
+ * bounding box of everything drawn since the last takeDirty, so a burst
+ * of pixels and lines can be handed to the view as one rectangle.
+ * Lines are clipped to the image before they are rasterized, only the
+ * pixels on it are visited.
+ */
+class HX20CrtRaster {
+private:
+    uint8_t *image;
+    int width;
+    int height;
+    //right and bottom exclusive, empty when left >= right
+    int left, top, right, bottom;
+    void addDirty(int x, int y);
+    void hline(int x1, int x2, int y, uint8_t color);
+    void vline(int x, int y1, int y2, uint8_t color);
+public:
+    HX20CrtRaster();
+    //image has to hold width * height bytes, row by row
+    void setTarget(uint8_t *image, int width, int height);
+    void pixel(int x, int y, uint8_t color);
+    //both end points included
+    void line(int x1, int y1, int x2, int y2, uint8_t color);
+    void clear(uint8_t color);
+    //the bounding box drawn into, returns false if there is none
+    bool takeDirty(int &left, int &top, int &right, int &bottom);
+};
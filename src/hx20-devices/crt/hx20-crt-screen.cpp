@@ -0,0 +1,91 @@
+#include "hx20-crt-screen.hpp"
+
+#include <string.h>
+#include <algorithm>
+
+HX20CrtScreen::HX20CrtScreen()
+    : width(0), height(0), head(0) {
+}
+
+void HX20CrtScreen::resize(int width, int height) {
+    std::rotate(cells.begin(), cells.begin() + head * this->width, cells.end());
+    std::rotate(conts.begin(), conts.begin() + head, conts.end());
+    head = 0;
+    this->width = width;
+    this->height = height;
+    cells.resize(width * height);
+    conts.resize(height);
+}
+
+uint8_t HX20CrtScreen::cont(int y) const {
+    if(y < 0 || y >= height)
+        return 0;
+    return conts[slot(y)];
+}
+
+void HX20CrtScreen::setCont(int y, uint8_t cont) {
+    if(y < 0 || y >= height)
+        return;
+    conts[slot(y)] = cont;
+}
+
+void HX20CrtScreen::clearConts(int y) {
+    for(; y < height; y++)
+        conts[slot(y)] = 0;
+}
+
+//in pieces that stay within one line on both ends
+void HX20CrtScreen::move(int dst, int src, int n) {
+    if(n <= 0 || dst == src)
+        return;
+    if(dst < src) {
+        while(n > 0) {
+            int chunk = std::min({ n, width - src % width, width - dst % width });
+            memmove(row(dst / width) + dst % width,
+                    row(src / width) + src % width, chunk);
+            dst += chunk;
+            src += chunk;
+            n -= chunk;
+        }
+    } else {
+        //from the end, so nothing is overwritten before it moved
+        while(n > 0) {
+            int src_end = src + n;
+            int dst_end = dst + n;
+            int chunk = std::min({ n, (src_end - 1) % width + 1,
+                                   (dst_end - 1) % width + 1 });
+            memmove(row((dst_end - chunk) / width) + (dst_end - chunk) % width,
+                    row((src_end - chunk) / width) + (src_end - chunk) % width,
+                    chunk);
+            n -= chunk;
+        }
+    }
+}
+
+void HX20CrtScreen::fill(int pos, uint8_t ch, int n) {
+    while(n > 0) {
+        int chunk = std::min(n, width - pos % width);
+        memset(row(pos / width) + pos % width, ch, chunk);
+        pos += chunk;
+        n -= chunk;
+    }
+}
+
+void HX20CrtScreen::read(int pos, uint8_t *dst, int n) const {
+    while(n > 0 && pos < size()) {
+        int chunk = std::min(n, width - pos % width);
+        memcpy(dst, row(pos / width) + pos % width, chunk);
+        dst += chunk;
+        pos += chunk;
+        n -= chunk;
+    }
+    memset(dst, 0x20, n);
+}
+
+void HX20CrtScreen::scroll() {
+    if(height == 0)
+        return;
+    head = slot(1);
+    memset(row(height - 1), 0x20, width);
+    conts[slot(height - 1)] = 0;
+}
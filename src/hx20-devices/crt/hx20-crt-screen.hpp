@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+/* The virtual screen of the character display, and for each of its
+ * lines whether it continues the logical line above. The lines are kept
+ * as a ring starting at head, so scrolling the whole screen up one line
+ * is moving head and clearing the new last line, however big the screen
+ * is. Positions count through the lines like in a plain array,
+ * x + y * width, and may run across lines.
+ */
+class HX20CrtScreen {
+private:
+    int width;
+    int height;
+    int head;
+    std::vector<uint8_t> cells;
+    std::vector<uint8_t> conts;
+    int slot(int y) const {
+        int s = head + y;
+        return s >= height ? s - height : s;
+    }
+public:
+    HX20CrtScreen();
+    //keeps the contents as positions, like resizing a plain array would
+    void resize(int width, int height);
+    int size() const {
+        return width * height;
+    }
+    uint8_t *row(int y) {
+        return &cells[slot(y) * width];
+    }
+    uint8_t const *row(int y) const {
+        return &cells[slot(y) * width];
+    }
+    //pos must be below size()
+    uint8_t &at(int pos) {
+        return row(pos / width)[pos % width];
+    }
+    //lines outside of the screen never continue
+    uint8_t cont(int y) const;
+    void setCont(int y, uint8_t cont);
+    //from line y to the end of the screen
+    void clearConts(int y);
+    //like memmove and memset on positions
+    void move(int dst, int src, int n);
+    void fill(int pos, uint8_t ch, int n);
+    //positions past the end read as spaces
+    void read(int pos, uint8_t *dst, int n) const;
+    //drops the first line, the new last one is empty and not continued
+    void scroll();
+};
@@ -2,6 +2,10 @@
 #include "disk-drive-adapters.hpp"
 #include "../../tools/teledisk/parser.hpp"
 #include <string.h>
+#include <stdlib.h>
+#include <map>
+#include <mutex>
+#include <stdexcept>
 #include <QFileInfo>
 
 TelediskImageDrive::TelediskImageDrive(std::string const &filename)
@@ -174,3 +178,123 @@ bool RawImageDrive::size(CHS const &chs, uint8_t &sector_size_code) {
     return true;
 }
 
+
+size_t SharedImageDrive::Image::index(CHS const &chs) const {
+    if(chs.idCylinder >= geometry.idCylinder ||
+            chs.idSide >= geometry.idSide ||
+            chs.idSector < 1 || chs.idSector > geometry.idSector)
+        return (size_t)-1;
+    return (chs.idCylinder * geometry.idSide + chs.idSide) *
+           geometry.idSector + chs.idSector - 1;
+}
+
+static std::shared_ptr<SharedImageDrive::Image const>
+loadSharedImage(std::string const &filename) {
+    //the other drives create missing images, which makes no sense here
+    if(!QFileInfo(filename.c_str()).isFile())
+        throw std::runtime_error("Image " + filename + " does not exist");
+    auto image = std::make_shared<SharedImageDrive::Image>();
+    size_t p = filename.rfind(".");
+    if(p == std::string::npos || (filename.substr(p+1) != "td0" &&
+                                  filename.substr(p+1) != "TD0")) {
+        //RawImageDrive opens for writing, which fails on write
+        //protected images
+        std::ifstream f(filename, std::ios_base::binary);
+        if(!f)
+            throw std::runtime_error("Could not open " + filename);
+        image->geometry = CHS(40, 2, 16);
+        image->sectorSize = 256;
+        image->sizeCodes.resize(40*2*16, 1);
+        image->data.resize(40*2*16*256, 0xe5);
+        f.read(reinterpret_cast<char *>(image->data.data()), image->data.size());
+        return image;
+    }
+    std::unique_ptr<DiskDriveInterface> src =
+        std::make_unique<TelediskImageDrive>(filename);
+
+    src->size(image->geometry);
+    size_t count = image->geometry.idCylinder * image->geometry.idSide *
+                   image->geometry.idSector;
+    image->sizeCodes.resize(count, 0xff);
+    uint8_t maxCode = 0;
+    for(size_t i = 0; i < count; i++) {
+        CHS chs(i / image->geometry.idSector / image->geometry.idSide,
+                i / image->geometry.idSector % image->geometry.idSide,
+                i % image->geometry.idSector + 1);
+        uint8_t code;
+        if(src->size(chs, code)) {
+            image->sizeCodes[i] = code;
+            maxCode = std::max(maxCode, code);
+        }
+    }
+    image->sectorSize = 128 << maxCode;
+    image->data.resize(count * image->sectorSize, 0xe5);
+    for(size_t i = 0; i < count; i++) {
+        if(image->sizeCodes[i] == 0xff)
+            continue;
+        CHS chs(i / image->geometry.idSector / image->geometry.idSide,
+                i / image->geometry.idSector % image->geometry.idSide,
+                i % image->geometry.idSector + 1);
+        if(!src->read(chs, image->data.data() + i * image->sectorSize,
+                      image->sizeCodes[i]))
+            image->sizeCodes[i] = 0xff;
+    }
+    return image;
+}
+
+SharedImageDrive::SharedImageDrive(std::string const &filename) {
+    static std::mutex lock;
+    static std::map<std::string, std::weak_ptr<Image const> > images;
+
+    char *real = realpath(filename.c_str(), nullptr);
+    std::string key = real ? real : filename;
+    free(real);
+
+    std::lock_guard<std::mutex> l(lock);
+    image = images[key].lock();
+    if(!image) {
+        image = loadSharedImage(filename);
+        images[key] = image;
+    }
+}
+
+SharedImageDrive::~SharedImageDrive() {
+}
+
+void SharedImageDrive::reset() {
+}
+
+bool SharedImageDrive::write(CHS const &chs,
+                             void const *buffer, uint8_t sector_size_code) {
+    return false;
+}
+
+bool SharedImageDrive::format(uint8_t track, uint8_t head,
+                              uint8_t num_sectors, uint8_t sector_size_code) {
+    return false;
+}
+
+bool SharedImageDrive::size(CHS &chs) {
+    chs = image->geometry;
+    return true;
+}
+
+bool SharedImageDrive::read(CHS const &chs, void *buffer,
+                            uint8_t sector_size_code) {
+    size_t i = image->index(chs);
+    if(i == (size_t)-1 || image->sizeCodes[i] == 0xff)
+        return false;
+    if(image->sizeCodes[i] < sector_size_code)
+        return false;
+    memcpy(buffer, image->data.data() + i * image->sectorSize,
+           128 << sector_size_code);
+    return true;
+}
+
+bool SharedImageDrive::size(CHS const &chs, uint8_t &sector_size_code) {
+    size_t i = image->index(chs);
+    if(i == (size_t)-1 || image->sizeCodes[i] == 0xff)
+        return false;
+    sector_size_code = image->sizeCodes[i];
+    return true;
+}
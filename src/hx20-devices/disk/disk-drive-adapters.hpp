@@ -5,6 +5,7 @@
 #include <string>
 #include <memory>
 #include <fstream>
+#include <vector>
 
 namespace TeleDiskParser {
 class Disk;
@@ -46,3 +47,33 @@ public:
                       uint8_t sector_size_code) override;
     virtual bool size(CHS const &chs, uint8_t &sector_size_code) override;
 };
+
+/* An image that is read once and then shared, read-only, by every drive
+ * opening the same file this way, e.g. one system disk for a whole
+ * classroom of hx-20s. Writing and formatting fail.
+ */
+class SharedImageDrive : public DiskDriveInterface {
+public:
+    struct Image {
+        CHS geometry;//counts, sectors are numbered from 1
+        std::vector<uint8_t> sizeCodes;//0xff for missing sectors
+        std::vector<uint8_t> data;//largest sector size for each sector
+        size_t sectorSize;
+        size_t index(CHS const &chs) const;
+    };
+private:
+    std::shared_ptr<Image const> image;
+public:
+    //file is a TeleDisk image if it ends in .td0, a raw image otherwise
+    SharedImageDrive(std::string const &filename);
+    virtual ~SharedImageDrive() override;
+    virtual void reset() override;
+    virtual bool write(CHS const &chs,
+                       void const *buffer, uint8_t sector_size_code) override;
+    virtual bool format(uint8_t track, uint8_t head,
+                        uint8_t num_sectors, uint8_t sector_size_code) override;
+    virtual bool size(CHS &chs) override;
+    virtual bool read(CHS const &chs, void *buffer,
+                      uint8_t sector_size_code) override;
+    virtual bool size(CHS const &chs, uint8_t &sector_size_code) override;
+};
@@ -34,35 +34,7 @@
 #include "../../dockwidgettitlebar.hpp"
 #include "tf20drivediskimage.hpp"
 #include "tf20drivedirectory.hpp"
-
-static void hexdump(char const *buf, unsigned int size) {
-    uint16_t addr;
-    for(addr = 0; addr < size; addr+=16) {
-        printf("%04x:",addr);
-        uint16_t a2;
-        for(a2 = addr; a2 < addr+16; a2++) {
-            if((a2 & 0x3) == 0)  //4-byte seperator
-                printf(" ");
-            if(a2 < size)
-                printf(" %02x",(unsigned char)buf[a2]);
-            else
-                printf("   ");
-        }
-        printf(" ");
-        for(a2 = addr; a2 < addr+16; a2++) {
-            if(a2 < size) {
-                if(0x20 <= buf[a2] && buf[a2] < 0x7f)
-                    printf("%c",buf[a2]);
-                else
-                    printf(".");
-            } else
-                printf(" ");
-        }
-        printf("\n");
-    }
-    if((addr & 0xf) != 0xf)
-        printf("\n");
-}
+#include "../../hx20-trace.hpp"
 
 static void hx20ToUnixFilename(char *dst,uint8_t const *src) {
     char *fp = dst;
@@ -121,15 +93,20 @@ int HX20DiskDevice::getDeviceID() const {
     return 0x31+ddno;
 }
 
+//the status shown in the docks is only updated once the response is out
 void HX20DiskDevice::triggerActivityStatus(int drive_code) {
-    drive(drive_code).status_icon->setPixmap(
-    activeIcon.pixmap(
-    drive(drive_code).status_icon->style()->pixelMetric(QStyle::PM_ButtonIconSize)));
-    drive(drive_code).status_timer->start(400);
+    deferUntilResponded([this, drive_code]() {
+        drive(drive_code).status_icon->setPixmap(
+        activeIcon.pixmap(
+        drive(drive_code).status_icon->style()->pixelMetric(QStyle::PM_ButtonIconSize)));
+        drive(drive_code).status_timer->start(400);
+    });
 }
 
 void HX20DiskDevice::setCurrentFilename(int drive_code, std::string const &filename) {
-    drive(drive_code).last_file->setText(QString::fromStdString(filename));
+    deferUntilResponded([this, drive_code, filename]() {
+        drive(drive_code).last_file->setText(QString::fromStdString(filename));
+    });
 }
 
 class FileCloser {
@@ -144,9 +121,121 @@ public:
     }
 };
 
+void HX20DiskDevice::copyTrack(TF20DriveInterface *drive_src,
+                               TF20DriveInterface *drive_dst, uint8_t track) {
+    for(uint8_t sector = 0; sector < 16*2*2; sector++) {
+        uint8_t track_buf[128];
+        drive_src->disk_read(track, sector, track_buf);
+        drive_dst->disk_write(track, sector, track_buf);
+    }
+}
+
+void HX20DiskDevice::copySystemFiles(TF20DriveInterface *drive_src,
+                                     TF20DriveInterface *drive_dst) {
+    HX20_TRACE(Disk, Debug, "Copying system files\n");
+    char unix_pattern[13] = "????????.SYS";
+    uint8_t pattern[11];
+    uint8_t dir_entry[32];
+    std::string filename;
+    unixToHx20Filename(pattern, unix_pattern);
+    uint8_t search_res;
+    try {
+        drive_src->file_find_first(0, pattern, 0, dir_entry, filename);
+        search_res = BDOS_OK;
+    } catch(BDOSError const &e) {
+        search_res = e.getBDOSError();
+    }
+    while(search_res == BDOS_OK) {
+        char fn[14] = {0};
+        hx20ToUnixFilename(fn, dir_entry+1);
+        HX20_TRACE(Disk, Debug, "%s...\n", fn);
+        void *fcb_src = drive_src->file_open(0, dir_entry+1, 0);
+        if(!fcb_src) {
+            throw BDOSError(BDOS_FILE_NOT_FOUND);
+        }
+        FileCloser srccloser(drive_src, fcb_src);
+        drive_dst->file_remove(0, dir_entry+1, 0);
+        void *fcb_dst;
+        fcb_dst = drive_dst->file_create(0, dir_entry+1, 0);
+        if(!fcb_dst) {
+            throw BDOSError(BDOS_WRITE_ERROR);
+        }
+        FileCloser dstcloser(drive_src, fcb_src);
+        uint8_t extent;
+        uint8_t record;
+        uint32_t records;
+        drive_src->file_size(fcb_src, extent, record, records);
+        for(uint32_t r = 0; r < records; r++) {
+            uint8_t file_buf[128];
+            drive_src->file_read(fcb_src, r, extent, record, file_buf);
+            drive_dst->file_write(fcb_dst, file_buf, r, extent, record);
+        }
+
+        try {
+            drive_src->file_find_next(dir_entry, filename);
+            search_res = BDOS_OK;
+        } catch(BDOSError const &e) {
+            search_res = e.getBDOSError();
+        }
+    }
+}
+
+int HX20DiskDevice::startProgress(uint16_t sid, uint16_t did, uint8_t fnc,
+                                  HX20SerialConnection *conn,
+                                  std::function<bool(uint8_t *obuf)> step) {
+    progress = std::make_unique<ProgressReply>();
+    progress->sid = sid;
+    progress->did = did;
+    progress->fnc = fnc;
+    progress->conn = conn;
+    progress->step = std::move(step);
+    return sendProgress();
+}
+
+int HX20DiskDevice::sendProgress() {
+    uint8_t obuf[0x3] = {0};
+    bool more;
+    try {
+        more = progress->step(obuf);
+    } catch(BDOSError const &e) {
+        obuf[0x0] = 0xff;//msb of currently formatted track number
+        obuf[0x1] = 0xff;//lsb of currently formatted track number
+        obuf[0x2] = e.getBDOSError();
+        more = false;
+    }
+    uint16_t sid = progress->sid;
+    uint16_t did = progress->did;
+    uint8_t fnc = progress->fnc;
+    HX20SerialConnection *conn = progress->conn;
+    if(!more)
+        progress.reset();
+    int res = conn->sendPacket(did, sid, fnc, 3, obuf);
+    if(res != 0)
+        progress.reset();
+    return res;
+}
+
+void HX20DiskDevice::sendComplete(uint16_t sid, uint16_t did, uint8_t fnc,
+                                  int result) {
+    if(!progress || sid != progress->sid || did != progress->did ||
+            fnc != progress->fnc)
+        return;
+    if(result != 0) {
+        HX20_TRACE(Disk, Warning, "hx20 did not take the progress of fnc 0x%02x, stopping\n",
+                   fnc);
+        progress.reset();
+        return;
+    }
+    if(sendProgress() != 0)
+        HX20_TRACE(Disk, Error, "sending the progress of fnc 0x%02x failed, stopping\n",
+                   fnc);
+}
+
 int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
                               uint16_t size, uint8_t *ibuf,
                               HX20SerialConnection *conn) {
+    //a new request means the hx20 is done waiting for the last one
+    progress.reset();
     switch(fnc) {
     case 0x00: { //system reset
         /*
@@ -155,7 +244,7 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
          */
         uint8_t obuf[0x1] = {0};
         obuf[0x0] = BDOS_OK;
-        return conn->sendPacket(did, sid, fnc, 0x1, obuf);
+        return conn->sendPacket(replies.get(did, sid, fnc, 0x1, obuf));
     }
     //case 0x01: broken; 0 byte in, 1 byte out. probably: console in. actually: console out.
     //case 0x02: broken; 0 byte in, 1 byte out. probably: console out. actually: aux out.
@@ -172,7 +261,7 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         triggerActivityStatus(2);
         uint8_t obuf[1] = {0};
         obuf[0] = 0;
-        return conn->sendPacket(did, sid, fnc, 1, obuf);
+        return conn->sendPacket(replies.get(did, sid, fnc, 1, obuf));
     }
     case 0x0e: { // drive select
         /*
@@ -186,7 +275,7 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         triggerActivityStatus(drive_code);
         uint8_t obuf[1] = {0};
         obuf[0] = 0;
-        return conn->sendPacket(did, sid, fnc, 1, obuf);
+        return conn->sendPacket(replies.get(did, sid, fnc, 1, obuf));
     }
     case 0x0f: //file open
     case 0x16: { //file create (those two are very similar on unix)
@@ -211,9 +300,9 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         uint8_t us = (ibuf[2] & 0xe0) | user;
         uint8_t extent = ibuf[0x0e];
         triggerActivityStatus(drive_code);
-        printf("hx20 tries to %s %s(extent %d) on drive %d for fcb at 0x%04x.\n",
-               fnc == 0x0f?"open":"create",
-               filename,extent,drive_code,hx20FcbAddress);
+        HX20_TRACE(Disk, Info, "hx20 tries to %s %s(extent %d) on drive %d for fcb at 0x%04x.\n",
+                   fnc == 0x0f?"open":"create",
+                   filename,extent,drive_code,hx20FcbAddress);
         uint8_t obuf[1] = {0};
         try {
             if(!drive(drive_code).drive) {
@@ -228,7 +317,7 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
             }
             if(!fcb) {
                 obuf[0] = BDOS_FILE_NOT_FOUND;
-                return conn->sendPacket(did, sid, fnc, 1, obuf);
+                return conn->sendPacket(replies.get(did, sid, fnc, 1, obuf));
             }
             if(fcbs[hx20FcbAddress].fcb) {
                 fcbs[hx20FcbAddress].drive->file_close(fcbs[hx20FcbAddress].fcb);
@@ -242,7 +331,7 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         } catch(BDOSError const &e) {
             obuf[0] = e.getBDOSError();
         }
-        return conn->sendPacket(did, sid, fnc, 1, obuf);
+        return conn->sendPacket(replies.get(did, sid, fnc, 1, obuf));
     }
     case 0x10: { //file close
         /*
@@ -255,8 +344,8 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         if(size != 0x02)
             return 0;
         uint16_t hx20FcbAddress = (ibuf[0] << 8) | ibuf[1];//only usable as key into a fcb map, i guess
-        printf("hx20 tries to close fcb at 0x%04x.\n",
-               hx20FcbAddress);
+        HX20_TRACE(Disk, Info, "hx20 tries to close fcb at 0x%04x.\n",
+                   hx20FcbAddress);
         uint8_t obuf[1] = {0};
         try {
             if(fcbs.find(hx20FcbAddress) == fcbs.end()) {
@@ -271,7 +360,7 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         } catch(BDOSError const &e) {
             obuf[0] = e.getBDOSError();
         }
-        return conn->sendPacket(did, sid, fnc, 1, obuf);
+        return conn->sendPacket(replies.get(did, sid, fnc, 1, obuf));
     }
     case 0x11: { //findfirst
         /*
@@ -300,10 +389,10 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         hx20ToUnixFilename(pattern,ibuf+1);
         uint8_t drive_code = ibuf[0];
         uint8_t extent = ibuf[1+8+3];
-        printf("hx20 requested first file matching %s\n",
-               pattern);
-        printf("extent number %d\n",extent);
-        printf("from drive %d\n",drive_code);
+        HX20_TRACE(Disk, Info, "hx20 requested first file matching %s\n",
+                   pattern);
+        HX20_TRACE(Disk, Debug, "extent number %d\n",extent);
+        HX20_TRACE(Disk, Debug, "from drive %d\n",drive_code);
 
         triggerActivityStatus(drive_code);
 
@@ -349,7 +438,7 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         if(size != 0x01)
             return 0;
         //would the single byte be the driveCode? protocol says to ignore.
-        printf("hx20 requested next file\n");
+        HX20_TRACE(Disk, Info, "hx20 requested next file\n");
 
         uint8_t obuf[0x21] = {0};
 
@@ -386,8 +475,8 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         uint8_t drive_code = ibuf[0];
         uint8_t us = (ibuf[0] & 0xe0) | user;
         uint8_t extent = ibuf[0x0c];
-        printf("hx20 tries to delete %s(extent %d) on drive %d.\n",
-               filename,extent,drive_code);
+        HX20_TRACE(Disk, Info, "hx20 tries to delete %s(extent %d) on drive %d.\n",
+                   filename,extent,drive_code);
         triggerActivityStatus(drive_code);
 
         uint8_t obuf[0x1] = {0};
@@ -406,7 +495,7 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
 
         setCurrentFilename(drive_code, filename);
 
-        return conn->sendPacket(did, sid, fnc, 1, obuf);
+        return conn->sendPacket(replies.get(did, sid, fnc, 1, obuf));
     }
     case 0x14: { // file read at extent and record position
         /*
@@ -426,8 +515,8 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         uint16_t hx20FcbAddress = (ibuf[0] << 8) | ibuf[1];
         uint8_t extent = ibuf[2];
         uint8_t record = ibuf[3];
-        printf("hx20 tries to read record %d(%d,%d) to fcb at 0x%04x.\n",
-               record+extent*128,extent,record,hx20FcbAddress);
+        HX20_TRACE(Disk, Debug, "hx20 tries to read record %d(%d,%d) to fcb at 0x%04x.\n",
+                   record+extent*128,extent,record,hx20FcbAddress);
 
         uint8_t obuf[0x83] = {0};
 
@@ -472,8 +561,8 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         uint16_t hx20FcbAddress = (ibuf[0] << 8) | ibuf[1];
         uint8_t extent = ibuf[2];
         uint8_t record = ibuf[3];
-        printf("hx20 tries to write record %d(%d,%d) to fcb at 0x%04x.\n",
-               record+extent*128,extent,record,hx20FcbAddress);
+        HX20_TRACE(Disk, Debug, "hx20 tries to write record %d(%d,%d) to fcb at 0x%04x.\n",
+                   record+extent*128,extent,record,hx20FcbAddress);
 
 
         uint8_t obuf[3] = {0};
@@ -531,8 +620,8 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         uint8_t us_new = ibuf[0x10];
         uint8_t extent_new = ibuf[0x1c];
         triggerActivityStatus(drive_code);
-        printf("hx20 tries to rename file %s(extent %d) to %s(%d) on drive %d\n",
-               filename_old,extent_old,filename_new,extent_new,drive_code);
+        HX20_TRACE(Disk, Info, "hx20 tries to rename file %s(extent %d) to %s(%d) on drive %d\n",
+                   filename_old,extent_old,filename_new,extent_new,drive_code);
         uint8_t obuf[1] = {0};
         try {
             if(!drive(drive_code).drive) {
@@ -549,7 +638,7 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
 
         setCurrentFilename(drive_code, filename_new);
 
-        return conn->sendPacket(did, sid, fnc, 1, obuf);
+        return conn->sendPacket(replies.get(did, sid, fnc, 1, obuf));
     }
     case 0x1a: { //sets the BDOS buffer to memory address 0x80; no parameters
         /*
@@ -558,7 +647,7 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
          */
         uint8_t obuf[0x1] = {0};
         obuf[0x0] = BDOS_OK;
-        return conn->sendPacket(did, sid, fnc, 0x1, obuf);
+        return conn->sendPacket(replies.get(did, sid, fnc, 0x1, obuf));
     }
     case 0x1c: { //set write protect
         //this sets the current drive to be write protected until eiter
@@ -570,7 +659,7 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
          */
         uint8_t obuf[0x1] = {0};
         obuf[0x0] = BDOS_OK;
-        return conn->sendPacket(did, sid, fnc, 0x1, obuf);
+        return conn->sendPacket(replies.get(did, sid, fnc, 0x1, obuf));
     }
     case 0x20: { //broken; set user num
         //tries to call BDOS function 64 instead of 32.
@@ -584,7 +673,7 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
          */
         uint8_t obuf[0x1] = {0};
         obuf[0x0] = BDOS_OK;
-        return conn->sendPacket(did, sid, fnc, 0x1, obuf);
+        return conn->sendPacket(replies.get(did, sid, fnc, 0x1, obuf));
     }
     case 0x21: { //read record from file
         /*
@@ -602,8 +691,8 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
             return 0;
         uint16_t hx20FcbAddress = (ibuf[0] << 8) | ibuf[1];
         uint32_t record = (ibuf[0x4] << 16) | (ibuf[0x3] << 8) | ibuf[0x2];
-        printf("hx20 tries to read record %d to fcb at 0x%04x.\n",
-               record,hx20FcbAddress);
+        HX20_TRACE(Disk, Debug, "hx20 tries to read record %d to fcb at 0x%04x.\n",
+                   record,hx20FcbAddress);
 
         uint8_t obuf[0x83] = {0};
 
@@ -649,8 +738,8 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
             return 0;
         uint16_t hx20FcbAddress = (ibuf[0] << 8) | ibuf[1];
         uint32_t record = (ibuf[0x84] << 16) | (ibuf[0x83] << 8) | ibuf[0x82];
-        printf("hx20 tries to write record %d to fcb at 0x%04x.\n",
-               record,hx20FcbAddress);
+        HX20_TRACE(Disk, Debug, "hx20 tries to write record %d to fcb at 0x%04x.\n",
+                   record,hx20FcbAddress);
 
 
         uint8_t obuf[3] = {0};
@@ -699,8 +788,8 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         if(size != 0x02)
             return 0;
         uint16_t hx20FcbAddress = (ibuf[0] << 8) | ibuf[1];//only usable as key into a fcb map, i guess
-        printf("hx20 tries to calculate size of fcb at 0x%04x.\n",
-               hx20FcbAddress);
+        HX20_TRACE(Disk, Debug, "hx20 tries to calculate size of fcb at 0x%04x.\n",
+                   hx20FcbAddress);
         uint8_t obuf[6] = {0};
         try {
             if(fcbs.find(hx20FcbAddress) == fcbs.end()) {
@@ -742,8 +831,8 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         if(size != 0x02)
             return 0;
         uint16_t hx20FcbAddress = (ibuf[0] << 8) | ibuf[1];//only usable as key into a fcb map, i guess
-        printf("hx20 tries to tell position of fcb at 0x%04x.\n",
-               hx20FcbAddress);
+        HX20_TRACE(Disk, Debug, "hx20 tries to tell position of fcb at 0x%04x.\n",
+                   hx20FcbAddress);
         uint8_t obuf[4] = {0};
         try {
             if(fcbs.find(hx20FcbAddress) == fcbs.end()) {
@@ -779,7 +868,7 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         fcbs.clear();
         uint8_t obuf[0x1] = {0};
         obuf[0x0] = BDOS_OK;
-        return conn->sendPacket(did, sid, fnc, 0x1, obuf);
+        return conn->sendPacket(replies.get(did, sid, fnc, 0x1, obuf));
     }
     case 0x79: {//flush HXBIOS sector cache
         /*
@@ -788,7 +877,7 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
          */
         uint8_t obuf[0x1] = {0};
         obuf[0x0] = BDOS_OK;
-        return conn->sendPacket(did, sid, fnc, 0x1, obuf);
+        return conn->sendPacket(replies.get(did, sid, fnc, 0x1, obuf));
     }
     case 0x7a: { // disk all copy
         /*
@@ -802,48 +891,33 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         if(size != 0x1)
             return 0;
         uint8_t drive_code = ibuf[0];
-        printf("hx20 tries to copy disk in drive %d\n",
-               drive_code);
-        uint8_t obuf[0x3] = {0};
-        obuf[0x0] = 0xff;//msb of currently formatted track number
-        obuf[0x1] = 0xff;//lsb of currently formatted track number
-        triggerActivityStatus(1);
-        triggerActivityStatus(2);
+        HX20_TRACE(Disk, Info, "hx20 tries to copy disk in drive %d\n",
+                   drive_code);
 
         if(drive_code == 0)//seems to assume code 0 is also 1 => 2 copy
             drive_code = 1;
-        try {
+        uint8_t track = 0;
+        return startProgress(sid, did, fnc, conn,
+        [this, drive_code, track](uint8_t *obuf) mutable {
+            triggerActivityStatus(1);
+            triggerActivityStatus(2);
             if(!drive(1).drive || !drive(2).drive) {
                 throw BDOSError(BDOS_READ_ERROR);
             }
-            TF20DriveInterface *drive_src = drive(drive_code).drive.get();
-            TF20DriveInterface *drive_dst = drive(3-drive_code).drive.get();
-
-            for(uint8_t track = 0; track < 40; track++) {
-                for(uint8_t sector = 0; sector < 16*2*2; sector++) {
-                    uint8_t track_buf[128];
-                    drive_src->disk_read(track, sector, track_buf);
-                    drive_dst->disk_write(track, sector, track_buf);
-                    if(sector == 0) {
-                        obuf[0x0] = 0;
-                        obuf[0x1] = track;
-                        obuf[0x2] = BDOS_OK;
-                        int res = conn->sendPacket(did, sid, fnc, 3, obuf);
-                        if(res != 0)
-                            return res;
-                    }
-                }
+            if(track == 40) {
+                obuf[0x0] = 0xff;//msb of currently formatted track number
+                obuf[0x1] = 0xff;//lsb of currently formatted track number
+                obuf[0x2] = BDOS_OK;
+                return false;
             }
-
-            obuf[0x0] = 0xff;//msb of currently formatted track number
-            obuf[0x1] = 0xff;//lsb of currently formatted track number
+            copyTrack(drive(drive_code).drive.get(),
+                      drive(3-drive_code).drive.get(), track);
+            obuf[0x0] = 0;
+            obuf[0x1] = track;
             obuf[0x2] = BDOS_OK;
-        } catch(BDOSError const &e) {
-            obuf[0x0] = 0xff;//msb of currently formatted track number
-            obuf[0x1] = 0xff;//lsb of currently formatted track number
-            obuf[0x2] = e.getBDOSError();
-        }
-        return conn->sendPacket(did, sid, fnc, 3, obuf);
+            track++;
+            return true;
+        });
     }
     case 0x78: //direct write going through HXBIOS caches
     case 0x7b: { //direct write going through BDOS caches(that exclude HXBIOS caches)
@@ -862,8 +936,8 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         uint8_t drive_code = ibuf[0];
         uint8_t track = ibuf[1];
         uint8_t sector = ibuf[2];//128 byte sectors
-        printf("hx20 tries do direct read from drive %d, track %d, sector %d\n",
-               drive_code,track,sector);
+        HX20_TRACE(Disk, Debug, "hx20 tries do direct read from drive %d, track %d, sector %d\n",
+                   drive_code,track,sector);
         uint8_t obuf[0x1] = {0};
         triggerActivityStatus(drive_code);
 
@@ -877,7 +951,7 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         } catch(BDOSError const &e) {
             obuf[0x0] = e.getBDOSError();
         }
-        return conn->sendPacket(did, sid, fnc, 0x1, obuf);
+        return conn->sendPacket(replies.get(did, sid, fnc, 0x1, obuf));
     }
     case 0x7c: { // disk formatting
         /*
@@ -891,37 +965,32 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         if(size != 0x1)
             return 0;
         uint8_t drive_code = ibuf[0];
-        printf("hx20 tries to format disk in drive %d\n",
-               drive_code);
-        uint8_t obuf[0x3] = {0};
-        triggerActivityStatus(drive_code);
-
-        try {
+        HX20_TRACE(Disk, Info, "hx20 tries to format disk in drive %d\n",
+                   drive_code);
+
+        //each track is formatted once the hx20 has taken its number
+        uint8_t track = 0;
+        return startProgress(sid, did, fnc, conn,
+        [this, drive_code, track](uint8_t *obuf) mutable {
+            triggerActivityStatus(drive_code);
             if(!drive(drive_code).drive) {
                 throw BDOSError(BDOS_READ_ERROR);
             }
-            TF20DriveInterface *drive = this->drive(drive_code).drive.get();
-
-            for(uint8_t track = 0; track != 39; track++) {
-                printf("format track %d\n", track);
-                obuf[0x0] = 0;
-                obuf[0x1] = track;
+            if(track > 0)
+                drive(drive_code).drive->disk_format(track - 1);
+            if(track == 39) {
+                obuf[0x0] = 0xff;//msb of currently formatted track number
+                obuf[0x1] = 0xff;//lsb of currently formatted track number
                 obuf[0x2] = 0;
-                int res = conn->sendPacket(did, sid, fnc, 3, obuf);
-                if(res != 0)
-                    return res;
-                drive->disk_format(track);
+                return false;
             }
-
-            obuf[0x0] = 0xff;//msb of currently formatted track number
-            obuf[0x1] = 0xff;//lsb of currently formatted track number
+            HX20_TRACE(Disk, Debug, "format track %d\n", track);
+            obuf[0x0] = 0;
+            obuf[0x1] = track;
             obuf[0x2] = 0;
-        } catch(BDOSError const &e) {
-            obuf[0x0] = 0xff;//msb of currently formatted track number
-            obuf[0x1] = 0xff;//lsb of currently formatted track number
-            obuf[0x2] = e.getBDOSError();
-        }
-        return conn->sendPacket(did, sid, fnc, 3, obuf);
+            track++;
+            return true;
+        });
     }
     case 0x7d: { // new system generation
         /*
@@ -934,94 +1003,37 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
          */
         if(size != 0x1)
             return 0;
-        printf("hx20 tries to create a system disk in 2nd drive from the system in 1st drive\n");
-        uint8_t obuf[0x3] = {0};
-        triggerActivityStatus(1);
-        triggerActivityStatus(2);
+        HX20_TRACE(Disk, Info, "hx20 tries to create a system disk in 2nd drive from the system in 1st drive\n");
 
-        try {
+        //the first four tracks directly, one progress packet each
+        uint8_t track = 0;
+        return startProgress(sid, did, fnc, conn,
+        [this, track](uint8_t *obuf) mutable {
+            triggerActivityStatus(1);
+            triggerActivityStatus(2);
             if(!drive(1).drive || !drive(2).drive) {
                 throw BDOSError(BDOS_READ_ERROR);
             }
             TF20DriveInterface *drive_src = drive(1).drive.get();
             TF20DriveInterface *drive_dst = drive(2).drive.get();
-
-            //directly copy the first four tracks
-            printf("Copying boot tracks\n");
-            for(uint8_t track = 0; track < 4; track++) {
-                for(uint8_t sector = 0; sector < 16*2*2; sector++) {
-                    uint8_t track_buf[128];
-                    drive_src->disk_read(track, sector, track_buf);
-                    drive_dst->disk_write(track, sector, track_buf);
-                    if(sector == 0) {
-                        obuf[0x0] = 0;
-                        obuf[0x1] = 0;
-                        obuf[0x2] = 0;
-                        int res = conn->sendPacket(did, sid, fnc, 3, obuf);
-                        if(res != 0)
-                            return res;
-                    }
-                }
-            }
-
-            printf("Copying system files\n");
-            char unix_pattern[13] = "????????.SYS";
-            uint8_t pattern[11];
-            uint8_t dir_entry[32];
-            std::string filename;
-            unixToHx20Filename(pattern, unix_pattern);
-            uint8_t search_res;
-            try {
-                drive_src->file_find_first(0, pattern, 0, dir_entry, filename);
-                search_res = BDOS_OK;
-            } catch(BDOSError const &e) {
-                search_res = e.getBDOSError();
-            }
-            while(search_res == BDOS_OK) {
-                char fn[14] = {0};
-                hx20ToUnixFilename(fn, dir_entry+1);
-                printf("%s...\n", fn);
-                void *fcb_src = drive_src->file_open(0, dir_entry+1, 0);
-                if(!fcb_src) {
-                    throw BDOSError(BDOS_FILE_NOT_FOUND);
-                }
-                FileCloser srccloser(drive_src, fcb_src);
-                drive_dst->file_remove(0, dir_entry+1, 0);
-                void *fcb_dst;
-                fcb_dst = drive_dst->file_create(0, dir_entry+1, 0);
-                if(!fcb_dst) {
-                    throw BDOSError(BDOS_WRITE_ERROR);
-                }
-                FileCloser dstcloser(drive_src, fcb_src);
-                uint8_t extent;
-                uint8_t record;
-                uint32_t records;
-                drive_src->file_size(fcb_src, extent, record, records);
-                for(uint32_t r = 0; r < records; r++) {
-                    uint8_t file_buf[128];
-                    drive_src->file_read(fcb_src, r, extent, record, file_buf);
-                    drive_dst->file_write(fcb_dst, file_buf, r, extent, record);
-                    obuf[2] = BDOS_OK;
-                }
-
-                try {
-                    drive_src->file_find_next(dir_entry, filename);
-                    search_res = BDOS_OK;
-                } catch(BDOSError const &e) {
-                    search_res = e.getBDOSError();
-                }
+            if(track < 4) {
+                if(track == 0)
+                    HX20_TRACE(Disk, Debug, "Copying boot tracks\n");
+                copyTrack(drive_src, drive_dst, track);
+                obuf[0x0] = 0;
+                obuf[0x1] = 0;
+                obuf[0x2] = 0;
+                track++;
+                return true;
             }
-            printf("Done\n");
+            copySystemFiles(drive_src, drive_dst);
+            HX20_TRACE(Disk, Debug, "Done\n");
 
             obuf[0x0] = 0xff;//
             obuf[0x1] = 0xff;//done, 0x0000 => not done
             obuf[0x2] = BDOS_OK;
-        } catch(BDOSError const &e) {
-            obuf[0x0] = 0xff;//msb of currently formatted track number
-            obuf[0x1] = 0xff;//lsb of currently formatted track number
-            obuf[0x2] = e.getBDOSError();
-        }
-        return conn->sendPacket(did, sid, fnc, 3, obuf);
+            return false;
+        });
     }
     case 0x7e: { //disk free size calculation
         /*
@@ -1035,8 +1047,8 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         if(size != 0x01)
             return 0;
         uint8_t drive_code = ibuf[0];
-        printf("hx20 tries to calculate free space of drive %d\n",
-               drive_code);
+        HX20_TRACE(Disk, Info, "hx20 tries to calculate free space of drive %d\n",
+                   drive_code);
         uint8_t obuf[2] = {0};
         triggerActivityStatus(drive_code);
 
@@ -1072,8 +1084,8 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         uint8_t drive_code = ibuf[0];
         uint8_t track = ibuf[1];
         uint8_t sector = ibuf[2];//128 byte sectors
-        printf("hx20 tries do direct read from drive %d, track %d, sector %d\n",
-               drive_code,track,sector);
+        HX20_TRACE(Disk, Debug, "hx20 tries do direct read from drive %d, track %d, sector %d\n",
+                   drive_code,track,sector);
         uint8_t obuf[0x81] = {0};
         triggerActivityStatus(drive_code);
 
@@ -1104,8 +1116,8 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
             return 0;
         char unixfilename[13];
         snprintf(unixfilename,13,"BOOT%02X.SYS",ibuf[0]);
-        drive(1).last_file->setText(unixfilename);
-        printf("hx20 requested %s\n",unixfilename);
+        setCurrentFilename(1, unixfilename);
+        HX20_TRACE(Disk, Info, "hx20 requested %s\n",unixfilename);
         triggerActivityStatus(1);
         uint8_t filename[11];
         unixToHx20Filename(filename, unixfilename);
@@ -1155,19 +1167,19 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
          */
 
         std::string filename = hx20ToUnixFilename(ibuf);
-        drive(1).last_file->setText(QString::fromStdString(filename));
-        printf("hx20 requested %s\n",
-               filename.c_str());
+        setCurrentFilename(1, filename);
+        HX20_TRACE(Disk, Info, "hx20 requested %s\n",
+                   filename.c_str());
         uint8_t reloc_type = ibuf[11];
-        printf("relocation: %s\n",
-               reloc_type==0?"none":
-               reloc_type==1?"from starting address":
-               reloc_type==2?"from ending address":
-               "unknown");
+        HX20_TRACE(Disk, Debug, "relocation: %s\n",
+                   reloc_type==0?"none":
+                   reloc_type==1?"from starting address":
+                   reloc_type==2?"from ending address":
+                   "unknown");
         uint16_t reloc_address = ibuf[13] | (ibuf[12] << 8);
-        printf("address: 0x%04x\n",
-               reloc_address
-              );
+        HX20_TRACE(Disk, Debug, "address: 0x%04x\n",
+                   reloc_address
+                  );
 
         uint8_t obuf[3] = {0};
 
@@ -1189,7 +1201,7 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
             uint32_t records;
             drive->file_size(fcb, extent, record, records);
             load_buffer.resize(records * 128);
-            printf("drive reported %d records\n", records);
+            HX20_TRACE(Disk, Debug, "drive reported %d records\n", records);
             for(uint32_t r = 0; r < records; r++) {
                 drive->file_read(fcb, r, extent, record, load_buffer.data() + 128*r);
             }
@@ -1209,13 +1221,13 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
                     reloc_offset =
                     reloc_address >> 8;
                 reloc_offset -= 0x60;
-                printf("relocation offset = 0x%02x\n",
-                       reloc_offset);
+                HX20_TRACE(Disk, Debug, "relocation offset = 0x%02x\n",
+                           reloc_offset);
 
                 uint8_t *bp = load_buffer.data()+0x100;
                 uint8_t *mp = bp+code_size;
-                printf("buffer: %p, bp: %p, mp: %p, code size: 0x%x\n",
-                       load_buffer.data(),bp,mp,code_size);
+                HX20_TRACE(Disk, Debug, "buffer: %p, bp: %p, mp: %p, code size: 0x%x\n",
+                           load_buffer.data(),bp,mp,code_size);
                 uint8_t t = 0x80;
                 for(;
                         bp < load_buffer.data()+0x100+code_size;
@@ -1233,7 +1245,7 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
             obuf[0] = BDOS_OK;
             obuf[1] = code_size >> 8;
             obuf[2] = code_size;
-            hexdump((char *)obuf,3);
+            HX20_TRACE_HEX(Disk, Debug, "load open answer", obuf, 3);
         } catch(BDOSError const &e) {
             obuf[0] = e.getBDOSError();
         }
@@ -1250,7 +1262,7 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
          * 130: status
          */
         unsigned int record = (ibuf[0] << 8) | ibuf[1];
-        printf("hx20 requested record 0x%02x\n",record);
+        HX20_TRACE(Disk, Debug, "hx20 requested record 0x%02x\n",record);
         uint8_t obuf[2+128+1] = {0};
         triggerActivityStatus(1);
         try {
@@ -1276,18 +1288,18 @@ int HX20DiskDevice::gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
         } catch(BDOSError const &e) {
             obuf[2+128] = e.getBDOSError();
         }
-        hexdump((char *)obuf,128+3);
+        HX20_TRACE_HEX(Disk, Debug, "load record", obuf, 128+3);
         return conn->sendPacket(did, sid, fnc, 2+128+1, obuf);
     }
     default: {
-        printf("HX20DiskDevice: got packet: sid = 0x%04x, did = 0x%04x, "
-               "fnc = 0x%02x, size = 0x%04x\n",
-               sid,did,fnc,size);
-        hexdump((char *)ibuf,size);
+        HX20_TRACE(Disk, Warning, "HX20DiskDevice: got packet: sid = 0x%04x, did = 0x%04x, "
+                   "fnc = 0x%02x, size = 0x%04x\n",
+                   sid,did,fnc,size);
+        HX20_TRACE_HEX(Disk, Warning, "unknown function", ibuf, size);
         //TFDOS returns 1 byte/BDOS_OK for anything it does not know
         uint8_t obuf[0x1] = {0};
         obuf[0x0] = BDOS_OK;
-        return conn->sendPacket(did, sid, fnc, 0x1, obuf);
+        return conn->sendPacket(replies.get(did, sid, fnc, 0x1, obuf));
     }
     }
 }
@@ -1373,6 +1385,9 @@ void HX20DiskDevice::setDiskFile(int drive_code, std::string const &file,
     case TF20DriveDiskImageFileType::TeleDisk:
         tgtval = "teledisk" + tgtval;
         break;
+    case TF20DriveDiskImageFileType::SharedReadOnly:
+        tgtval = "ro" + tgtval;
+        break;
     default:
         break;
     }
@@ -1512,6 +1527,9 @@ void HX20DiskDevice::setDiskUrl(int drive_code, QString const &url) {
     } else if(url.startsWith("telediskfile://")) {
         setDiskFile(drive_code, url.mid(15).toStdString(),
                     TF20DriveDiskImageFileType::TeleDisk);
+    } else if(url.startsWith("rofile://")) {
+        setDiskFile(drive_code, url.mid(9).toStdString(),
+                    TF20DriveDiskImageFileType::SharedReadOnly);
     }
 }
 
@@ -2,6 +2,7 @@
 #pragma once
 
 #include <map>
+#include <functional>
 #include <stdint.h>
 #include <QObject>
 #include <QIcon>
@@ -37,6 +38,17 @@ private:
         uint8_t drive_code;
         TF20DriveInterface *drive;
     };
+    /* A reply that goes out as a series of packets, each one only once
+     * the hx-20 has taken the one before. step does the next piece of
+     * work and fills in the 3 byte packet, returning false for the last.
+     */
+    struct ProgressReply {
+        uint16_t sid;
+        uint16_t did;
+        uint8_t fnc;
+        HX20SerialConnection *conn;
+        std::function<bool(uint8_t *obuf)> step;
+    };
     struct DriveInfo {
         uint8_t drive_code;
         std::unique_ptr<TF20DriveInterface> drive;
@@ -51,6 +63,8 @@ private:
     std::vector<uint8_t> load_buffer;
     DirSearchInfo dirSearch;
     std::map<uint16_t,FCBInfo> fcbs;
+    //the answers that only carry a status
+    HX20PreparedPacketCache replies;
     int ddno;
     QIcon activeIcon;
     QIcon inactiveIcon;
@@ -58,6 +72,7 @@ private:
     DriveInfo drive_2;
     Settings::Group *settingsConfig;
     Settings::Group *settingsPresets;
+    std::unique_ptr<ProgressReply> progress;
 
     DriveInfo &drive(uint8_t drive_code);
     DriveInfo const &drive(uint8_t drive_code) const;
@@ -67,11 +82,21 @@ private:
     void installNewDrive(int drive_code,
                          std::unique_ptr<TF20DriveInterface> &&new_drive,
                          QString const &title);
+    void copyTrack(TF20DriveInterface *drive_src,
+                   TF20DriveInterface *drive_dst, uint8_t track);
+    void copySystemFiles(TF20DriveInterface *drive_src,
+                         TF20DriveInterface *drive_dst);
+    int startProgress(uint16_t sid, uint16_t did, uint8_t fnc,
+                      HX20SerialConnection *conn,
+                      std::function<bool(uint8_t *obuf)> step);
+    int sendProgress();
 protected:
     virtual int getDeviceID() const override;
     virtual int gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
                           uint16_t size, uint8_t *buf,
                           HX20SerialConnection *conn) override;
+    virtual void sendComplete(uint16_t sid, uint16_t did, uint8_t fnc,
+                              int result) override;
 public:
     HX20DiskDevice(int ddno = 0);
     ~HX20DiskDevice();
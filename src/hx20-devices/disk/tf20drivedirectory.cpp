@@ -2,6 +2,7 @@
 #include "tf20drivedirectory.hpp"
 
 #include "../../../../src/hx20-ser-proto.hpp"
+#include "../../hx20-trace.hpp"
 
 #include <string.h>
 #include <dirent.h>
@@ -110,7 +111,7 @@ uint8_t DirSearch::findNext(uint8_t *obuf) {
     uint8_t res;
     struct dirent *de;
     while((de = readdir())) {
-        printf("seeing %s\n",de->d_name);
+        HX20_TRACE(Drive, Debug, "seeing %s\n", de->d_name);
         if(matchFilename(de->d_name,pattern.c_str()) &&
                 unixToHx20Filename(obuf+1,de->d_name)) {
             filename = de->d_name;
@@ -119,7 +120,7 @@ uint8_t DirSearch::findNext(uint8_t *obuf) {
                 throw IOError(errno, std::system_category(), "Could not stat file in dir");
             }
             bool canwrite = faccessat(dirfd(dir), de->d_name, W_OK, 0) == 0;
-            printf("found %s\n",de->d_name);
+            HX20_TRACE(Drive, Debug, "found %s\n", de->d_name);
             res = 0x00;
             obuf[0] = 0;
             //obuf[0]: 0
@@ -2,6 +2,7 @@
 #include "tf20drivediskimage.hpp"
 
 #include "disk-drive-adapters.hpp"
+#include "../../hx20-trace.hpp"
 
 #include <sstream>
 #include <string.h>
@@ -32,52 +33,40 @@ static bool dirent_compare_ignore_position(uint8_t const *n1, uint8_t const *n2)
 
 static bool dirent_compare_ignore_position(uint8_t const *ent, uint8_t p_us,
         uint8_t const *pattern, uint8_t p_ext) {
-    if(p_us != '?' && ent[0] != p_us) {
-        printf("\n");
+    if(p_us != '?' && ent[0] != p_us)
         return false;
-    }
     for(int i = 0; i < 11; i++) {
         if((pattern[i] & 0x7f) != (ent[i+1] & 0x7f) &&
-                pattern[i] != '?') {
-            printf("\n");
+                pattern[i] != '?')
             return false;
-        }
     }
-    if(p_ext != '?' && (ent[12] & 0xe0) != (p_ext & 0xe0)) {
-        printf("\n");
+    if(p_ext != '?' && (ent[12] & 0xe0) != (p_ext & 0xe0))
         return false;
-    }
-    printf(" match\n");
     return true;
 }
 
 static bool dirent_match(uint8_t const *ent,
                          uint8_t p_us, uint8_t const *pattern, uint8_t p_ext) {
-    printf("matching dirent %d %s %d against pattern %d %s %d...",
-           int(ent[0]), hx20ToUnixFilename(ent+1).c_str(), int(ent[12]),
-           int(p_us), hx20ToUnixFilename(pattern).c_str(), int(p_ext));
-    if(p_us != '?' && ent[0] != p_us) {
-        printf("\n");
-        return false;
-    }
-    for(int i = 0; i < 11; i++) {
+    bool res = true;
+    if(p_us != '?' && ent[0] != p_us)
+        res = false;
+    for(int i = 0; res && i < 11; i++) {
         if((pattern[i] & 0x7f) != (ent[i+1] & 0x7f) &&
-                pattern[i] != '?') {
-            printf("\n");
-            return false;
-        }
-    }
-    if(p_ext != '?' && (ent[12] & 0xfe) != (p_ext & 0xfe)) {
-        printf("\n");
-        return false;
+                pattern[i] != '?')
+            res = false;
     }
-    printf(" match\n");
-    return true;
+    if(res && p_ext != '?' && (ent[12] & 0xfe) != (p_ext & 0xfe))
+        res = false;
+    HX20_TRACE(Drive, Debug, "matching dirent %d %s %d against pattern %d %s %d...%s\n",
+               int(ent[0]), hx20ToUnixFilename(ent+1).c_str(), int(ent[12]),
+               int(p_us), hx20ToUnixFilename(pattern).c_str(), int(p_ext),
+               res?" match":"");
+    return res;
 }
 
 static bool read_dir_extent(DiskDriveInterface *drive, uint8_t extent, uint8_t *dir_ent) {
     uint8_t buf[256];
-    printf("Read dirent, sector %d,%d,%d, offset +0x%x\n", 4, 0, (extent >> 3)+1, (extent & 0x7)*32);
+    HX20_TRACE(Drive, Verbose, "Read dirent, sector %d,%d,%d, offset +0x%x\n", 4, 0, (extent >> 3)+1, (extent & 0x7)*32);
     CHS chs(4,0,(extent >> 3)+1);
     if(!drive->read(chs, buf, 1)) {
         memset(buf, 0xe5, 256);
@@ -88,7 +77,7 @@ static bool read_dir_extent(DiskDriveInterface *drive, uint8_t extent, uint8_t *
 
 static bool write_dir_extent(DiskDriveInterface *drive, uint8_t extent, uint8_t const *dir_ent) {
     uint8_t buf[256];
-    printf("Read/write dirent, sector %d,%d,%d, offset +0x%x\n", 4, 0, (extent >> 3)+1, (extent & 0x7)*32);
+    HX20_TRACE(Drive, Verbose, "Read/write dirent, sector %d,%d,%d, offset +0x%x\n", 4, 0, (extent >> 3)+1, (extent & 0x7)*32);
     CHS chs(4,0,(extent >> 3)+1);
     if(!drive->read(chs, buf, 1)) {
         memset(buf, 0xe5, 256);
@@ -123,7 +112,7 @@ static uint8_t find_free_block_after(DiskDriveInterface *drive, uint8_t after_bl
         bool is_free = true;
         for(int i = 0; i < 64; i++) { // 64 directory entries in 2kb directory block
             if(!read_dir_extent(drive, i, dir_ent)) {
-                printf("Could not read dir ent %d\n", i);
+                HX20_TRACE(Drive, Warning, "Could not read dir ent %d\n", i);
                 return 0;
             }
             if(dir_ent[0] != 0)
@@ -240,14 +229,14 @@ ImgFCB::ImgFCB(DiskDriveInterface *drive, uint8_t us, uint8_t const *filename,
     for(int i = 0; i < 64; i++) {
         uint8_t dir_ent[32];
         if(!read_dir_extent(drive, i, dir_ent)) {
-            printf("Cannot read extent %d\n", i);
+            HX20_TRACE(Drive, Warning, "Cannot read extent %d\n", i);
             throw BDOSError(BDOS_READ_ERROR);
         }
         if(dir_ent[0] != 0)
             continue;
-        printf("filename %s\n", hx20ToUnixFilename(dir_ent+1).c_str());
+        HX20_TRACE(Drive, Verbose, "filename %s\n", hx20ToUnixFilename(dir_ent+1).c_str());
         if(dirent_compare_ignore_position(dir_ent, us, filename, extent)) {
-            printf("Found file in extent %d\n", i);
+            HX20_TRACE(Drive, Debug, "Found file in extent %d\n", i);
             //found one.
             if((dir_ent[0xc] & 0x1e) == 0 && dir_ent[0xe] == 0) {
                 memcpy(this->dirent, dir_ent, 15);
@@ -262,24 +251,24 @@ ImgFCB::ImgFCB(DiskDriveInterface *drive, uint8_t us, uint8_t const *filename,
     if(create) {
         if(last_ent != -1) {
             last_ent = -1;
-            printf("Create: file exists\n");
+            HX20_TRACE(Drive, Debug, "Create: file exists\n");
             throw BDOSError(BDOS_WRITE_ERROR);
         }
         uint8_t dir_ent[32];
         last_ent = find_free_dirent(drive, dir_ent);
         if(last_ent != -1) {
-            printf("Found empty extent %d\n", last_ent);
+            HX20_TRACE(Drive, Debug, "Found empty extent %d\n", last_ent);
             memset(dir_ent, 0, 32);
             dir_ent[0] = us;
             memcpy(dir_ent+1, filename, 11);
             dir_ent[12] = extent & 0xf0;//the actual extent group number and extent number is 0.
             memcpy(this->dirent, dir_ent, 15);
             if(!write_dir_extent(drive, last_ent, dir_ent)) {
-                printf("Failed to write extent\n");
+                HX20_TRACE(Drive, Warning, "Failed to write extent\n");
                 throw BDOSError(BDOS_WRITE_ERROR);
             }
         } else {
-            printf("Create: cannot find empty extent\n");
+            HX20_TRACE(Drive, Warning, "Create: cannot find empty extent\n");
             throw BDOSError(BDOS_WRITE_ERROR);
         }
     }
@@ -288,7 +277,7 @@ ImgFCB::ImgFCB(DiskDriveInterface *drive, uint8_t us, uint8_t const *filename,
 uint64_t ImgFCB::size() {
     uint8_t dir_ent[32];
     if(!read_dir_extent(drive, last_ent, dir_ent)) {
-        printf("Cannot read extent %d\n", last_ent);
+        HX20_TRACE(Drive, Warning, "Cannot read extent %d\n", last_ent);
         return BDOS_READ_ERROR;
     }
     return get_records_in_file(dir_ent)*128;
@@ -303,23 +292,23 @@ uint8_t ImgFCB::write(uint32_t record, uint8_t &cur_extent, uint8_t &cur_record,
     //first, check if the file is already large enough
     uint8_t dir_ent[32];
     if(!read_dir_extent(drive, last_ent, dir_ent)) {
-        printf("Extent %d not found\n", last_ent);
+        HX20_TRACE(Drive, Warning, "Extent %d not found\n", last_ent);
         return BDOS_READ_ERROR;
     }
     unsigned int records_in_file = get_records_in_file(dir_ent);
     int ent = last_ent;
-    printf("Found %d records in file\n", records_in_file);
+    HX20_TRACE(Drive, Debug, "Found %d records in file\n", records_in_file);
     if(records_in_file <= record) {
         //no, it is not.
         //check if we need to add more blocks
         if(blockCountInFileFromRecordCount(records_in_file) <
                 blockCountInFileFromRecordCount(record+1)) {
-            printf("For record %d, need to add new block\n", record);
+            HX20_TRACE(Drive, Debug, "For record %d, need to add new block\n", record);
             //yes, complete this one.
             records_in_file = (records_in_file+15) & ~0xf;
             set_records_in_dirent(dir_ent, records_in_file % 256);
-            printf("Set records to %d in %d (resulting in %d %d)\n", records_in_file % 256, ent,
-                   (int)dir_ent[12], (int)dir_ent[15]);
+            HX20_TRACE(Drive, Debug, "Set records to %d in %d (resulting in %d %d)\n", records_in_file % 256, ent,
+                       (int)dir_ent[12], (int)dir_ent[15]);
 
             //now add blocks until we have enough.
             int current_add_block = 0;
@@ -329,19 +318,19 @@ uint8_t ImgFCB::write(uint32_t record, uint8_t &cur_extent, uint8_t &cur_record,
                 if((records_in_file % 256) == 0 &&
                         records_in_file != 0) {
                     set_records_in_dirent(dir_ent, 256);
-                    printf("Set records to %d in %d (resulting in %d %d)\n", 256, ent,
-                           (int)dir_ent[12], (int)dir_ent[15]);
+                    HX20_TRACE(Drive, Debug, "Set records to %d in %d (resulting in %d %d)\n", 256, ent,
+                               (int)dir_ent[12], (int)dir_ent[15]);
                     uint8_t last_extent_bits = dir_ent[12] & 0xfe;
                     if(!write_dir_extent(drive, last_ent, dir_ent)) {
-                        printf("Could not write current dirent\n");
+                        HX20_TRACE(Drive, Warning, "Could not write current dirent\n");
                         return BDOS_WRITE_ERROR;
                     }
                     int res = find_free_dirent(drive, dir_ent);
                     if(res == -1) {
-                        printf("Could not find new free dirent\n");
+                        HX20_TRACE(Drive, Warning, "Could not find new free dirent\n");
                         return BDOS_WRITE_ERROR;
                     }
-                    printf("Added new dirent %d\n", res);
+                    HX20_TRACE(Drive, Debug, "Added new dirent %d\n", res);
                     last_ent = res;
                     memset(dir_ent, 0, 32);
                     memcpy(dir_ent, this->dirent, 15);
@@ -349,11 +338,11 @@ uint8_t ImgFCB::write(uint32_t record, uint8_t &cur_extent, uint8_t &cur_record,
                 }
                 int res = find_free_block_after(drive, current_add_block);
                 if(res == 0) {
-                    printf("Could not find new free block after %d\n", current_add_block);
+                    HX20_TRACE(Drive, Warning, "Could not find new free block after %d\n", current_add_block);
                     return BDOS_READ_ERROR;
                 }
                 current_add_block = res;
-                printf("Added new block %d at %d in %d\n", res, blockIndexInExtentGroupFromRecord(records_in_file), ent);
+                HX20_TRACE(Drive, Debug, "Added new block %d at %d in %d\n", res, blockIndexInExtentGroupFromRecord(records_in_file), ent);
                 dir_ent[16+blockIndexInExtentGroupFromRecord(records_in_file)] = res;
                 records_in_file += 16;
             }
@@ -365,16 +354,16 @@ uint8_t ImgFCB::write(uint32_t record, uint8_t &cur_extent, uint8_t &cur_record,
             if(records_in_file % 256 == 0) {
                 //no need to add a new extent, yet. just fill this one.
                 set_records_in_dirent(dir_ent, 256);
-                printf("Set records to %d in %d (resulting in %d %d)\n", 256, ent,
-                       (int)dir_ent[12], (int)dir_ent[15]);
+                HX20_TRACE(Drive, Debug, "Set records to %d in %d (resulting in %d %d)\n", 256, ent,
+                           (int)dir_ent[12], (int)dir_ent[15]);
             } else {
                 set_records_in_dirent(dir_ent, records_in_file % 256);
-                printf("Set records to %d in %d (resulting in %d %d)\n", records_in_file % 256, ent,
-                       (int)dir_ent[12], (int)dir_ent[15]);
+                HX20_TRACE(Drive, Debug, "Set records to %d in %d (resulting in %d %d)\n", records_in_file % 256, ent,
+                           (int)dir_ent[12], (int)dir_ent[15]);
             }
         }
         if(!write_dir_extent(drive, last_ent, dir_ent)) {
-            printf("Could not write updated dir ent\n");
+            HX20_TRACE(Drive, Warning, "Could not write updated dir ent\n");
             return BDOS_WRITE_ERROR;
         }
         ent = last_ent;
@@ -384,28 +373,28 @@ uint8_t ImgFCB::write(uint32_t record, uint8_t &cur_extent, uint8_t &cur_record,
         this->dirent[14] = (this->dirent[14] & 0xf0) | (extentHighFromRecord(record) & 0x0f);
         for(ent = 0; ent < 64; ent++) {
             if(!read_dir_extent(drive, ent, dir_ent)) {
-                printf("Could not read dir ent\n");
+                HX20_TRACE(Drive, Warning, "Could not read dir ent\n");
                 return BDOS_READ_ERROR;
             }
             if(dirent_compare(this->dirent, dir_ent))
                 break;
         }
         if(ent == 64) {
-            printf("Could not find dir ent\n");
+            HX20_TRACE(Drive, Warning, "Could not find dir ent\n");
             return BDOS_READ_ERROR;
         }
-        printf("Found correct dirent\n");
+        HX20_TRACE(Drive, Debug, "Found correct dirent\n");
     }
 
     if(dir_ent[16+blockIndexInExtentGroupFromRecord(record)] == 0) {
         int res = find_free_block_after(drive, 0);
         if(res == -1) {
-            printf("Could not find free block\n");
+            HX20_TRACE(Drive, Warning, "Could not find free block\n");
             return BDOS_READ_ERROR;
         }
         dir_ent[16+blockIndexInExtentGroupFromRecord(record)] = res;
         if(!write_dir_extent(drive, ent, dir_ent)) {
-            printf("Could not write dir ent\n");
+            HX20_TRACE(Drive, Warning, "Could not write dir ent\n");
             return BDOS_WRITE_ERROR;
         }
     }
@@ -415,12 +404,12 @@ uint8_t ImgFCB::write(uint32_t record, uint8_t &cur_extent, uint8_t &cur_record,
     CHS chs = chsFromBlockAndRecord(block, record);
 
     if(!drive->read(chs, sector_data, 1)) {
-        printf("Could not read sector %d,%d,%d\n",chs.idCylinder,chs.idSide,chs.idSector);
+        HX20_TRACE(Drive, Warning, "Could not read sector %d,%d,%d\n",chs.idCylinder,chs.idSide,chs.idSector);
         return BDOS_READ_ERROR;
     }
     memcpy(sector_data + sectorOffsetFromRecord(record), buf, 128);
     if(!drive->write(chs, sector_data, 1)) {
-        printf("Could not write updated sector %d,%d,%d\n",chs.idCylinder,chs.idSide,chs.idSector);
+        HX20_TRACE(Drive, Warning, "Could not write updated sector %d,%d,%d\n",chs.idCylinder,chs.idSide,chs.idSector);
         return BDOS_WRITE_ERROR;
     }
     position_records = record+1;
@@ -435,14 +424,14 @@ uint8_t ImgFCB::read(uint32_t record, uint8_t &cur_extent, uint8_t &cur_record,
     //first, check if the file is already large enough
     uint8_t dir_ent[32];
     if(!read_dir_extent(drive, last_ent, dir_ent)) {
-        printf("read: cannot find last extent %d\n", last_ent);
+        HX20_TRACE(Drive, Warning, "read: cannot find last extent %d\n", last_ent);
         return BDOS_READ_ERROR;
     }
-    printf("read: found last extent %d\n", last_ent);
+    HX20_TRACE(Drive, Debug, "read: found last extent %d\n", last_ent);
     unsigned int records_in_file = get_records_in_file(dir_ent);
     int ent;
     if(records_in_file <= record) {
-        printf("read: requested record %d, but only %d in file\n", record, records_in_file);
+        HX20_TRACE(Drive, Debug, "read: requested record %d, but only %d in file\n", record, records_in_file);
         return BDOS_READ_ERROR;
     } else if(extentGroupFromRecord(records_in_file) != extentGroupFromRecord(record)) {
         //find the correct extent
@@ -450,34 +439,34 @@ uint8_t ImgFCB::read(uint32_t record, uint8_t &cur_extent, uint8_t &cur_record,
         this->dirent[14] = (this->dirent[14] & 0xf0) | (extentHighFromRecord(record) & 0x0f);
         for(ent = 0; ent < 64; ent++) {
             if(!read_dir_extent(drive, ent, dir_ent)) {
-                printf("Could not read dir ent\n");
+                HX20_TRACE(Drive, Warning, "Could not read dir ent\n");
                 return BDOS_READ_ERROR;
             }
             if(dirent_compare(this->dirent, dir_ent))
                 break;
         }
         if(ent == 64) {
-            printf("Could not find dir ent\n");
+            HX20_TRACE(Drive, Warning, "Could not find dir ent\n");
             return BDOS_READ_ERROR;
         }
-        printf("read: found extent %d\n", ent);
+        HX20_TRACE(Drive, Debug, "read: found extent %d\n", ent);
     }
 
     if(dir_ent[16+blockIndexInExtentGroupFromRecord(record)] == 0) {
-        printf("read: block %d is not active\n",
-               blockIndexInExtentGroupFromRecord(record));
+        HX20_TRACE(Drive, Debug, "read: block %d is not active\n",
+                   blockIndexInExtentGroupFromRecord(record));
         return BDOS_READ_ERROR;
     }
     int block = dir_ent[16+blockIndexInExtentGroupFromRecord(record)];
-    printf("Reading record %d in block %d: %d\n",
-           record, blockIndexInExtentGroupFromRecord(record), block);
+    HX20_TRACE(Drive, Debug, "Reading record %d in block %d: %d\n",
+               record, blockIndexInExtentGroupFromRecord(record), block);
     //now get the sector for this
     uint8_t sector_data[256];
 
     CHS chs = chsFromBlockAndRecord(block, record);
 
     if(!drive->read(chs, sector_data, 1)) {
-        printf("read: failed to read disk %d %d %d\n", chs.idCylinder, chs.idSide, chs.idSector);
+        HX20_TRACE(Drive, Warning, "read: failed to read disk %d %d %d\n", chs.idCylinder, chs.idSide, chs.idSector);
         return BDOS_READ_ERROR;
     }
     memcpy(buf, sector_data + sectorOffsetFromRecord(record), 128);
@@ -522,6 +511,12 @@ TF20DriveDiskImage::TF20DriveDiskImage(std::string const &file,
         } catch(std::exception &e) {
             errors << "Raw: " << e.what();
         }
+    } else if(filetype == TF20DriveDiskImageFileType::SharedReadOnly) {
+        try {
+            drive = std::make_unique<SharedImageDrive>(file);
+        } catch(std::exception &e) {
+            errors << "Shared: " << e.what();
+        }
     }
     if(!drive) {
         throw std::runtime_error(errors.str());
@@ -572,7 +567,7 @@ void TF20DriveDiskImage::file_remove(uint8_t us, uint8_t const *filename, uint8_
         if(dir_ent[0] != 0)
             continue;
         if(dirent_compare_ignore_position(dir_ent, pattern)) {
-            printf("Deleting file in entry %d\n", i);
+            HX20_TRACE(Drive, Debug, "Deleting file in entry %d\n", i);
             dir_ent[0] = 0xe5;
             if(!write_dir_extent(drive.get(), i, dir_ent))
                 throw BDOSError(BDOS_WRITE_ERROR);
@@ -6,7 +6,10 @@
 enum class TF20DriveDiskImageFileType {
     TeleDisk,
     Raw,
-    Autodetect
+    Autodetect,
+    //TeleDisk or raw by extension, loaded once for all drives using it
+    //this way and never written
+    SharedReadOnly
 };
 
 class TF20DriveDiskImage : public TF20DriveInterface {
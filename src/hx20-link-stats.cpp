@@ -0,0 +1,198 @@
+#include <algorithm>
+#include <cmath>
+
+#include "hx20-link-stats.hpp"
+
+HdrHistogram::HdrHistogram() :
+    counts(HalfSubBuckets * (MaxShift + 2), 0), total(0), maxValue(0), sum(0) {
+}
+
+unsigned int HdrHistogram::indexFor(uint64_t value) {
+    if(value < (1u << SubBucketBits))
+        return value;
+    uint64_t limit = (uint64_t)1 << (SubBucketBits + MaxShift);
+    if(value >= limit)
+        value = limit - 1;
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - (SubBucketBits - 1);
+    return HalfSubBuckets * shift + (value >> shift);
+}
+
+uint64_t HdrHistogram::highestEquivalent(unsigned int index) {
+    if(index < (1u << SubBucketBits))
+        return index;
+    int shift = index / HalfSubBuckets - 1;
+    uint64_t sub = index - HalfSubBuckets * shift;
+    return ((sub + 1) << shift) - 1;
+}
+
+void HdrHistogram::record(uint64_t value) {
+    counts[indexFor(value)]++;
+    total++;
+    sum += value;
+    maxValue = std::max(maxValue, value);
+}
+
+uint64_t HdrHistogram::percentile(double q) const {
+    if(total == 0)
+        return 0;
+    uint64_t target = std::max<uint64_t>(1, std::ceil(q * total));
+    uint64_t seen = 0;
+    for(unsigned int i = 0; i < counts.size(); i++) {
+        seen += counts[i];
+        if(seen >= target)
+            return std::min(highestEquivalent(i), maxValue);
+    }
+    return maxValue;
+}
+
+void HdrHistogram::merge(HdrHistogram const &other) {
+    for(unsigned int i = 0; i < counts.size(); i++)
+        counts[i] += other.counts[i];
+    total += other.total;
+    sum += other.sum;
+    maxValue = std::max(maxValue, other.maxValue);
+}
+
+HX20LinkStats::HX20LinkStats() : requestPending(false), requestFnc(0) {
+}
+
+HX20LinkStats::HX20LinkStats(HX20LinkStats const &other) {
+    *this = other;
+}
+
+HX20LinkStats &HX20LinkStats::operator=(HX20LinkStats const &other) {
+    if(this == &other)
+        return *this;
+    std::lock_guard<std::mutex> l(other.lock);
+    total = other.total;
+    fncs = other.fncs;
+    devices = other.devices;
+    relayLatency = other.relayLatency;
+    bytesRelayed = other.bytesRelayed;
+    srttUs = other.srttUs;
+    rtoUs = other.rtoUs;
+    requestPending = other.requestPending;
+    requestFnc = other.requestFnc;
+    requestTime = other.requestTime;
+    return *this;
+}
+
+HX20LinkStats HX20LinkStats::snapshot() const {
+    return HX20LinkStats(*this);
+}
+
+void HX20LinkStats::reset() {
+    std::lock_guard<std::mutex> l(lock);
+    total = HX20FncStats();
+    fncs.clear();
+    devices.clear();
+    relayLatency = HdrHistogram();
+    bytesRelayed = 0;
+    requestPending = false;
+}
+
+template<typename F>
+void HX20LinkStats::update(uint8_t fnc, uint16_t dev, F f) {
+    std::lock_guard<std::mutex> l(lock);
+    f(total.counters, &total);
+    f(fncs[fnc].counters, &fncs[fnc]);
+    f(devices[dev], nullptr);
+}
+
+static uint64_t micros(HX20LinkStats::Timestamp from, HX20LinkStats::Timestamp to) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(to - from).count();
+}
+
+void HX20LinkStats::packetReceived(uint8_t fnc, uint16_t dev, size_t size,
+                                   Timestamp time) {
+    update(fnc, dev, [size](HX20LinkCounters &c, HX20FncStats *) {
+        c.packetsReceived++;
+        c.bytesReceived += size;
+    });
+    std::lock_guard<std::mutex> l(lock);
+    //a request nobody answered is simply replaced
+    requestPending = true;
+    requestFnc = fnc;
+    requestTime = time;
+}
+
+void HX20LinkStats::checksumError(uint8_t fnc, uint16_t dev) {
+    update(fnc, dev, [](HX20LinkCounters &c, HX20FncStats *) {
+        c.checksumErrors++;
+    });
+}
+
+void HX20LinkStats::headerChecksumError() {
+    std::lock_guard<std::mutex> l(lock);
+    total.counters.checksumErrors++;
+}
+
+void HX20LinkStats::responseStarted(Timestamp time) {
+    std::lock_guard<std::mutex> l(lock);
+    if(!requestPending)
+        return;
+    requestPending = false;
+    uint64_t us = micros(requestTime, time);
+    total.responseLatency.record(us);
+    fncs[requestFnc].responseLatency.record(us);
+}
+
+void HX20LinkStats::ackReceived(uint8_t fnc, uint16_t dev, Timestamp sent,
+                                Timestamp time) {
+    uint64_t us = micros(sent, time);
+    update(fnc, dev, [us](HX20LinkCounters &, HX20FncStats *s) {
+        if(s)
+            s->ackTurnaround.record(us);
+    });
+}
+
+void HX20LinkStats::nakReceived(uint8_t fnc, uint16_t dev) {
+    update(fnc, dev, [](HX20LinkCounters &c, HX20FncStats *) {
+        c.naks++;
+    });
+}
+
+void HX20LinkStats::wakReceived(uint8_t fnc, uint16_t dev) {
+    update(fnc, dev, [](HX20LinkCounters &c, HX20FncStats *) {
+        c.waks++;
+    });
+}
+
+//kept across reset, the estimate is still valid
+void HX20LinkStats::rttUpdated(int64_t srtt, int64_t rto) {
+    std::lock_guard<std::mutex> l(lock);
+    srttUs = srtt;
+    rtoUs = rto;
+}
+
+void HX20LinkStats::retry(uint8_t fnc, uint16_t dev) {
+    update(fnc, dev, [](HX20LinkCounters &c, HX20FncStats *) {
+        c.retries++;
+    });
+}
+
+void HX20LinkStats::timeout(uint8_t fnc, uint16_t dev) {
+    update(fnc, dev, [](HX20LinkCounters &c, HX20FncStats *) {
+        c.timeouts++;
+    });
+}
+
+void HX20LinkStats::packetSent(uint8_t fnc, uint16_t dev, size_t size,
+                               int result) {
+    update(fnc, dev, [size, result](HX20LinkCounters &c, HX20FncStats *) {
+        if(result == 0) {
+            c.packetsSent++;
+            c.bytesSent += size;
+        } else {
+            c.failures++;
+        }
+    });
+}
+
+void HX20LinkStats::relayed(size_t size, Timestamp read, Timestamp written) {
+    uint64_t us = micros(read, written);
+    std::lock_guard<std::mutex> l(lock);
+    relayLatency.record(us);
+    bytesRelayed += size;
+}
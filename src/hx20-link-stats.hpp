@@ -0,0 +1,108 @@
+#pragma once
+
+#include <stdint.h>
+#include <array>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <vector>
+
+/* Log-linear histogram in the style of HdrHistogram: values below 128 are
+ * counted exactly, above that each power of two is split into 64
+ * buckets, so every value is kept within 1.6%. Values are microseconds,
+ * anything beyond about 19 hours goes into the last bucket.
+ */
+class HdrHistogram {
+private:
+    static constexpr int SubBucketBits = 7;
+    static constexpr int HalfSubBuckets = 1 << (SubBucketBits - 1);
+    static constexpr int MaxShift = 30;
+    std::vector<uint32_t> counts;
+    uint64_t total;
+    uint64_t maxValue;
+    uint64_t sum;
+    static unsigned int indexFor(uint64_t value);
+    static uint64_t highestEquivalent(unsigned int index);
+public:
+    HdrHistogram();
+    void record(uint64_t value);
+    uint64_t count() const { return total; }
+    uint64_t max() const { return maxValue; }
+    uint64_t mean() const { return total ? sum / total : 0; }
+    //the smallest recorded value q (0..1) of all values are at or below
+    uint64_t percentile(double q) const;
+    void merge(HdrHistogram const &other);
+};
+
+struct HX20LinkCounters {
+    uint64_t packetsReceived = 0;
+    uint64_t bytesReceived = 0;
+    uint64_t packetsSent = 0;
+    uint64_t bytesSent = 0;
+    //frames we NAKed because of a bad checksum
+    uint64_t checksumErrors = 0;
+    //NAK or EOT from the hx-20 instead of an ACK
+    uint64_t naks = 0;
+    //WAK from the hx-20, it is busy with the frame
+    uint64_t waks = 0;
+    uint64_t retries = 0;
+    uint64_t timeouts = 0;
+    //packets given up on after all retries
+    uint64_t failures = 0;
+};
+
+struct HX20FncStats {
+    HX20LinkCounters counters;
+    //request fully received (EOT) to the first header of the response sent
+    HdrHistogram responseLatency;
+    //header or text frame sent to the ACK from the hx-20
+    HdrHistogram ackTurnaround;
+};
+
+/* Link statistics of one HX20SerialConnection. Updated by the thread
+ * running the protocol, read through snapshot from anywhere.
+ */
+class HX20LinkStats {
+public:
+    typedef std::chrono::steady_clock::time_point Timestamp;
+    HX20FncStats total;
+    std::map<uint8_t, HX20FncStats> fncs;
+    std::map<uint16_t, HX20LinkCounters> devices;
+    //bridge mode: bytes read on one port until written to the other
+    HdrHistogram relayLatency;
+    uint64_t bytesRelayed = 0;
+    //the text ACK round trip estimate and the retransmit timeout derived
+    //from it
+    int64_t srttUs = 0;
+    int64_t rtoUs = 0;
+private:
+    mutable std::mutex lock;
+    //EPSP is half duplex, so there is at most one request waiting for
+    //its response.
+    bool requestPending;
+    uint8_t requestFnc;
+    Timestamp requestTime;
+    template<typename F> void update(uint8_t fnc, uint16_t dev, F f);
+public:
+    HX20LinkStats();
+    HX20LinkStats(HX20LinkStats const &other);
+    HX20LinkStats &operator=(HX20LinkStats const &other);
+
+    HX20LinkStats snapshot() const;
+    void reset();
+
+    void packetReceived(uint8_t fnc, uint16_t dev, size_t size, Timestamp time);
+    void checksumError(uint8_t fnc, uint16_t dev);
+    //bad header checksum, fnc and device are unknown
+    void headerChecksumError();
+    //the first send attempt of the header of a packet
+    void responseStarted(Timestamp time);
+    void ackReceived(uint8_t fnc, uint16_t dev, Timestamp sent, Timestamp time);
+    void nakReceived(uint8_t fnc, uint16_t dev);
+    void wakReceived(uint8_t fnc, uint16_t dev);
+    void rttUpdated(int64_t srtt, int64_t rto);
+    void retry(uint8_t fnc, uint16_t dev);
+    void timeout(uint8_t fnc, uint16_t dev);
+    void packetSent(uint8_t fnc, uint16_t dev, size_t size, int result);
+    void relayed(size_t size, Timestamp read, Timestamp written);
+};
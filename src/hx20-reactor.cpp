@@ -0,0 +1,231 @@
+#include "hx20-reactor.hpp"
+#include "hx20-ser-proto.hpp"
+
+#include <string.h>
+
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+HX20Reactor::HX20Reactor() : stopping(false) {
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(epfd == -1)
+        throw IOError(errno, std::system_category(), "Creating epoll fd failed");
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(wakeFd == -1) {
+        int err = errno;
+        close(epfd);
+        throw IOError(err, std::system_category(), "Creating eventfd failed");
+    }
+    //steady_clock is CLOCK_MONOTONIC, so deadlines can be used as is
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(timerFd == -1) {
+        int err = errno;
+        close(wakeFd);
+        close(epfd);
+        throw IOError(err, std::system_category(), "Creating timerfd failed");
+    }
+    //the wake and timer fds are told apart by their data.ptr, neither
+    //points to a Watch
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    int res = epoll_ctl(epfd, EPOLL_CTL_ADD, wakeFd, &ev);
+    ev.data.ptr = this;
+    if(res == 0)
+        res = epoll_ctl(epfd, EPOLL_CTL_ADD, timerFd, &ev);
+    if(res != 0) {
+        int err = errno;
+        close(timerFd);
+        close(wakeFd);
+        close(epfd);
+        throw IOError(err, std::system_category(), "Adding eventfd to epoll failed");
+    }
+}
+
+HX20Reactor::~HX20Reactor() {
+    close(timerFd);
+    close(wakeFd);
+    close(epfd);
+}
+
+void HX20Reactor::addConnection(HX20SerialConnection *conn,
+                                std::function<void()> failed) {
+    std::unique_ptr<Link> link = std::make_unique<Link>();
+    link->conn = conn;
+    link->failed = std::move(failed);
+    link->deadline = deadlines.end();
+
+    std::vector<struct pollfd> pfds(conn->getNfds());
+    conn->fillPollFd(pfds.data());
+    //epoll_event.data points into watches, so it must not grow anymore
+    link->watches.reserve(pfds.size());
+    for(auto &pfd : pfds) {
+        link->watches.push_back(Watch { link.get(), pfd.fd, pfd.events });
+        struct epoll_event ev;
+        ev.events = 0;
+        if(pfd.events & POLLIN)
+            ev.events |= EPOLLIN;
+        if(pfd.events & POLLOUT)
+            ev.events |= EPOLLOUT;
+        if(pfd.events & POLLPRI)
+            ev.events |= EPOLLPRI;
+        ev.data.ptr = &link->watches.back();
+        if(epoll_ctl(epfd, EPOLL_CTL_ADD, pfd.fd, &ev) != 0) {
+            int err = errno;
+            for(auto &w : link->watches)
+                epoll_ctl(epfd, EPOLL_CTL_DEL, w.fd, nullptr);
+            throw IOError(err, std::system_category(), "Adding fd to epoll failed");
+        }
+    }
+    Link *l = link.get();
+    links[conn] = std::move(link);
+    updateDeadline(l);
+}
+
+void HX20Reactor::removeConnection(HX20SerialConnection *conn) {
+    auto it = links.find(conn);
+    if(it == links.end())
+        return;
+    Link *link = it->second.get();
+    for(auto &w : link->watches)
+        epoll_ctl(epfd, EPOLL_CTL_DEL, w.fd, nullptr);
+    if(link->deadline != deadlines.end())
+        deadlines.erase(link->deadline);
+    link->deadline = deadlines.end();
+    link->conn = nullptr;
+    removed.push_back(std::move(it->second));
+    links.erase(it);
+}
+
+void HX20Reactor::addFd(int fd, uint32_t events,
+                        std::function<void(uint32_t)> handler) {
+    std::unique_ptr<Watch> watch = std::make_unique<Watch>();
+    watch->link = nullptr;
+    watch->fd = fd;
+    watch->events = 0;
+    watch->handler = std::move(handler);
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = watch.get();
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+        throw IOError(errno, std::system_category(), "Adding fd to epoll failed");
+    fds[fd] = std::move(watch);
+}
+
+void HX20Reactor::removeFd(int fd) {
+    auto it = fds.find(fd);
+    if(it == fds.end())
+        return;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+    //the handler may be the one removing it, so it stays around
+    it->second->fd = -1;
+    removedFds.push_back(std::move(it->second));
+    fds.erase(it);
+}
+
+void HX20Reactor::updateDeadline(Link *link) {
+    Timestamp deadline;
+    if(link->deadline != deadlines.end())
+        deadlines.erase(link->deadline);
+    if(!link->conn->getDeadline(deadline)) {
+        link->deadline = deadlines.end();
+        return;
+    }
+    link->deadline = deadlines.emplace(deadline, link);
+}
+
+void HX20Reactor::armTimer() {
+    Timestamp next = deadlines.empty() ? Timestamp() : deadlines.begin()->first;
+    if(next == armed)
+        return;
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if(!deadlines.empty()) {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>
+                  (next.time_since_epoch()).count();
+        its.it_value.tv_sec = ns / 1000000000;
+        its.it_value.tv_nsec = ns % 1000000000;
+        //an all zero it_value would disarm it instead
+        if(its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+            its.it_value.tv_nsec = 1;
+    }
+    if(timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &its, nullptr) != 0)
+        throw IOError(errno, std::system_category(), "Setting timerfd failed");
+    armed = next;
+}
+
+void HX20Reactor::fail(Link *link) {
+    std::function<void()> failed = std::move(link->failed);
+    removeConnection(link->conn);
+    if(failed)
+        failed();
+}
+
+void HX20Reactor::run() {
+    struct epoll_event evs[64];
+    while(!stopping.load() && (!links.empty() || !fds.empty())) {
+        armTimer();
+        int n = epoll_wait(epfd, evs, sizeof(evs) / sizeof(evs[0]), -1);
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            throw IOError(errno, std::system_category(), "epoll_wait failed");
+        }
+        for(int i = 0; i < n; i++) {
+            if(evs[i].data.ptr == nullptr || evs[i].data.ptr == this) {
+                //the deadlines are checked below in any case
+                uint64_t v;
+                int fd = evs[i].data.ptr ? timerFd : wakeFd;
+                while(read(fd, &v, sizeof(v)) < 0 && errno == EINTR) {}
+                continue;
+            }
+            Watch *w = static_cast<Watch *>(evs[i].data.ptr);
+            if(!w->link) {
+                if(w->fd >= 0)
+                    w->handler(evs[i].events);
+                continue;
+            }
+            Link *link = w->link;
+            if(!link->conn)
+                continue;
+            struct pollfd pfd;
+            pfd.fd = w->fd;
+            pfd.events = w->events;
+            pfd.revents = 0;
+            //the connection only acts on POLLIN. Errors and hangups also
+            //show up on reading, so they are passed on as such.
+            if(evs[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                pfd.revents |= POLLIN;
+            if(evs[i].events & EPOLLOUT)
+                pfd.revents |= POLLOUT;
+            if(link->conn->handleEvents(&pfd, 1) < 0)
+                fail(link);
+            else
+                updateDeadline(link);
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        while(!deadlines.empty() && deadlines.begin()->first <= now) {
+            Link *link = deadlines.begin()->second;
+            deadlines.erase(deadlines.begin());
+            link->deadline = deadlines.end();
+            if(link->conn->handleTimeout() < 0)
+                fail(link);
+            else
+                updateDeadline(link);
+        }
+        removed.clear();
+        removedFds.clear();
+    }
+    stopping.store(false);
+}
+
+void HX20Reactor::stop() {
+    stopping.store(true);
+    uint64_t one = 1;
+    while(write(wakeFd, &one, sizeof(one)) < 0 && errno == EINTR) {}
+}
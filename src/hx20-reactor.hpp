@@ -0,0 +1,75 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
+#include <atomic>
+
+class HX20SerialConnection;
+
+/* Services any number of connections from the calling thread, using one
+ * epoll set for all of their fds and one ordered set for their protocol
+ * timers, with a timerfd armed for the earliest of them. Waking up costs
+ * the same no matter how many links are idle, and nothing wakes up while
+ * all of them are. Other fds, like a control socket or an inotify fd,
+ * can be watched in the same loop with addFd.
+ * The connections must not run their own thread (startThread).
+ */
+class HX20Reactor {
+private:
+    typedef std::chrono::steady_clock::time_point Timestamp;
+    struct Link;
+    //what an epoll event points to
+    struct Watch {
+        Link *link;//nullptr for external fds
+        int fd;//-1 once an external fd is removed
+        short events;//poll(2) events
+        std::function<void(uint32_t)> handler;//for external fds
+    };
+    struct Link {
+        //nullptr once removed
+        HX20SerialConnection *conn;
+        std::function<void()> failed;
+        std::vector<Watch> watches;
+        std::multimap<Timestamp, Link *>::iterator deadline;
+    };
+    int epfd;
+    int wakeFd;
+    int timerFd;
+    //what timerFd is armed for, the epoch for disarmed
+    Timestamp armed;
+    std::atomic<bool> stopping;
+    std::map<HX20SerialConnection *, std::unique_ptr<Link> > links;
+    std::map<int, std::unique_ptr<Watch> > fds;
+    //removed links and fds, kept until the events collected with them
+    //are handled
+    std::vector<std::unique_ptr<Link> > removed;
+    std::vector<std::unique_ptr<Watch> > removedFds;
+    std::multimap<Timestamp, Link *> deadlines;
+
+    void updateDeadline(Link *link);
+    void armTimer();
+    void fail(Link *link);
+public:
+    HX20Reactor();
+    ~HX20Reactor();
+    /* failed is called when io on the connection failed, after it has
+     * been removed again. It may destroy the connection.
+     */
+    void addConnection(HX20SerialConnection *conn,
+                       std::function<void()> failed = std::function<void()>());
+    void removeConnection(HX20SerialConnection *conn);
+    size_t connections() const { return links.size(); }
+    /* Calls handler with the epoll(7) events whenever fd becomes ready
+     * for the given ones. The handler may add and remove fds and
+     * connections, including its own.
+     */
+    void addFd(int fd, uint32_t events, std::function<void(uint32_t)> handler);
+    void removeFd(int fd);
+    //runs until stop is called or the last connection and fd is gone
+    void run();
+    //async signal safe
+    void stop();
+};
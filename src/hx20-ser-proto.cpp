@@ -6,7 +6,6 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
-#include <termios.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -14,10 +13,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <poll.h>
-#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <typeinfo>
 
 #include "hx20-ser-proto.hpp"
+#include "hx20-trace.hpp"
+#include "hx20-reactor.hpp"
 
 /* the tf-20 expects this sequence:
  * EOT
@@ -86,12 +91,6 @@
  *   (send EOT)
  */
 
-#if 0
-#define EPSP_DEBUG(fmt, ...) EPSP_DEBUG(fmt, ## __VA_ARGS__)
-#else
-#define EPSP_DEBUG(fmt, ...)
-#endif
-
 #define SOH 0x1
 #define STX 0x2
 #define ETX 0x3
@@ -105,506 +104,1387 @@
 
 HX20SerialDevice::~HX20SerialDevice() =default;
 
+void HX20SerialDevice::deferUntilResponded(std::function<void()> fn) {
+    //nothing would come along to run it later
+    if(pendingResponses == 0 && !delivering) {
+        fn();
+        return;
+    }
+    deferred.push_back(std::move(fn));
+}
+
+void HX20SerialDevice::runDeferred() {
+    //the work may defer more, which then waits for the next round
+    std::vector<std::function<void()> > work;
+    work.swap(deferred);
+    for(auto &fn : work)
+        fn();
+}
+
 HX20SerialMonitor::~HX20SerialMonitor() =default;
 
-static int readTimeout(int fd, void *buf, size_t nbytes, int timeout) {
-    struct pollfd pfd;
-    pfd.fd = fd;
-    pfd.events = POLLIN;
-    int res;
-    res = ::poll(&pfd,1,timeout);
-    if(res <= 0) {
-        return 0;
+#define WRITEb(v) do { uint8_t __b(v); if(writeBytes(&__b,1) != 0) return -1; } while(0)
+
+//the fd is non-blocking, so wait for it to drain when the kernel buffer is full
+static int writeAll(HX20Transport &t, uint8_t const *buf, size_t size) {
+    while(size > 0) {
+        ssize_t res = t.write(buf, size);
+        if(res < 0) {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd pfd;
+                pfd.fd = t.getFd();
+                pfd.events = POLLOUT;
+                if(::poll(&pfd, 1, -1) < 0 && errno != EINTR)
+                    return -1;
+                continue;
+            }
+            return -1;
+        }
+        buf += res;
+        size -= res;
     }
+    return 0;
+}
 
-    return read(fd, buf, nbytes);
+int HX20SerialConnection::writeBytes(uint8_t const *buf, size_t size) {
+    if(capturing.load(std::memory_order_relaxed))
+        captureBytes(HX20CaptureDirection::ToHX20, buf, size,
+                     std::chrono::steady_clock::now());
+    return writeAll(*transport, buf, size);
 }
 
-#define READb(v) do { uint8_t __b; if(read(fd,&__b,1) != 1) return -1; (v) = __b; } while(0)
-#define READSUMb(v) do { uint8_t __b; if(read(fd,&__b,1) != 1) return -1; sum += __b; (v) = __b; } while(0)
-#define WRITEb(v) do { uint8_t __b(v); if(write(fd,&__b,1) != 1) return -1; } while(0)
-#define WRITESUMb(v) do { uint8_t __b(v); if(write(fd,&__b,1) != 1) return -1; sum += __b; } while(0)
+void HX20SerialConnection::captureBytes(HX20CaptureDirection dir,
+                                        uint8_t const *bytes, size_t size,
+                                        std::chrono::steady_clock::time_point time) {
+    std::lock_guard<std::mutex> lock(captureLock);
+    if(capture)
+        capture->record(dir, bytes, size, time);
+}
 
-int HX20SerialConnection::sendPacket(uint16_t sid, uint16_t did, uint8_t fnc,
-                                     uint16_t size, uint8_t *buf) {
-    /*
-     * When the TF-20 sends a packet, it does like this:
-     * up to 4 restarts over all. Cancels the command if number of restarts greater than 4
-     * start:
-     *   (send SOH, fmt, did, sid, fnc, siz, hcs)
-     * header_recv:
-     *   no data or NAK => restart at header_recv |
-     *   ACK => continue |
-     *   any other data: restart at start
-     *
-     *   reset restart counter to 4
-     * start_buffer:
-     *   (send STX, buffer, ETX, hcs)
-     * buffer_recv:
-     *   no data or NAK => restart at buffer_recv |
-     *   ACK => continue |
-     *   any other data: restart at start_buffer
-     *
-     *   (send EOT)
-     */
-    uint8_t sum;
-    uint8_t fmt = 1;//slave sending a block to master
-    uint8_t b;
-    uint16_t siz = size-1;
-    int i;
+void HX20SerialConnection::startCapture(char const *path) {
+    std::unique_ptr<HX20CaptureWriter> writer(new HX20CaptureWriter(path));
+    std::lock_guard<std::mutex> lock(captureLock);
+    capture = std::move(writer);
+    capturing.store(true);
+}
 
-    //The disk device would have at most one byte stored, so just flush
-    //all the chatter from the hx-20 out.
-    while(true) {
-        int res = readTimeout(fd, &b, 1, 0);
-        if(res < 0)
-            return -1;
-        if(res == 0) {
-            break;
+void HX20SerialConnection::stopCapture() {
+    std::unique_ptr<HX20CaptureWriter> writer;
+    {
+        std::lock_guard<std::mutex> lock(captureLock);
+        capturing.store(false);
+        writer = std::move(capture);
+    }
+    //flushed and closed outside of the lock
+}
+
+/* Reads as much as fits into the free space of the input ring with one
+ * readv. Returns the number of bytes read, 0 if nothing was available and
+ * -1 on error or end of file.
+ */
+int HX20SerialConnection::fillInput() {
+    uint32_t used = inWrite - inRead;
+    uint32_t space = inRing.size() - used;
+    if(space == 0)
+        return 0;
+    uint32_t wpos = inWrite % inRing.size();
+    struct iovec iov[2];
+    int iovcnt = 1;
+    iov[0].iov_base = &inRing[wpos];
+    iov[0].iov_len = std::min<uint32_t>(space, inRing.size() - wpos);
+    if(iov[0].iov_len < space) {
+        iov[1].iov_base = &inRing[0];
+        iov[1].iov_len = space - iov[0].iov_len;
+        iovcnt = 2;
+    }
+    ssize_t res;
+    do {
+        res = transport->readv(iov, iovcnt);
+    } while(res < 0 && errno == EINTR);
+    if(res < 0) {
+        if(errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        return -1;
+    }
+    if(res == 0)
+        return -1;
+    if(bridge)
+        inTime = std::chrono::steady_clock::now();
+    if(capturing.load(std::memory_order_relaxed)) {
+        auto now = std::chrono::steady_clock::now();
+        size_t left = res;
+        for(int i = 0; i < iovcnt && left > 0; i++) {
+            size_t n = std::min<size_t>(left, iov[i].iov_len);
+            captureBytes(HX20CaptureDirection::FromHX20,
+                         (uint8_t const *)iov[i].iov_base, n, now);
+            left -= n;
         }
-        for(auto &m : monitors)
-            m->monitorInput(HX20SerialMonitor::GotUnassociated,
-                            std::vector<uint8_t>(1, b));
     }
+    inWrite += res;
+    return res;
+}
+
+//SOH, fmt, did(2), sid(2), fnc, siz(2), hcs
+#define HEADER_FRAME_MAX 10
+/* Both frames are assembled into buffers that are recycled between
+ * packets, so assembling them does not allocate once the buffers have
+ * grown to the size needed. The checksum is accumulated while the bytes
+ * are appended.
+ */
+static void assembleHeaderFrame(std::vector<uint8_t> &frame, uint8_t fmt,
+                                uint16_t did, uint16_t sid, uint8_t fnc,
+                                uint16_t siz) {
+    uint8_t sum = 0;
+    auto put = [&frame, &sum](uint8_t b) {
+        frame.push_back(b);
+        sum += b;
+    };
+    frame.clear();
+    put(SOH);
+    put(fmt);
+    if(fmt & 0x4)
+        put(did >> 8);
+    put(did & 0xff);
+    if(fmt & 0x4)
+        put(sid >> 8);
+    put(sid & 0xff);
+    put(fnc);
+    if(fmt & 0x2)
+        put(siz >> 8);
+    put(siz & 0xff);
+    frame.push_back(-sum);
+}
+
+static void assembleTextFrame(std::vector<uint8_t> &frame,
+                              uint16_t size, uint8_t const *buf) {
+    uint8_t sum = STX + ETX;
+    frame.resize(size + 3);
+    frame[0] = STX;
+    for(unsigned int i = 0; i < size; i++) {
+        frame[i+1] = buf[i];
+        sum += buf[i];
+    }
+    frame[size+1] = ETX;
+    frame[size+2] = -sum;
+}
+
+//the frames do not change between retries, so they are built once.
+static void assembleFrames(std::vector<uint8_t> &header, std::vector<uint8_t> &text,
+                           uint16_t sid, uint16_t did, uint8_t fnc,
+                           uint16_t size, uint8_t const *buf) {
+    uint8_t fmt = 1;//slave sending a block to master
+    uint16_t siz = size-1;
 
     if((did & 0xff00) || (sid & 0xff00))
         fmt |= 0x04;
     if(siz & 0xff00)
         fmt |= 0x02;
 
-    int retries = 4;
+    assembleHeaderFrame(header, fmt, did, sid, fnc, siz);
+    assembleTextFrame(text, size, buf);
+}
 
-    while(1) {
-        sum = 0;
-        std::vector<uint8_t> data;
-        WRITESUMb(SOH);
-        data.push_back(SOH);
-        WRITESUMb(fmt);
-        data.push_back(fmt);
+std::shared_ptr<HX20PreparedPacket const>
+HX20PreparedPacket::prepare(uint16_t sid, uint16_t did, uint8_t fnc,
+                            uint16_t size, uint8_t const *buf) {
+    auto pkt = std::make_shared<HX20PreparedPacket>();
+    pkt->sid = sid;
+    pkt->did = did;
+    pkt->fnc = fnc;
+    pkt->header.reserve(HEADER_FRAME_MAX);
+    assembleFrames(pkt->header, pkt->text, sid, did, fnc, size, buf);
+    return pkt;
+}
 
-        if(fmt & 0x4) {
-            data.push_back(did >> 8);
-            WRITESUMb(did >> 8);
-        }
-        data.push_back(did & 0xff);
-        WRITESUMb(did & 0xff);
+bool HX20PreparedPacketCache::Key::operator<(Key const &o) const {
+    if(sid != o.sid)
+        return sid < o.sid;
+    if(did != o.did)
+        return did < o.did;
+    if(fnc != o.fnc)
+        return fnc < o.fnc;
+    if(size != o.size)
+        return size < o.size;
+    return memcmp(text.data(), o.text.data(), size) < 0;
+}
 
-        if(fmt & 0x4) {
-            data.push_back(sid >> 8);
-            WRITESUMb(sid >> 8);
+std::shared_ptr<HX20PreparedPacket const>
+HX20PreparedPacketCache::get(uint16_t sid, uint16_t did, uint8_t fnc,
+                             uint16_t size, uint8_t const *buf) {
+    if(size > MAX_TEXT)
+        return HX20PreparedPacket::prepare(sid, did, fnc, size, buf);
+    Key key;
+    key.sid = sid;
+    key.did = did;
+    key.fnc = fnc;
+    key.size = size;
+    memcpy(key.text.data(), buf, size);
+    auto it = entries.find(key);
+    if(it != entries.end())
+        return it->second;
+    if(entries.size() >= MAX_ENTRIES)
+        entries.clear();
+    return entries[key] = HX20PreparedPacket::prepare(sid, did, fnc, size, buf);
+}
+
+/* Transmission of a packet is driven by the bytes received from the
+ * HX-20 and by a timer, so the caller of sendPacket never waits for the
+ * HX-20:
+ *
+ * TxIdle --sendPacket--> (send header) TxSentHeader
+ * TxSentHeader:
+ *   ACK => (send text) TxSentText |
+ *   NAK or EOT => keep waiting |
+ *   timeout or any other data => resend header, up to 4 times
+ * TxSentText:
+ *   ACK => (send EOT) TxIdle, report completion, start next packet |
+ *   NAK or EOT => keep waiting |
+ *   timeout or any other data => resend text, up to 4 times
+ */
+
+#define TX_RETRIES 4
+//until the first ACK has been timed
+#define TX_ACK_TIMEOUT_MS 800
+//not much below the fixed timeout this replaced, a few quick ACKs do
+//not show how long the hx-20 can take when it is busy
+#define TX_RTO_MIN_MS 600
+#define TX_RTO_MAX_MS 4000
+//how long the hx-20 gets after a WAK before we ask again with ENQ
+#define TX_WAK_POLL_MS 1000
+
+HX20RttEstimator::HX20RttEstimator() :
+    srtt(0), rttvar(0), rto(TX_ACK_TIMEOUT_MS * 1000), haveSample(false) {
+}
+
+void HX20RttEstimator::sample(int64_t r) {
+    if(r < 0)
+        r = 0;
+    if(!haveSample) {
+        srtt = r;
+        rttvar = r / 2;
+        haveSample = true;
+    } else {
+        int64_t err = srtt - r;
+        if(err < 0)
+            err = -err;
+        rttvar = (3 * rttvar + err) / 4;
+        srtt = (7 * srtt + r) / 8;
+    }
+    //the granularity of our timers is a millisecond
+    rto = srtt + std::max<int64_t>(1000, 4 * rttvar);
+    rto = std::max<int64_t>(rto, TX_RTO_MIN_MS * 1000);
+    rto = std::min<int64_t>(rto, TX_RTO_MAX_MS * 1000);
+}
+
+void HX20RttEstimator::backoff() {
+    rto = std::min<int64_t>(rto * 2, TX_RTO_MAX_MS * 1000);
+}
+
+int HX20SerialConnection::sendPacket(uint16_t sid, uint16_t did, uint8_t fnc,
+                                     uint16_t size, uint8_t *buf) {
+    bool ioThreadCaller = threaded && std::this_thread::get_id() == ioThread.get_id();
+    if(!ioThreadCaller) {
+        if(HX20SerialDevice *dev = findDevice(did))
+            dev->pendingResponses++;
+    }
+    if(threaded && !ioThreadCaller) {
+        //hand the packet over to the io thread
+        TxRequest req;
+        req.sid = sid;
+        req.did = did;
+        req.fnc = fnc;
+        req.data.assign(buf, buf+size);
+        req.prepared = nullptr;
+        while(!txRequests.push(std::move(req)))
+            std::this_thread::yield();
+        if(!ioWakePending.exchange(true))
+            wakeFd(ioWakeFd);
+        return 0;
+    }
+    return queuePacket(sid, did, fnc, size, buf);
+}
+
+int HX20SerialConnection::sendPacket(std::shared_ptr<HX20PreparedPacket const> const &packet) {
+    bool ioThreadCaller = threaded && std::this_thread::get_id() == ioThread.get_id();
+    if(!ioThreadCaller) {
+        if(HX20SerialDevice *dev = findDevice(packet->did))
+            dev->pendingResponses++;
+    }
+    if(threaded && !ioThreadCaller) {
+        TxRequest req;
+        req.prepared = packet;
+        while(!txRequests.push(std::move(req)))
+            std::this_thread::yield();
+        if(!ioWakePending.exchange(true))
+            wakeFd(ioWakeFd);
+        return 0;
+    }
+    return queuePacket(packet);
+}
+
+//reuses the frame buffers of an already finished packet if possible
+HX20SerialConnection::TxPacket HX20SerialConnection::takeSpareTxPacket() {
+    TxPacket pkt;
+    if(!txSpare.empty()) {
+        pkt = std::move(txSpare.back());
+        txSpare.pop_back();
+    } else {
+        pkt.headerBuf.reserve(HEADER_FRAME_MAX);
+    }
+    return pkt;
+}
+
+int HX20SerialConnection::enqueueTxPacket(TxPacket &&pkt) {
+    txQueue.push_back(std::move(pkt));
+    if(txState == TxIdle)
+        return startTransmit();
+    return 0;
+}
+
+int HX20SerialConnection::queuePacket(uint16_t sid, uint16_t did, uint8_t fnc,
+                                      uint16_t size, uint8_t const *buf) {
+    TxPacket pkt = takeSpareTxPacket();
+    pkt.sid = sid;
+    pkt.did = did;
+    pkt.fnc = fnc;
+    assembleFrames(pkt.headerBuf, pkt.textBuf, sid, did, fnc, size, buf);
+    return enqueueTxPacket(std::move(pkt));
+}
+
+int HX20SerialConnection::queuePacket(std::shared_ptr<HX20PreparedPacket const> const &packet) {
+    TxPacket pkt = takeSpareTxPacket();
+    pkt.sid = packet->sid;
+    pkt.did = packet->did;
+    pkt.fnc = packet->fnc;
+    pkt.prepared = packet;
+    return enqueueTxPacket(std::move(pkt));
+}
+
+void HX20SerialConnection::armTxTimer(std::chrono::microseconds timeout) {
+    txDeadline = std::chrono::steady_clock::now() + timeout;
+}
+
+//the estimator for the frame waiting for its ACK
+HX20RttEstimator &HX20SerialConnection::txRtt() {
+    return txState == TxSentText ? textRtt : headerRtt;
+}
+
+/* The estimated turnaround plus the time the frame needs on the line. The
+ * ACK timer starts when a frame is handed to the kernel, so the line time
+ * is added to the timeout and left out of the round trip samples.
+ */
+void HX20SerialConnection::armAckTimer() {
+    TxPacket &pkt = txQueue.front();
+    size_t size = (txState == TxSentText ? pkt.text() : pkt.header()).size();
+    armTxTimer(std::chrono::microseconds(txRtt().timeout() +
+                                         size * transport->lineUsPerByte()));
+}
+
+int HX20SerialConnection::sendTxHeader() {
+    TxPacket &pkt = txQueue.front();
+    if(writeBytes(pkt.header().data(), pkt.header().size()) < 0)
+        return -1;
+    txSentTime = std::chrono::steady_clock::now();
+    if(txRetries == TX_RETRIES)
+        stats.responseStarted(txSentTime);
+    notifyOutput(HX20SerialMonitor::SentPacketHeaderRequest,
+                 pkt.header().data(), pkt.header().size());
+    txState = TxSentHeader;
+    txSampleValid = txRetries == TX_RETRIES;
+    txWak = false;
+    armAckTimer();
+    return 0;
+}
+
+int HX20SerialConnection::sendTxText() {
+    TxPacket &pkt = txQueue.front();
+    if(writeBytes(pkt.text().data(), pkt.text().size()) < 0)
+        return -1;
+    txSentTime = std::chrono::steady_clock::now();
+    notifyOutput(HX20SerialMonitor::SentPacketTextRequest,
+                 pkt.text().data(), pkt.text().size());
+    txState = TxSentText;
+    txSampleValid = txRetries == TX_RETRIES;
+    txWak = false;
+    armAckTimer();
+    return 0;
+}
+
+int HX20SerialConnection::startTransmit() {
+    if(txQueue.empty()) {
+        txState = TxIdle;
+        return 0;
+    }
+
+    //The disk device would have at most one byte stored, so just flush
+    //all the chatter from the hx-20 out.
+    if(fillInput() < 0)
+        return -1;
+    while(inRead != inWrite) {
+        uint8_t b = inRing[inRead++ % inRing.size()];
+        notifyInput(HX20SerialMonitor::GotUnassociated, b);
+    }
+
+    txRetries = TX_RETRIES;
+    return sendTxHeader();
+}
+
+int HX20SerialConnection::finishTransmit(int result) {
+    std::vector<TxPacket> done;
+    done.push_back(std::move(txQueue.front()));
+    txQueue.pop_front();
+    //if the hx-20 did not take this packet, it will not take the
+    //ones queued behind it either.
+    if(result != 0) {
+        while(!txQueue.empty()) {
+            done.push_back(std::move(txQueue.front()));
+            txQueue.pop_front();
         }
-        data.push_back(sid & 0xff);
-        WRITESUMb(sid & 0xff);
+    }
+    txState = TxIdle;
 
-        data.push_back(fnc);
-        WRITESUMb(fnc);
+    HX20SerialMonitor::Frame frame;
+    frame.dir = HX20SerialMonitor::Frame::SlaveToMaster;
+    frame.did = done.front().did;
+    frame.sid = done.front().sid;
+    frame.fnc = done.front().fnc;
+    frame.text = done.front().text().data();
+    frame.textSize = done.front().text().size();
+    notifyFrame(txFrame, frame);
 
-        if(fmt & 0x2) {
-            data.push_back(siz >> 8);
-            WRITESUMb(siz >> 8);
+    for(auto &pkt : done) {
+        //STX, data, ETX, cks
+        stats.packetSent(pkt.fnc, pkt.did, pkt.text().size()-3, result);
+        if(threaded) {
+            Event ev;
+            ev.type = Event::SendComplete;
+            ev.did = pkt.did;
+            ev.sid = pkt.sid;
+            ev.fnc = pkt.fnc;
+            ev.state = result;
+            postEvent(std::move(ev), false);
+        } else if(HX20SerialDevice *dev = findDevice(pkt.did)) {
+            deliverSendComplete(dev, pkt.did, pkt.sid, pkt.fnc, result);
         }
-        data.push_back(siz & 0xff);
-        WRITESUMb(siz & 0xff);
+        pkt.prepared = nullptr;
+        txSpare.push_back(std::move(pkt));
+    }
 
-        data.push_back(-sum);
-        WRITEb(-sum);
+    //completion handlers may already have started the next packet
+    if(txState == TxIdle)
+        return startTransmit();
+    return 0;
+}
 
-        for(auto &m : monitors)
-            m->monitorOutput(HX20SerialMonitor::SentPacketHeaderRequest, data);
+int HX20SerialConnection::transmitByte(uint8_t b) {
+    HX20SerialMonitor::InputPacketState ms =
+        (txState == TxSentHeader) ?
+        HX20SerialMonitor::GotPacketHeaderResponse :
+        HX20SerialMonitor::GotPacketTextResponse;
+    notifyInput(ms, b);
 
-        while(true) {
-            int res = readTimeout(fd, &b, 1, 800);
-            if(res < 0)
-                return -1;
-            if(res == 0) {
-                b = 0;
-                break;
-            }
-//            EPSP_DEBUG("answer: %02x\n",b);
-            for(auto &m : monitors)
-                m->monitorInput(HX20SerialMonitor::GotPacketHeaderResponse,
-                                std::vector<uint8_t>(1, b));
-            if(b == ACK) {
-                break;
-            } else if(b == NAK || b == EOT) {
-                continue;
-            } else {
-                //WAK handling would be:
-                //1) WAK received; wait 1s, send ENQ. if WAK again, stay at 1)
-                //2) ACK received, continue.
-                EPSP_DEBUG("error: hx20 replied %02x\n",b);
-                fflush(stdout);
-                break;
-            }
+    TxPacket &pkt = txQueue.front();
+    if(b == NAK || b == EOT) {
+        stats.nakReceived(pkt.fnc, pkt.did);
+        txWak = false;
+        armAckTimer();
+        return 0;
+    }
+    if(b == WAK) {
+        //the hx-20 is busy and got the frame. It keeps the bus, and we
+        //do not use up retries while it works.
+        stats.wakReceived(pkt.fnc, pkt.did);
+        HX20_TRACE(Proto, Debug, "hx20 sent WAK for fnc %02x\n", pkt.fnc);
+        txSampleValid = false;
+        txWak = true;
+        txEnqSent = false;
+        armTxTimer(std::chrono::milliseconds(TX_WAK_POLL_MS));
+        return 0;
+    }
+    if(b == ACK) {
+        auto now = std::chrono::steady_clock::now();
+        stats.ackReceived(pkt.fnc, pkt.did, txSentTime, now);
+        if(txSampleValid) {
+            size_t size = (txState == TxSentText ? pkt.text() : pkt.header()).size();
+            txRtt().sample(std::chrono::duration_cast<std::chrono::microseconds>(
+                           now - txSentTime).count() -
+                           size * transport->lineUsPerByte());
+            if(txState == TxSentText)
+                stats.rttUpdated(textRtt.smoothed(), textRtt.timeout());
         }
-        if(b == ACK)
-            break;
-        retries--;
-        if(retries == 0)
-            return 1;
-    }
-
-    retries = 4;
-    while(1) {
-        sum = 0;
-        std::vector<uint8_t> data;
-        WRITESUMb(STX);
-        data.push_back(STX);
-        for(i = 0; i < size; i++) {
-            WRITESUMb(buf[i]);
-            data.push_back(buf[i]);
+        txWak = false;
+        if(txState == TxSentHeader) {
+            txRetries = TX_RETRIES;
+            return sendTxText();
         }
-        data.push_back(ETX);
-        WRITESUMb(ETX);
-        data.push_back(-sum);
-        WRITEb(-sum);
+        WRITEb(EOT);
+        notifyOutput(HX20SerialMonitor::SentReverseDirection, EOT);
+        return finishTransmit(0);
+    }
+    HX20_TRACE(Proto, Debug, "hx20 replied %02x to a frame\n", b);
+    return retryTransmit();
+}
 
-        for(auto &m : monitors)
-            m->monitorOutput(HX20SerialMonitor::SentPacketTextRequest, data);
+int HX20SerialConnection::retryTransmit() {
+    txRetries--;
+    if(txRetries == 0)
+        return finishTransmit(1);
+    stats.retry(txQueue.front().fnc, txQueue.front().did);
+    if(txState == TxSentHeader)
+        return sendTxHeader();
+    return sendTxText();
+}
 
-        while(true) {
-            int res = readTimeout(fd, &b, 1, 800);
-            if(res < 0)
-                return -1;
-            if(res == 0) {
-                b = 0;
-                break;
-            }
-//            EPSP_DEBUG("answer: %02x\n",b);
-            for(auto &m : monitors)
-                m->monitorInput(HX20SerialMonitor::GotPacketTextResponse,
-                                std::vector<uint8_t>(1, b));
-            if(b == ACK) {
-                break;
-            } else if(b == NAK || b == EOT) {
-                continue;
-            } else {
-                //WAK handling would be:
-                //1) WAK received; wait 1s, send ENQ. if WAK again, stay at 1)
-                //2) ACK received, continue.
-                EPSP_DEBUG("error: hx20 replied %02x\n",b);
-                fflush(stdout);
-                break;//restart at sending the header
-            }
-        }
-        if(b == ACK)
-            break;
-        retries--;
-        if(retries == 0)
-            return 1;
+int HX20SerialConnection::txTimeout() const {
+    if(txState == TxIdle)
+        return -1;
+    auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>
+                     (txDeadline - std::chrono::steady_clock::now()).count();
+    if(remaining < 0)
+        return 0;
+    return remaining;
+}
+
+int HX20SerialConnection::txTimerExpired() {
+    if(txWak && !txEnqSent) {
+        //done waiting after a WAK, ask whether the hx-20 is ready
+        WRITEb(ENQ);
+        notifyOutput(HX20SerialMonitor::SentEnquiry, ENQ);
+        txEnqSent = true;
+        armTxTimer(std::chrono::microseconds(txRtt().timeout()));
+        return 0;
     }
+    stats.timeout(txQueue.front().fnc, txQueue.front().did);
+    txRtt().backoff();
+    if(txState == TxSentText)
+        stats.rttUpdated(textRtt.smoothed(), textRtt.timeout());
+    return retryTransmit();
+}
 
-    WRITEb(EOT);
+int HX20SerialConnection::checkTxTimeout() {
+    if(txState == TxIdle ||
+            std::chrono::steady_clock::now() < txDeadline)
+        return 0;
+    return txTimerExpired();
+}
+
+int HX20SerialConnection::forceTimeout() {
+    if(txState == TxIdle)
+        return 0;
+    return txTimerExpired();
+}
+
+int HX20SerialConnection::getTimeout() const {
+    //in threaded mode, the io thread takes care of the timers
+    if(threaded)
+        return -1;
+    return txTimeout();
+}
+
+bool HX20SerialConnection::getDeadline(std::chrono::steady_clock::time_point &deadline) const {
+    if(threaded || txState == TxIdle)
+        return false;
+    deadline = txDeadline;
+    return true;
+}
+
+int HX20SerialConnection::handleTimeout() {
+    if(threaded)
+        return 0;
+    return checkTxTimeout();
+}
+
+void HX20SerialConnection::notifyInput(HX20SerialMonitor::InputPacketState state,
+                                       uint8_t const *bytes, size_t size) {
+    if(!monitoring())
+        return;
+    HX20SerialMonitor::Timestamp now = std::chrono::steady_clock::now();
+    switch(state) {
+    case HX20SerialMonitor::GotSelectRequest:
+        rxFrame.open = false;
+        break;
+    case HX20SerialMonitor::GotPacketHeaderRequest:
+        traceFrame(rxFrame, bytes, size, true, now);
+        break;
+    case HX20SerialMonitor::GotPacketTextEnd:
+        traceFrame(rxFrame, bytes, size, false, now);
+        break;
+    case HX20SerialMonitor::GotPacketHeaderResponse:
+    case HX20SerialMonitor::GotPacketTextResponse:
+        traceFrame(txFrame, bytes, size, false, now);
+        break;
+    default:
+        break;
+    }
+    if(threaded) {
+        Event ev;
+        ev.type = Event::MonitorInput;
+        ev.state = state;
+        ev.time = now;
+        uint32_t sz = size;
+        postMonitorEvent(std::move(ev), &bytes, &sz, 1);
+        return;
+    }
     for(auto &m : monitors)
-        m->monitorOutput(HX20SerialMonitor::SentReverseDirection,
-                         std::vector<uint8_t>(1, EOT));
-    return 0;
+        m->monitorInput(state, bytes, size, now);
 }
 
-void HX20SerialConnection::addByteToBuf(uint8_t b) {
-    buf.push_back(b);
+void HX20SerialConnection::notifyOutput(HX20SerialMonitor::OutputPacketState state,
+                                        uint8_t const *bytes, size_t size) {
+    if(!monitoring())
+        return;
+    HX20SerialMonitor::Timestamp now = std::chrono::steady_clock::now();
+    switch(state) {
+    case HX20SerialMonitor::SentPacketHeaderRequest:
+        traceFrame(txFrame, bytes, size, true, now);
+        break;
+    case HX20SerialMonitor::SentReverseDirection:
+    case HX20SerialMonitor::SentEnquiry:
+        traceFrame(txFrame, bytes, size, false, now);
+        break;
+    case HX20SerialMonitor::SentPacketHeaderResponse:
+    case HX20SerialMonitor::SentPacketTextResponse:
+        traceFrame(rxFrame, bytes, size, false, now);
+        break;
+    default:
+        break;
+    }
+    if(threaded) {
+        Event ev;
+        ev.type = Event::MonitorOutput;
+        ev.state = state;
+        ev.time = now;
+        uint32_t sz = size;
+        postMonitorEvent(std::move(ev), &bytes, &sz, 1);
+        return;
+    }
+    for(auto &m : monitors)
+        m->monitorOutput(state, bytes, size, now);
 }
 
-uint8_t HX20SerialConnection::checkSumBuf() {
-    uint8_t sum = 0;
-    for(unsigned int i = 0; i < buf.size(); i++)
-        sum += buf[i];
-    return sum;
+void HX20SerialConnection::traceFrame(FrameTrace &trace,
+                                      uint8_t const *bytes, size_t size,
+                                      bool header,
+                                      HX20SerialMonitor::Timestamp time) {
+    if(!trace.open) {
+        trace.open = true;
+        trace.headerSize = 0;
+        trace.handshakeSize = 0;
+        trace.begin = time;
+    }
+    if(header) {
+        //a repeated header replaces the previous one
+        trace.headerSize = std::min(size, trace.header.size());
+        memcpy(trace.header.data(), bytes, trace.headerSize);
+        return;
+    }
+    size_t n = std::min(size, trace.handshake.size() - trace.handshakeSize);
+    memcpy(trace.handshake.data() + trace.handshakeSize, bytes, n);
+    trace.handshakeSize += n;
+}
+
+//frame comes with dir, ids and text filled in
+void HX20SerialConnection::notifyFrame(FrameTrace &trace,
+                                       HX20SerialMonitor::Frame &frame) {
+    if(!trace.open)
+        return;
+    trace.open = false;
+    if(!monitoring())
+        return;
+    frame.header = trace.header.data();
+    frame.headerSize = trace.headerSize;
+    frame.handshake = trace.handshake.data();
+    frame.handshakeSize = trace.handshakeSize;
+    frame.begin = trace.begin;
+    frame.end = std::chrono::steady_clock::now();
+    if(threaded) {
+        Event ev;
+        ev.type = Event::MonitorFrame;
+        ev.state = frame.dir;
+        ev.did = frame.did;
+        ev.sid = frame.sid;
+        ev.fnc = frame.fnc;
+        ev.time = frame.begin;
+        ev.time2 = frame.end;
+        uint8_t const *parts[3] = { frame.header, frame.text, frame.handshake };
+        uint32_t sizes[3] = { (uint32_t)frame.headerSize, (uint32_t)frame.textSize,
+                              (uint32_t)frame.handshakeSize };
+        postMonitorEvent(std::move(ev), parts, sizes, 3);
+        return;
+    }
+    for(auto &m : monitors)
+        m->monitorFrame(frame);
+}
+
+HX20SerialDevice *HX20SerialConnection::findDevice(uint16_t id) {
+    if(id < devices.size())
+        return devices[id].load(std::memory_order_acquire);
+    std::atomic<HX20SerialDevice *> *wide =
+        wideDevices.load(std::memory_order_acquire);
+    if(!wide)
+        return nullptr;
+    return wide[id].load(std::memory_order_acquire);
 }
 
+//SOH, fmt, did, sid, fnc, siz, hcs; fmt bit 2 makes the ids 16 bit,
+//fmt bit 1 the size. Bit 0 is the direction, which we ignore.
+static const uint8_t headerLength[8] = {
+    7, 7, 8, 8, 9, 9, 10, 10
+};
+
 int HX20SerialConnection::receiveByte(uint8_t b) {
-    EPSP_DEBUG("Got %02x in ",b);
+    HX20_TRACE(Proto, Verbose, "got %02x in state %d\n", b, state);
     switch(state) {
-    case Select: {
+    case Select:
         //according to docs, this is: PS <sid> <did> ENQ, which can
         //be followed up with ACK by the <did> device
-        EPSP_DEBUG("Select\n");
-        addByteToBuf(b);
-        if(buf.size() < 4) {
-            fflush(stdout);
+        rxBuf[rxLen++] = b;
+        if(rxLen < 4)
             return 0;
-        }
-        selectedSlaveID = buf[1];
-        selectedMasterID = buf[2];
-        EPSP_DEBUG("Selected 0x%04x => 0x%04x\n",
-                   selectedMasterID,
-                   selectedSlaveID);
-        for(auto &m : monitors)
-            m->monitorInput(HX20SerialMonitor::GotSelectRequest, buf);
-        buf.clear();
-        HX20SerialDevice *dev = devices[selectedSlaveID];
-        if(dev) {
-            for(auto &m : monitors)
-                m->monitorOutput(HX20SerialMonitor::SentSelectResponse,
-                                 std::vector<uint8_t>(1, ACK));
+        selectedSlaveID = rxBuf[1];
+        selectedMasterID = rxBuf[2];
+        HX20_TRACE(Proto, Debug, "selected 0x%04x => 0x%04x\n",
+                   selectedMasterID, selectedSlaveID);
+        notifyInput(HX20SerialMonitor::GotSelectRequest, rxBuf.data(), rxLen);
+        rxLen = 0;
+        state = NoHeader;
+        if(findDevice(selectedSlaveID)) {
+            //while bridging, the select has been relayed already and
+            //the bridged device ignores it
+            bridging = false;
+            notifyOutput(HX20SerialMonitor::SentSelectResponse, ACK);
             WRITEb(ACK);
+        } else if(bridge && !bridging) {
+            //the EOT before the select went nowhere, so send it along
+            uint8_t sel[5] = { EOT, rxBuf[0], rxBuf[1], rxBuf[2], rxBuf[3] };
+            bridging = true;
+            HX20_TRACE(Proto, Debug, "bridging 0x%04x\n", selectedSlaveID);
+            if(relayToBridge(sel, sizeof(sel)) < 0)
+                return -1;
         }
-        EPSP_DEBUG("\n");
-        state = NoHeader;
-        fflush(stdout);
         return 0;
-    }
     case HaveHeader:
-        assert(buf.empty());
-        EPSP_DEBUG("HaveHeader");
         if(b == STX) {
-            EPSP_DEBUG("\n");
-            addByteToBuf(b);
+            rxBuf[0] = b;
+            rxLen = 1;
+            rxSum = b;
+            //STX, siz+1 bytes of data, ETX, cks
+            rxExpect = (uint32_t)siz+1+1+1+1;
             state = Text;
-            fflush(stdout);
             return 0;
         }
-        EPSP_DEBUG("->");
+        //fall through
     case NoHeader:
-        assert(buf.empty());
-        EPSP_DEBUG("NoHeader");
         state = NoHeader;
         if(b == SOH) {
-            addByteToBuf(b);
+            rxBuf[0] = b;
+            rxLen = 1;
+            rxSum = b;
             state = Header;
-            EPSP_DEBUG("->Header\n");
         } else if(b == PS) {
+            rxBuf[0] = b;
+            rxLen = 1;
             state = Select;
-            addByteToBuf(b);
         } else {
-            for(auto &m : monitors)
-                m->monitorInput(HX20SerialMonitor::GotUnassociated, std::vector<uint8_t>(1, b));
-            EPSP_DEBUG("\n");
+            notifyInput(HX20SerialMonitor::GotUnassociated, b);
         }
-        fflush(stdout);
         return 0;
     case Header: {
-        EPSP_DEBUG("Header");
-        addByteToBuf(b);
-        if(buf.size() < 2) {
-            EPSP_DEBUG("\n");
-            fflush(stdout);
+        rxBuf[rxLen++] = b;
+        rxSum += b;
+        if(rxLen == 2)
+            rxExpect = headerLength[b & 0x7];
+        if(rxLen < rxExpect)
             return 0;
-        }
-        uint8_t fmt = buf[1];
-        unsigned int size = 1+1+1+1+1+1+1;
-        //soh+fmt+did+sid+fnc+siz+hcs
-        if(fmt & 0x1) { //should be 0 for MasterToSlave. We ignore it.
-        }
-        if(fmt & 0x2) //Size is 16 bit
-            size++;
-        if(fmt & 0x4) //IDs are 16 bit
-            size += 2;
-        if(buf.size() < size) {
-            EPSP_DEBUG("\n");
-            fflush(stdout);
-            return 0;
-        }
-        if(checkSumBuf() != 0) {
-            for(auto &m : monitors)
-                m->monitorInput(HX20SerialMonitor::GotPacketHeaderRequest, buf);
-            WRITEb(NAK);
-            for(auto &m : monitors)
-                m->monitorOutput(HX20SerialMonitor::SentPacketHeaderResponse,
-                                 std::vector<uint8_t>(1, NAK));
-            buf.clear();
-            EPSP_DEBUG("->NoHeader\n");
+        notifyInput(HX20SerialMonitor::GotPacketHeaderRequest, rxBuf.data(), rxLen);
+        if(rxSum != 0) {
+            HX20_TRACE(Proto, Warning, "header checksum error\n");
+            stats.headerChecksumError();
+            if(!bridging) {
+                WRITEb(NAK);
+                notifyOutput(HX20SerialMonitor::SentPacketHeaderResponse, NAK);
+            }
+            rxLen = 0;
             state = NoHeader;
-            fflush(stdout);
             return 0;
         }
 
-        int pos = 2;//soh+fmt
-        if(fmt & 4) {
-            did = buf[pos++] << 8;
-            did |= buf[pos++];
-            sid = buf[pos++] << 8;
-            sid |= buf[pos++];
-        } else {
-            did = buf[pos++];
-            sid = buf[pos++];
-        }
-        fnc = buf[pos++];
-        if(fmt & 2) {
-            siz = buf[pos++] << 8;
-            siz |= buf[pos++];
+        uint8_t fmt = rxBuf[1];
+        uint8_t const *p = rxBuf.data() + 2;//soh+fmt
+        if(fmt & 0x4) {
+            did = (p[0] << 8) | p[1];
+            sid = (p[2] << 8) | p[3];
+            p += 4;
         } else {
-            siz = buf[pos++];
+            did = p[0];
+            sid = p[1];
+            p += 2;
         }
+        fnc = *p++;
+        if(fmt & 0x2)
+            siz = (p[0] << 8) | p[1];
+        else
+            siz = p[0];
 
-        for(auto &m : monitors)
-            m->monitorInput(HX20SerialMonitor::GotPacketHeaderRequest, buf);
-        WRITEb(ACK);
-        for(auto &m : monitors)
-            m->monitorOutput(HX20SerialMonitor::SentPacketHeaderResponse,
-                             std::vector<uint8_t>(1, ACK));
-        buf.clear();
-        EPSP_DEBUG("->HaveHeader\n");
+        if(!bridging) {
+            WRITEb(ACK);
+            notifyOutput(HX20SerialMonitor::SentPacketHeaderResponse, ACK);
+        }
+        rxLen = 0;
         state = HaveHeader;
-        fflush(stdout);
         return 0;
     }
-    case Text: {
-        EPSP_DEBUG("Text\n");
-        addByteToBuf(b);
-        if(buf.size() < (unsigned)siz+1+1+1+1) {
-            fflush(stdout);
+    case Text:
+        rxBuf[rxLen++] = b;
+        rxSum += b;
+        if(rxLen < rxExpect)
             return 0;
-        }
-        if(checkSumBuf() != 0) {
-            for(auto &m : monitors)
-                m->monitorInput(HX20SerialMonitor::GotPacketTextRequest, buf);
-            WRITEb(NAK);
-            for(auto &m : monitors)
-                m->monitorOutput(HX20SerialMonitor::SentPacketTextResponse,
-                                 std::vector<uint8_t>(1, NAK));
-
-            buf.clear();
+        notifyInput(HX20SerialMonitor::GotPacketTextRequest, rxBuf.data(), rxLen);
+        if(rxSum != 0) {
+            HX20_TRACE(Proto, Warning, "text checksum error, fnc %02x to 0x%04x\n",
+                       fnc, did);
+            stats.checksumError(fnc, did);
+            if(!bridging) {
+                WRITEb(NAK);
+                notifyOutput(HX20SerialMonitor::SentPacketTextResponse, NAK);
+            }
+            rxLen = 0;
             state = HaveHeader;
-            EPSP_DEBUG("->HaveHeader\n");
-            fflush(stdout);
             return 0;
         }
-
-        for(auto &m : monitors)
-            m->monitorInput(HX20SerialMonitor::GotPacketTextRequest, buf);
-        WRITEb(ACK);
-        for(auto &m : monitors)
-            m->monitorOutput(HX20SerialMonitor::SentPacketTextResponse,
-                             std::vector<uint8_t>(1, ACK));
+        if(!bridging) {
+            WRITEb(ACK);
+            notifyOutput(HX20SerialMonitor::SentPacketTextResponse, ACK);
+        }
         state = EndOfText;
-        EPSP_DEBUG("->EndOfText\n");
-        fflush(stdout);
-        break;
-    }
+        return 0;
     case EndOfText: {
-        EPSP_DEBUG("EndOfText");
-        for(auto &m : monitors)
-            m->monitorInput(HX20SerialMonitor::GotPacketTextEnd,
-                            std::vector<uint8_t>(1, b));
+        notifyInput(HX20SerialMonitor::GotPacketTextEnd, b);
         if(b == ENQ) {
-            WRITEb(ACK);
-            for(auto &m : monitors)
-                m->monitorOutput(HX20SerialMonitor::SentPacketTextResponse,
-                                 std::vector<uint8_t>(1, ACK));
-            break;
+            if(!bridging) {
+                WRITEb(ACK);
+                notifyOutput(HX20SerialMonitor::SentPacketTextResponse, ACK);
+            }
+            return 0;
         } else if(b != EOT) {
-            break;
+            return 0;
         }
-        EPSP_DEBUG("->HaveHeader\n");
-        fflush(stdout);
         state = HaveHeader;
 
-        HX20SerialDevice *dev = devices[did];
+        HX20SerialMonitor::Frame frame;
+        frame.dir = HX20SerialMonitor::Frame::MasterToSlave;
+        frame.did = did;
+        frame.sid = sid;
+        frame.fnc = fnc;
+        frame.text = rxBuf.data();
+        frame.textSize = rxLen;
+        notifyFrame(rxFrame, frame);
+        rxLen = 0;
+        stats.packetReceived(fnc, did, siz+1, std::chrono::steady_clock::now());
 
-        if(dev) {
-            fflush(stdout);
-            int res = dev->gotPacket(
-                      did, sid, fnc, siz+1, buf.data()+1,
-                      this);
-            buf.clear();
-            return res;
+        HX20SerialDevice *dev = findDevice(did);
+        if(!dev)
+            return 0;
+        if(threaded) {
+            //the device runs on the thread owning the connection
+            Event ev;
+            ev.type = Event::Packet;
+            ev.did = did;
+            ev.sid = sid;
+            ev.fnc = fnc;
+            ev.data.assign(rxBuf.data()+1, rxBuf.data()+1+siz+1);
+            postEvent(std::move(ev), false);
+            return 0;
         }
-        buf.clear();
-        fflush(stdout);
-        return 0;
+        return deliverPacket(dev, did, sid, fnc, siz+1, rxBuf.data()+1);
     }
-    default:
-        EPSP_DEBUG("Unknown??\n");
-        fflush(stdout);
-        break;
     }
     return 0;
 }
 
-HX20SerialConnection::HX20SerialConnection(char const *device) :
-    state(NoHeader) {
-    struct termios termios_d;
-
-    fd = open(device, O_RDWR);
-    if(fd == -1)
-        throw IOError(errno, std::system_category(), "Could not open device");
+int HX20SerialConnection::deliverPacket(HX20SerialDevice *dev, uint16_t did,
+                                        uint16_t sid, uint8_t fnc,
+                                        uint16_t size, uint8_t *buf) {
+    dev->delivering = true;
+    int res = dev->gotPacket(did, sid, fnc, size, buf, this);
+    dev->delivering = false;
+    if(dev->pendingResponses == 0)
+        dev->runDeferred();
+    return res;
+}
 
-    if(tcgetattr(fd, &termios_d) == -1)
-        throw IOError(errno, std::system_category(), "Get terminal attributes failed");
-    cfmakeraw(&termios_d);
+//for responses that are never going to be sent
+void HX20SerialConnection::dropResponse(HX20SerialDevice *dev) {
+    if(!dev || dev->pendingResponses == 0)
+        return;
+    dev->pendingResponses--;
+    if(dev->pendingResponses == 0 && !dev->delivering)
+        dev->runDeferred();
+}
 
-    termios_d.c_cflag &= ~CRTSCTS;
+void HX20SerialConnection::deliverSendComplete(HX20SerialDevice *dev,
+                                               uint16_t did, uint16_t sid,
+                                               uint8_t fnc, int result) {
+    if(dev->pendingResponses > 0)
+        dev->pendingResponses--;
+    dev->delivering = true;
+    dev->sendComplete(did, sid, fnc, result);
+    dev->delivering = false;
+    if(dev->pendingResponses == 0)
+        dev->runDeferred();
+}
 
-    cfsetospeed(&termios_d,B38400);
-    cfsetispeed(&termios_d,B38400);
-    if(tcsetattr(fd, TCSANOW, &termios_d) == -1)
-        throw IOError(errno, std::system_category(), "Set terminal attributes failed");
-    if(tcflush(fd, TCIOFLUSH) == -1)
-        throw IOError(errno, std::system_category(), "Flush terminal failed");
+HX20SerialConnection::HX20SerialConnection(char const *device) :
+    HX20SerialConnection(HX20Transport::open(device)) {
+}
 
-    int i = TIOCM_DTR; // Pin DTR wird deaktiviert (-12V)
-    // interessiert aber iirc niemanden?
-    if(ioctl(fd, TIOCMBIC, &i) == -1)
-        throw IOError(errno, std::system_category(), "Setting DTR failed");
+HX20SerialConnection::HX20SerialConnection(std::unique_ptr<HX20Transport> transport) :
+    transport(std::move(transport)), wideDevices(nullptr),
+    state(NoHeader), inRead(0), inWrite(0), bridgeFd(-1), bridging(false),
+    rxLen(0), rxExpect(0), rxSum(0),
+    txState(TxIdle), txRetries(0),
+    txSampleValid(false), txWak(false), txEnqSent(false),
+    threaded(false), ioStop(false), ioWakeFd(-1), dispatchFd(-1),
+    ioWakePending(false), dispatchPending(false), monitorCount(0),
+    monTail(0), monHead(0), capturing(false) {
+    fd = this->transport->getFd();
+    for(auto &d : devices)
+        d.store(nullptr);
+    rxFrame.open = false;
+    txFrame.open = false;
 }
 
 HX20SerialConnection::~HX20SerialConnection() {
-    close(fd);
+    if(threaded)
+        stopThread();
+    //the devices may go on with another connection
+    for(auto &pkt : txQueue)
+        dropResponse(findDevice(pkt.did));
+    txQueue.clear();
+    delete[] wideDevices.load();
 }
 
 int HX20SerialConnection::poll() {
-    struct pollfd pfd;
-    pfd.fd = fd;
-    pfd.events = POLLIN;
-    int res;
-    while((res = ::poll(&pfd,1,0)) > 0) {
-        if(pfd.revents & POLLIN) {
-            uint8_t b;
-            READb(b);
-            if(receiveByte(b) < 0)
+    while(true) {
+        int res = fillInput();
+        if(res < 0)
+            return -1;
+        //receiveByte may hand off to a device which sends a reply and
+        //consumes further bytes from the ring itself.
+        //Bytes arriving while bridging are relayed straight from the
+        //ring, in runs up to where bridging ends.
+        uint32_t relayFrom = inRead;
+        bool relaying = bridging;
+        while(inRead != inWrite) {
+            if(relaying != bridging) {
+                if(relaying && relayRing(relayFrom, inRead) < 0)
+                    return -1;
+                relayFrom = inRead;
+                relaying = bridging;
+            }
+            uint8_t b = inRing[inRead++ % inRing.size()];
+            int res = (txState == TxIdle) ? receiveByte(b) : transmitByte(b);
+            if(res < 0)
                 return -1;
         }
+        if(relaying && relayRing(relayFrom, inRead) < 0)
+            return -1;
+        //a short read means the kernel buffer has been drained
+        if(res == 0 || (unsigned)res < inRing.size())
+            break;
     }
-    if(res < 0)
+    return checkTxTimeout();
+}
+
+int HX20SerialConnection::feedBytes(uint8_t const *bytes, size_t size) {
+    if(bridge)
+        inTime = std::chrono::steady_clock::now();
+    size_t relayFrom = 0;
+    bool relaying = bridging;
+    for(size_t i = 0; i < size; i++) {
+        if(relaying != bridging) {
+            if(relaying && relayToBridge(bytes + relayFrom, i - relayFrom) < 0)
+                return -1;
+            relayFrom = i;
+            relaying = bridging;
+        }
+        int res = (txState == TxIdle) ? receiveByte(bytes[i]) : transmitByte(bytes[i]);
+        if(res < 0)
+            return -1;
+    }
+    if(relaying && relayToBridge(bytes + relayFrom, size - relayFrom) < 0)
         return -1;
     return 0;
 }
 
-void HX20SerialConnection::loop() {
-    while(1) {
-        if(poll() < 0)
-            return;
+void HX20SerialConnection::setBridge(std::unique_ptr<HX20Transport> bridge) {
+    this->bridge = std::move(bridge);
+    bridgeFd = this->bridge ? this->bridge->getFd() : -1;
+    bridging = false;
+}
+
+int HX20SerialConnection::relayToBridge(uint8_t const *bytes, size_t size) {
+    if(size == 0)
+        return 0;
+    if(writeAll(*bridge, bytes, size) < 0)
+        return -1;
+    stats.relayed(size, inTime, std::chrono::steady_clock::now());
+    return 0;
+}
+
+//relays inRing[from..to), which can wrap around the end of the ring
+int HX20SerialConnection::relayRing(uint32_t from, uint32_t to) {
+    if(from == to)
+        return 0;
+    uint32_t pos = from % inRing.size();
+    uint32_t size = to - from;
+    uint32_t first = std::min<uint32_t>(size, inRing.size() - pos);
+    if(writeAll(*bridge, &inRing[pos], first) < 0)
+        return -1;
+    if(first < size && writeAll(*bridge, &inRing[0], size - first) < 0)
+        return -1;
+    stats.relayed(size, inTime, std::chrono::steady_clock::now());
+    return 0;
+}
+
+/* Passes whatever the bridged device sent on to the hx-20. Anything it
+ * sends while not selected is dropped.
+ */
+int HX20SerialConnection::pollBridge() {
+    uint8_t buf[4096];
+    while(true) {
+        struct iovec iov;
+        iov.iov_base = buf;
+        iov.iov_len = sizeof(buf);
+        ssize_t res;
+        do {
+            res = bridge->readv(&iov, 1);
+        } while(res < 0 && errno == EINTR);
+        if(res < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        if(res == 0)
+            return -1;
+        auto readTime = std::chrono::steady_clock::now();
+        if(!bridging)
+            continue;
+        if(writeBytes(buf, res) < 0)
+            return -1;
+        stats.relayed(res, readTime, std::chrono::steady_clock::now());
+        //the bridged device starting its response packet
+        if(memchr(buf, SOH, res))
+            stats.responseStarted(readTime);
+        notifyOutput(HX20SerialMonitor::SentRelayed, buf, res);
+        if((size_t)res < sizeof(buf))
+            return 0;
     }
 }
 
+int HX20SerialConnection::loop() {
+    HX20Reactor reactor;
+    int res = 0;
+    reactor.addConnection(this, [&res]() { res = -1; });
+    reactor.run();
+    return res;
+}
+
 int HX20SerialConnection::getNfds() const {
-    return 1;
+    return (bridge && !threaded) ? 2 : 1;
 }
 
 void HX20SerialConnection::fillPollFd(struct pollfd *pfd) const {
-    pfd->fd = fd;
-    pfd->events = POLLIN;
+    pfd[0].fd = threaded ? dispatchFd : fd;
+    pfd[0].events = POLLIN;
+    if(bridge && !threaded) {
+        pfd[1].fd = bridgeFd;
+        pfd[1].events = POLLIN;
+    }
 }
 
 int HX20SerialConnection::handleEvents(struct pollfd const *pfd, int nfds) {
-    if(nfds < 1)
-        return 0;
-    if(pfd->revents & POLLIN) {
-        return poll();
+    for(int i = 0; i < nfds; i++) {
+        if(!(pfd[i].revents & POLLIN))
+            continue;
+        int res;
+        if(threaded)
+            res = dispatchEvents();
+        else if(bridge && pfd[i].fd == bridgeFd)
+            res = pollBridge();
+        else
+            res = poll();
+        if(res < 0)
+            return res;
     }
     return 0;
 }
 
+void HX20SerialConnection::wakeFd(int efd) {
+    uint64_t one = 1;
+    while(write(efd, &one, sizeof(one)) < 0 && errno == EINTR) {}
+}
+
+bool HX20SerialConnection::postEvent(Event &&ev, bool mayDrop) {
+    while(!events.push(std::move(ev))) {
+        //monitor events are not worth stalling the protocol for
+        if(mayDrop || ioStop.load())
+            return false;
+        std::this_thread::yield();
+    }
+    if(!dispatchPending.exchange(true))
+        wakeFd(dispatchFd);
+    return true;
+}
+
+/* Copies the parts to monRing and posts the event referring to them.
+ * Dropped if either the ring or the event queue is full.
+ */
+bool HX20SerialConnection::postMonitorEvent(Event &&ev,
+                                            uint8_t const *const *parts,
+                                            uint32_t const *sizes,
+                                            int nparts) {
+    uint32_t total = 0;
+    for(int i = 0; i < nparts; i++)
+        total += sizes[i];
+    if(monRing.size() - (monTail - monHead.load(std::memory_order_acquire)) < total)
+        return false;
+    for(int i = 0; i < 3; i++) {
+        ev.monSize[i] = i < nparts ? sizes[i] : 0;
+        if(i >= nparts)
+            continue;
+        uint32_t pos = monTail % monRing.size();
+        uint32_t first = std::min<uint32_t>(sizes[i], monRing.size() - pos);
+        memcpy(&monRing[pos], parts[i], first);
+        memcpy(&monRing[0], parts[i] + first, sizes[i] - first);
+        monTail += sizes[i];
+    }
+    if(!postEvent(std::move(ev), true)) {
+        monTail -= total;
+        return false;
+    }
+    return true;
+}
+
+//returns the next size bytes of monRing at head as one block
+uint8_t const *HX20SerialConnection::monitorData(uint32_t &head, uint32_t size) {
+    uint32_t pos = head % monRing.size();
+    head += size;
+    if(pos + size <= monRing.size())
+        return &monRing[pos];
+    uint32_t first = monRing.size() - pos;
+    memcpy(monStaging.data(), &monRing[pos], first);
+    memcpy(monStaging.data() + first, &monRing[0], size - first);
+    return monStaging.data();
+}
+
+int HX20SerialConnection::dispatchEvents() {
+    uint64_t v;
+    while(read(dispatchFd, &v, sizeof(v)) < 0 && errno == EINTR) {}
+    //cleared before draining, so anything posted from now on wakes us again
+    dispatchPending.store(false);
+    Event ev;
+    while(events.pop(ev)) {
+        switch(ev.type) {
+        case Event::Packet:
+            if(HX20SerialDevice *dev = findDevice(ev.did)) {
+                int res = deliverPacket(
+                          dev, ev.did, ev.sid, ev.fnc, ev.data.size(), ev.data.data());
+                if(res < 0)
+                    return res;
+            }
+            break;
+        case Event::SendComplete:
+            if(HX20SerialDevice *dev = findDevice(ev.did))
+                deliverSendComplete(dev, ev.did, ev.sid, ev.fnc, ev.state);
+            break;
+        case Event::MonitorInput: {
+            uint32_t head = monHead.load(std::memory_order_relaxed);
+            uint8_t const *bytes = monitorData(head, ev.monSize[0]);
+            for(auto &m : monitors)
+                m->monitorInput(static_cast<HX20SerialMonitor::InputPacketState>(ev.state),
+                                bytes, ev.monSize[0], ev.time);
+            monHead.store(head, std::memory_order_release);
+            break;
+        }
+        case Event::MonitorOutput: {
+            uint32_t head = monHead.load(std::memory_order_relaxed);
+            uint8_t const *bytes = monitorData(head, ev.monSize[0]);
+            for(auto &m : monitors)
+                m->monitorOutput(static_cast<HX20SerialMonitor::OutputPacketState>(ev.state),
+                                 bytes, ev.monSize[0], ev.time);
+            monHead.store(head, std::memory_order_release);
+            break;
+        }
+        case Event::MonitorFrame: {
+            uint32_t head = monHead.load(std::memory_order_relaxed);
+            HX20SerialMonitor::Frame frame;
+            frame.dir = static_cast<HX20SerialMonitor::Frame::Direction>(ev.state);
+            frame.did = ev.did;
+            frame.sid = ev.sid;
+            frame.fnc = ev.fnc;
+            //only one of the parts can wrap around, so monStaging suffices
+            frame.header = monitorData(head, ev.monSize[0]);
+            frame.headerSize = ev.monSize[0];
+            frame.text = monitorData(head, ev.monSize[1]);
+            frame.textSize = ev.monSize[1];
+            frame.handshake = monitorData(head, ev.monSize[2]);
+            frame.handshakeSize = ev.monSize[2];
+            frame.begin = ev.time;
+            frame.end = ev.time2;
+            for(auto &m : monitors)
+                m->monitorFrame(frame);
+            monHead.store(head, std::memory_order_release);
+            break;
+        }
+        case Event::IOError:
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void HX20SerialConnection::ioLoop() {
+    struct pollfd pfds[3];
+    pfds[0].fd = fd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = ioWakeFd;
+    pfds[1].events = POLLIN;
+    pfds[2].fd = bridgeFd;
+    pfds[2].events = POLLIN;
+    pfds[2].revents = 0;
+    int nfds = bridge ? 3 : 2;
+    int res = 0;
+    while(!ioStop.load() && res >= 0) {
+        if(::poll(pfds, nfds, txTimeout()) < 0) {
+            if(errno == EINTR)
+                continue;
+            res = -1;
+            break;
+        }
+        if(pfds[1].revents & POLLIN) {
+            uint64_t v;
+            while(read(ioWakeFd, &v, sizeof(v)) < 0 && errno == EINTR) {}
+            ioWakePending.store(false);
+            TxRequest req;
+            while(res >= 0 && txRequests.pop(req)) {
+                if(req.prepared)
+                    res = queuePacket(req.prepared);
+                else
+                    res = queuePacket(req.sid, req.did, req.fnc,
+                                      req.data.size(), req.data.data());
+            }
+        }
+        if(res < 0)
+            break;
+        //the response from a bridged device has to go out before
+        //anything else
+        if(pfds[2].revents & (POLLIN | POLLERR | POLLHUP))
+            res = pollBridge();
+        if(res < 0)
+            break;
+        if(pfds[0].revents & (POLLIN | POLLERR | POLLHUP))
+            res = poll();
+        else
+            res = checkTxTimeout();
+    }
+    if(res < 0) {
+        Event ev;
+        ev.type = Event::IOError;
+        postEvent(std::move(ev), false);
+    }
+}
+
+void HX20SerialConnection::startThread() {
+    if(threaded)
+        return;
+    ioWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(ioWakeFd == -1)
+        throw IOError(errno, std::system_category(), "Creating eventfd failed");
+    dispatchFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(dispatchFd == -1) {
+        int err = errno;
+        close(ioWakeFd);
+        throw IOError(err, std::system_category(), "Creating eventfd failed");
+    }
+    monRing.resize(1 << 17);
+    monStaging.resize(monRing.size());
+    ioStop.store(false);
+    threaded = true;
+    ioThread = std::thread(&HX20SerialConnection::ioLoop, this);
+}
+
+void HX20SerialConnection::stopThread() {
+    if(!threaded)
+        return;
+    ioStop.store(true);
+    wakeFd(ioWakeFd);
+    ioThread.join();
+    //nobody is going to answer packets the io thread left behind. What
+    //the devices sent is accounted for, whatever is still in txQueue is
+    //sent without the thread.
+    Event ev;
+    while(events.pop(ev)) {
+        if(ev.type == Event::SendComplete)
+            dropResponse(findDevice(ev.did));
+    }
+    TxRequest req;
+    while(txRequests.pop(req))
+        dropResponse(findDevice(req.prepared ? req.prepared->did : req.did));
+    monTail = 0;
+    monHead.store(0);
+    threaded = false;
+    close(ioWakeFd);
+    close(dispatchFd);
+    ioWakeFd = -1;
+    dispatchFd = -1;
+}
+
+//devices are only (un)registered from the thread owning the connection,
+//the io thread just looks them up.
 void HX20SerialConnection::registerDevice(HX20SerialDevice *dev) {
-    EPSP_DEBUG("Registering 0x%02x for %s\n",
-               dev->getDeviceID(), typeid(dev).name());
-    fflush(stdout);
-    if(devices.find(dev->getDeviceID()) != devices.end())
+    uint16_t id = dev->getDeviceID();
+    HX20_TRACE(Proto, Debug, "registering 0x%02x for %s\n",
+               id, typeid(*dev).name());
+    std::atomic<HX20SerialDevice *> *slot;
+    if(id < devices.size()) {
+        slot = &devices[id];
+    } else {
+        std::atomic<HX20SerialDevice *> *wide = wideDevices.load();
+        if(!wide) {
+            wide = new std::atomic<HX20SerialDevice *>[65536];
+            for(unsigned int i = 0; i < 65536; i++)
+                wide[i].store(nullptr);
+            wideDevices.store(wide, std::memory_order_release);
+        }
+        slot = &wide[id];
+    }
+    if(slot->load())
         throw std::runtime_error("There already is a device with the same ID");
-    devices[dev->getDeviceID()] = dev;
+    slot->store(dev, std::memory_order_release);
 }
 
 void HX20SerialConnection::unregisterDevice(HX20SerialDevice *dev) {
-    devices.erase(dev->getDeviceID());
+    //its responses are not reported to it anymore
+    dev->pendingResponses = 0;
+    if(!dev->delivering)
+        dev->runDeferred();
+    uint16_t id = dev->getDeviceID();
+    if(id < devices.size()) {
+        devices[id].store(nullptr, std::memory_order_release);
+    } else if(std::atomic<HX20SerialDevice *> *wide = wideDevices.load()) {
+        wide[id].store(nullptr, std::memory_order_release);
+    }
 }
 
 void HX20SerialConnection::registerMonitor(HX20SerialMonitor *mon) {
     monitors.insert(mon);
+    monitorCount.store(monitors.size());
 }
 
 void HX20SerialConnection::unregisterMonitor(HX20SerialMonitor *mon) {
     monitors.erase(mon);
+    monitorCount.store(monitors.size());
 }
-
-
@@ -2,25 +2,92 @@
 #pragma once
 
 #include <stdint.h>
-#include <unordered_map>
+#include <array>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
 #include <unordered_set>
-#include <system_error>
+#include <memory>
 #include <vector>
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#include "spsc-queue.hpp"
+#include "hx20-transport.hpp"
+#include "hx20-link-stats.hpp"
+#include "hx20-capture.hpp"
 
 struct pollfd;
 class HX20SerialConnection;
 
-class IOError : public std::system_error {
+/* Estimates the ACK turnaround of the hx-20 the way TCP does (RFC 6298)
+ * and derives the retransmit timeout from it. Times are microseconds.
+ */
+class HX20RttEstimator {
+private:
+    int64_t srtt;
+    int64_t rttvar;
+    int64_t rto;
+    bool haveSample;
+public:
+    HX20RttEstimator();
+    void sample(int64_t rtt);
+    //after a timeout, until the next sample
+    void backoff();
+    int64_t timeout() const { return rto; }
+    int64_t smoothed() const { return srtt; }
+};
+
+/* A response with its header and text frames already assembled and
+ * checksummed, for replies that go out over and over again. Immutable,
+ * so it can be shared between connections and their io threads.
+ */
+struct HX20PreparedPacket {
+    uint16_t sid;
+    uint16_t did;
+    uint8_t fnc;
+    std::vector<uint8_t> header;
+    std::vector<uint8_t> text;
+    //same arguments as HX20SerialConnection::sendPacket
+    static std::shared_ptr<HX20PreparedPacket const>
+    prepare(uint16_t sid, uint16_t did, uint8_t fnc,
+            uint16_t size, uint8_t const *buf);
+};
+
+/* Prepared packets of a device keyed by everything in them. Short
+ * replies only; when it fills up, it starts over.
+ */
+class HX20PreparedPacketCache {
+public:
+    static constexpr uint16_t MAX_TEXT = 8;
+    static constexpr size_t MAX_ENTRIES = 64;
+private:
+    struct Key {
+        uint16_t sid;
+        uint16_t did;
+        uint8_t fnc;
+        uint8_t size;
+        std::array<uint8_t, MAX_TEXT> text;
+        bool operator<(Key const &o) const;
+    };
+    std::map<Key, std::shared_ptr<HX20PreparedPacket const> > entries;
 public:
-    IOError(std::error_code ec) : system_error(ec) {}
-    IOError(std::error_code ec, const std::string &what_arg) : system_error(ec, what_arg) {}
-    IOError(std::error_code ec, const char *what_arg) : system_error(ec, what_arg) {}
-    IOError(int ev, const std::error_category &ecat) : system_error(ev, ecat) {}
-    IOError(int ev, const std::error_category &ecat, const std::string &what_arg) : system_error(ev, ecat, what_arg) {}
-    IOError(int ev, const std::error_category &ecat, const char *what_arg) : system_error(ev, ecat, what_arg) {}
+    //longer texts are prepared every time, without caching them
+    std::shared_ptr<HX20PreparedPacket const>
+    get(uint16_t sid, uint16_t did, uint8_t fnc,
+        uint16_t size, uint8_t const *buf);
 };
 
 class HX20SerialDevice {
+private:
+    //responses sent with sendPacket the hx-20 has not taken yet
+    unsigned pendingResponses = 0;
+    //in gotPacket or sendComplete, the deferred work runs after them
+    bool delivering = false;
+    std::vector<std::function<void()> > deferred;
+    void runDeferred();
 protected:
     virtual int getDeviceID() const = 0;
     virtual ~HX20SerialDevice() = 0;
@@ -29,6 +96,18 @@ protected:
     int gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
                   uint16_t size, uint8_t *buf,
                   HX20SerialConnection *conn) = 0;
+    //called once a packet queued with sendPacket has been taken by the
+    //hx-20 (result 0) or given up on (result 1).
+    virtual void sendComplete(uint16_t sid, uint16_t did, uint8_t fnc,
+                              int result) {}
+    /* For work in gotPacket the hx-20 does not wait for, like updating
+     * the ui: fn runs once the responses sent so far have been taken and
+     * the hx-20 has moved on, or right after gotPacket if there are
+     * none. Called outside of gotPacket and sendComplete with nothing
+     * outstanding, fn runs right away. Keeps rendering out of the round
+     * trip.
+     */
+    void deferUntilResponded(std::function<void()> fn);
 
     friend class HX20SerialConnection;
 };
@@ -51,15 +130,49 @@ public:
         SentPacketHeaderResponse,
         SentPacketTextResponse,
         SentSelectResponse,
-        SentReverseDirection
+        SentReverseDirection,
+        //asking the hx-20 whether it is done after it sent WAK
+        SentEnquiry,
+        //passed through from the bridge port, see setBridge
+        SentRelayed
+    };
+    typedef std::chrono::steady_clock::time_point Timestamp;
+    /* One complete packet transfer, delivered once the transfer is over.
+     * handshake holds the single byte handshakes (ACK, NAK, ENQ, EOT, ...)
+     * of both sides in the order they went over the line. header and text
+     * are the last versions sent, in case of retries.
+     */
+    struct Frame {
+        enum Direction {
+            MasterToSlave,
+            SlaveToMaster
+        };
+        Direction dir;
+        //as found in the header
+        uint16_t did;
+        uint16_t sid;
+        uint8_t fnc;
+        uint8_t const *header;
+        size_t headerSize;
+        uint8_t const *text;
+        size_t textSize;
+        uint8_t const *handshake;
+        size_t handshakeSize;
+        Timestamp begin;
+        Timestamp end;
     };
 protected:
     virtual ~HX20SerialMonitor();
 
+    //the bytes point into the buffers of the connection and are only
+    //valid for the duration of the call.
     virtual void monitorInput(InputPacketState state,
-                              std::vector<uint8_t> const &bytes) {}
+                              uint8_t const *bytes, size_t size,
+                              Timestamp time) {}
     virtual void monitorOutput(OutputPacketState state,
-                               std::vector<uint8_t> const &bytes) {}
+                               uint8_t const *bytes, size_t size,
+                               Timestamp time) {}
+    virtual void monitorFrame(Frame const &frame) {}
 
     friend class HX20SerialConnection;
 };
@@ -74,16 +187,43 @@ private:
         Text,
         EndOfText
     };
-    int fd;
+    std::unique_ptr<HX20Transport> transport;
+    int fd;//transport->getFd(), for polling
 
-    std::unordered_map<int, HX20SerialDevice *> devices;
+    //indexed by device id. ids above 255 are rare, so the table covering
+    //all 16 bit ids is only allocated when one gets registered.
+    std::array<std::atomic<HX20SerialDevice *>, 256> devices;
+    std::atomic<std::atomic<HX20SerialDevice *> *> wideDevices;
     std::unordered_multiset<HX20SerialMonitor *> monitors;
 
     enum State state;
 
-    std::vector<uint8_t> buf;
-    void addByteToBuf(uint8_t b);
-    uint8_t checkSumBuf();
+    //input is drained from the fd in bursts into this ring. inRead and
+    //inWrite are free running, the ring size must be a power of two.
+    std::array<uint8_t, 4096> inRing;
+    uint32_t inRead;
+    uint32_t inWrite;
+    //when the last fillInput returned, only kept while bridging
+    std::chrono::steady_clock::time_point inTime;
+    int fillInput();
+
+    //bridge mode: a select for an id nobody registered hands the bus to
+    //the device on this transport until a registered device is selected.
+    //Meanwhile our receiver keeps parsing, but does not answer.
+    std::unique_ptr<HX20Transport> bridge;
+    int bridgeFd;
+    bool bridging;
+    int relayToBridge(uint8_t const *bytes, size_t size);
+    int relayRing(uint32_t from, uint32_t to);
+    int pollBridge();
+
+    //the frame being received, large enough for a text frame with 16 bit
+    //siz: STX, 65536 bytes of data, ETX, cks. rxSum is the checksum over
+    //rxBuf[0..rxLen).
+    std::array<uint8_t, 1+65536+1+1> rxBuf;
+    uint32_t rxLen;
+    uint32_t rxExpect;
+    uint8_t rxSum;
 
     uint16_t selectedSlaveID, selectedMasterID;
 
@@ -92,26 +232,241 @@ private:
     uint8_t fnc;
     uint16_t siz;//size-1
 
+    enum TxState {
+        TxIdle,
+        TxSentHeader,
+        TxSentText
+    };
+    struct TxPacket {
+        uint16_t sid;
+        uint16_t did;
+        uint8_t fnc;
+        //the frames are assembled into these, unless prepared is set
+        std::vector<uint8_t> headerBuf;
+        std::vector<uint8_t> textBuf;
+        std::shared_ptr<HX20PreparedPacket const> prepared;
+        std::vector<uint8_t> const &header() const {
+            return prepared ? prepared->header : headerBuf;
+        }
+        std::vector<uint8_t> const &text() const {
+            return prepared ? prepared->text : textBuf;
+        }
+    };
+    //packets waiting to be sent, the front one is being sent
+    std::deque<TxPacket> txQueue;
+    //finished packets, kept for their frame buffers
+    std::vector<TxPacket> txSpare;
+    enum TxState txState;
+    int txRetries;
+    std::chrono::steady_clock::time_point txDeadline;
+    //when the current header or text frame went out
+    std::chrono::steady_clock::time_point txSentTime;
+    //the frame went out once and the hx-20 did not WAK it, so its ACK
+    //is a valid round trip sample (Karn's algorithm)
+    bool txSampleValid;
+    //the hx-20 answered WAK; we poll it with ENQ until it ACKs
+    bool txWak;
+    bool txEnqSent;
+    //the hx-20 ACKs a header right away but a text only once it has
+    //taken the block, so the two are timed apart
+    HX20RttEstimator headerRtt;
+    HX20RttEstimator textRtt;
+
+    HX20LinkStats stats;
+
+    //collects the parts of a packet transfer for
+    //HX20SerialMonitor::monitorFrame while there are monitors
+    struct FrameTrace {
+        bool open;
+        std::array<uint8_t, 10> header;//HEADER_FRAME_MAX
+        size_t headerSize;
+        std::array<uint8_t, 32> handshake;
+        size_t handshakeSize;
+        HX20SerialMonitor::Timestamp begin;
+    };
+    FrameTrace rxFrame;
+    FrameTrace txFrame;
+
+    void armTxTimer(std::chrono::microseconds timeout);
+    HX20RttEstimator &txRtt();
+    void armAckTimer();
+    int txTimerExpired();
+    int sendTxHeader();
+    int sendTxText();
+    int startTransmit();
+    int finishTransmit(int result);
+    int retryTransmit();
+    __attribute__((warn_unused_result))
+    int transmitByte(uint8_t b);
+    __attribute__((warn_unused_result))
+    int queuePacket(uint16_t sid, uint16_t did, uint8_t fnc,
+                    uint16_t size, uint8_t const *buf);
+    __attribute__((warn_unused_result))
+    int queuePacket(std::shared_ptr<HX20PreparedPacket const> const &packet);
+    TxPacket takeSpareTxPacket();
+    __attribute__((warn_unused_result))
+    int enqueueTxPacket(TxPacket &&pkt);
+    int txTimeout() const;
+    int checkTxTimeout();
+
+    /* In threaded mode (see startThread), the fd is serviced by ioThread,
+     * which does all framing and handshaking. Received packets, send
+     * completions and monitor events are handed to the thread owning the
+     * connection through events, and packets sent by the devices travel
+     * back through txRequests.
+     */
+    struct Event {
+        enum Type {
+            Packet,
+            SendComplete,
+            MonitorInput,
+            MonitorOutput,
+            MonitorFrame,
+            IOError
+        };
+        Type type;
+        uint16_t did;
+        uint16_t sid;
+        uint8_t fnc;
+        int state;//monitor state or send result
+        std::vector<uint8_t> data;
+        //monitor bytes are passed through monRing instead of data. frames
+        //store header, text and handshake back to back.
+        uint32_t monSize[3];
+        HX20SerialMonitor::Timestamp time;
+        HX20SerialMonitor::Timestamp time2;
+    };
+    struct TxRequest {
+        uint16_t sid;
+        uint16_t did;
+        uint8_t fnc;
+        std::vector<uint8_t> data;
+        //instead of the above
+        std::shared_ptr<HX20PreparedPacket const> prepared;
+    };
+    bool threaded;
+    std::thread ioThread;
+    std::atomic<bool> ioStop;
+    int ioWakeFd;
+    int dispatchFd;
+    std::atomic<bool> ioWakePending;
+    std::atomic<bool> dispatchPending;
+    std::atomic<int> monitorCount;
+    SPSCQueue<Event, 256> events;
+    SPSCQueue<TxRequest, 256> txRequests;
+    //written by the io thread only, monTail is private to it. Allocated
+    //by startThread, connections without a thread do not need it.
+    std::vector<uint8_t> monRing;
+    uint32_t monTail;
+    std::atomic<uint32_t> monHead;
+    //for monitor data wrapping around the end of monRing
+    std::vector<uint8_t> monStaging;
+
+    //raw capture of everything going over the transport, written from
+    //whichever thread does the io.
+    std::mutex captureLock;
+    std::unique_ptr<HX20CaptureWriter> capture;
+    std::atomic<bool> capturing;
+    void captureBytes(HX20CaptureDirection dir, uint8_t const *bytes,
+                      size_t size, std::chrono::steady_clock::time_point time);
+    int writeBytes(uint8_t const *buf, size_t size);
+
+    static void wakeFd(int efd);
+    bool postEvent(Event &&ev, bool mayDrop);
+    bool postMonitorEvent(Event &&ev, uint8_t const *const *parts,
+                          uint32_t const *sizes, int nparts);
+    uint8_t const *monitorData(uint32_t &head, uint32_t size);
+    int dispatchEvents();
+    void ioLoop();
+
+    bool monitoring() const {
+        return monitorCount.load(std::memory_order_relaxed) != 0;
+    }
+    void notifyInput(HX20SerialMonitor::InputPacketState state,
+                     uint8_t const *bytes, size_t size);
+    void notifyInput(HX20SerialMonitor::InputPacketState state, uint8_t b) {
+        if(monitoring())
+            notifyInput(state, &b, 1);
+    }
+    void notifyOutput(HX20SerialMonitor::OutputPacketState state,
+                      uint8_t const *bytes, size_t size);
+    void notifyOutput(HX20SerialMonitor::OutputPacketState state, uint8_t b) {
+        if(monitoring())
+            notifyOutput(state, &b, 1);
+    }
+    void traceFrame(FrameTrace &trace, uint8_t const *bytes, size_t size,
+                    bool header, HX20SerialMonitor::Timestamp time);
+    void notifyFrame(FrameTrace &trace, HX20SerialMonitor::Frame &frame);
+    HX20SerialDevice *findDevice(uint16_t id);
+    //on the thread owning the connection, also run the deferred work
+    __attribute__((warn_unused_result))
+    int deliverPacket(HX20SerialDevice *dev, uint16_t did, uint16_t sid,
+                      uint8_t fnc, uint16_t size, uint8_t *buf);
+    void deliverSendComplete(HX20SerialDevice *dev, uint16_t did, uint16_t sid,
+                             uint8_t fnc, int result);
+    void dropResponse(HX20SerialDevice *dev);
+
     __attribute__((warn_unused_result))
     int receiveByte(uint8_t b);
 public:
+    //device is a transport url, see HX20Transport::open
     HX20SerialConnection(char const *device);
+    HX20SerialConnection(std::unique_ptr<HX20Transport> transport);
     ~HX20SerialConnection();
     __attribute__((warn_unused_result))
     int poll();
-    void loop();
+    //handles bytes as if they had been read from the transport
+    __attribute__((warn_unused_result))
+    int feedBytes(uint8_t const *bytes, size_t size);
+    /* Blocks serving the connection until io on it fails, returning -1
+     * then. Sleeps while there is nothing to do. For more connections
+     * or further fds in the same loop, use an HX20Reactor instead.
+     */
+    int loop();
     int getNfds() const;
     void fillPollFd(struct pollfd *pfd) const;
     __attribute__((warn_unused_result))
     int handleEvents(struct pollfd const *pfd, int nfds);
+    //milliseconds until handleTimeout needs to be called, -1 for never
+    int getTimeout() const;
+    //when handleTimeout needs to be called, false for never
+    bool getDeadline(std::chrono::steady_clock::time_point &deadline) const;
+    __attribute__((warn_unused_result))
+    int handleTimeout();
+    //acts as if the pending timeout had expired, for replaying captures
+    __attribute__((warn_unused_result))
+    int forceTimeout();
+
+    //moves all protocol handling to a separate thread. Devices and
+    //monitors are still called on the thread calling handleEvents.
+    void startThread();
+    void stopThread();
+
+    //snapshot() this for a consistent view
+    HX20LinkStats const &linkStats() const { return stats; }
+    void resetLinkStats() { stats.reset(); }
+
+    /* Relays packets for device ids without a registered device to the
+     * device on bridge, and its answers back. Call before startThread.
+     */
+    void setBridge(std::unique_ptr<HX20Transport> bridge);
+
+    //see hx20-capture.hpp for the file format
+    void startCapture(char const *path);
+    void stopCapture();
 
     void registerDevice(HX20SerialDevice *dev);
     void unregisterDevice(HX20SerialDevice *dev);
     void registerMonitor(HX20SerialMonitor *mon);
     void unregisterMonitor(HX20SerialMonitor *mon);
 
+    //queues the packet and returns, the device is told about the outcome
+    //through HX20SerialDevice::sendComplete
     __attribute__((warn_unused_result))
     int sendPacket(uint16_t sid, uint16_t did, uint8_t fnc,
                    uint16_t size, uint8_t *buf);
+    //same, without assembling or copying the frames again
+    __attribute__((warn_unused_result))
+    int sendPacket(std::shared_ptr<HX20PreparedPacket const> const &packet);
 };
 
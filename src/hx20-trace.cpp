@@ -0,0 +1,421 @@
+#include <stdlib.h>
+#include <strings.h>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "hx20-trace.hpp"
+
+static char const *const categoryNames[(int)HX20TraceCategory::Count] = {
+    "proto", "crt", "disk", "drive"
+};
+
+static char const *const levelNames[] = {
+    "error", "warning", "info", "debug", "verbose"
+};
+
+std::atomic<uint8_t> HX20Trace::levels[(int)HX20TraceCategory::Count] = {
+    { (uint8_t)HX20TraceLevel::Info },
+    { (uint8_t)HX20TraceLevel::Info },
+    { (uint8_t)HX20TraceLevel::Info },
+    { (uint8_t)HX20TraceLevel::Info }
+};
+
+namespace {
+
+struct RecordHeader {
+    uint16_t size;//including this header
+    uint8_t category;
+    uint8_t level;
+    uint8_t nargs;
+    uint16_t blobSize;
+    uint64_t time;//ns since Tracer::epoch
+    char const *fmt;
+};
+
+#define TRACE_STRING_MAX 200
+#define TRACE_BLOB_MAX 1024
+
+/* One per thread that traces, written by that thread and drained by the
+ * trace thread. Rings are never freed, a thread exiting returns its ring
+ * for reuse.
+ */
+struct Ring {
+    std::array<uint8_t, 1 << 18> buf;
+    //written by the consumer
+    alignas(64) std::atomic<uint32_t> head;
+    //written by the producer
+    alignas(64) std::atomic<uint32_t> tail;
+    std::atomic<uint32_t> dropped;
+    std::atomic<bool> inUse;
+    Ring() : head(0), tail(0), dropped(0), inUse(true) {}
+
+    void put(uint32_t pos, void const *src, size_t size) {
+        uint32_t p = pos % buf.size();
+        size_t first = std::min<size_t>(size, buf.size() - p);
+        memcpy(&buf[p], src, first);
+        memcpy(&buf[0], (uint8_t const *)src + first, size - first);
+    }
+    void get(uint32_t pos, void *dst, size_t size) const {
+        uint32_t p = pos % buf.size();
+        size_t first = std::min<size_t>(size, buf.size() - p);
+        memcpy(dst, &buf[p], first);
+        memcpy((uint8_t *)dst + first, &buf[0], size - first);
+    }
+};
+
+class Tracer {
+public:
+    std::chrono::steady_clock::time_point epoch;
+    std::mutex ringsLock;
+    std::vector<std::unique_ptr<Ring>> rings;
+    //serializes the consumers: the trace thread and flush
+    std::mutex drainLock;
+    std::mutex stopLock;
+    std::condition_variable stopCond;
+    bool stop;
+    std::thread thread;
+    std::atomic<FILE *> out;
+    std::string text;
+
+    Tracer() : epoch(std::chrono::steady_clock::now()), stop(false), out(stdout) {
+        if(char const *spec = getenv("HX20_TRACE"))
+            HX20Trace::configure(spec);
+    }
+    ~Tracer() {
+        if(thread.joinable()) {
+            {
+                std::lock_guard<std::mutex> l(stopLock);
+                stop = true;
+            }
+            stopCond.notify_all();
+            thread.join();
+        }
+        drain();
+    }
+
+    Ring *acquire() {
+        std::lock_guard<std::mutex> l(ringsLock);
+        if(!thread.joinable())
+            thread = std::thread(&Tracer::run, this);
+        for(auto &r : rings) {
+            bool expected = false;
+            if(r->inUse.compare_exchange_strong(expected, true))
+                return r.get();
+        }
+        rings.emplace_back(new Ring());
+        return rings.back().get();
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> l(stopLock);
+        while(!stop) {
+            stopCond.wait_for(l, std::chrono::milliseconds(20));
+            l.unlock();
+            drain();
+            l.lock();
+        }
+    }
+
+    void drain();
+    void format(RecordHeader const &h, uint8_t const *args, uint8_t const *blob);
+};
+
+Tracer tracer;
+
+struct RingHolder {
+    Ring *ring = nullptr;
+    ~RingHolder() {
+        if(ring)
+            ring->inUse.store(false, std::memory_order_release);
+    }
+};
+
+thread_local RingHolder threadRing;
+
+struct Arg {
+    char tag;
+    uint8_t size;
+    uint64_t v;
+    std::string s;
+};
+
+/* Formats one conversion of fmt at a time with snprintf, with the length
+ * modifiers replaced to match how the argument was stored.
+ */
+void formatArgs(std::string &out, char const *fmt, std::vector<Arg> const &args) {
+    size_t next = 0;
+    char buf[256];
+    auto take = [&]() -> Arg const * {
+        return next < args.size() ? &args[next++] : nullptr;
+    };
+    for(char const *p = fmt; *p; p++) {
+        if(*p != '%') {
+            out += *p;
+            continue;
+        }
+        if(p[1] == '%') {
+            out += '%';
+            p++;
+            continue;
+        }
+        std::string spec = "%";
+        p++;
+        while(*p && strchr("-+ #0123456789.*", *p)) {
+            if(*p == '*') {
+                Arg const *a = take();
+                spec += std::to_string(a ? (int)a->v : 0);
+            } else {
+                spec += *p;
+            }
+            p++;
+        }
+        while(*p && strchr("hlLqjzt", *p))
+            p++;
+        if(!*p)
+            break;
+        char conv = *p;
+        Arg const *a = take();
+        if(!a) {
+            out += "<?>";
+            continue;
+        }
+        switch(conv) {
+        case 'd':
+        case 'i':
+            spec += "ll";
+            spec += conv;
+            snprintf(buf, sizeof(buf), spec.c_str(), (long long)a->v);
+            break;
+        case 'o':
+        case 'u':
+        case 'x':
+        case 'X': {
+            uint64_t v = a->v;
+            //a negative int printed as unsigned keeps its own width
+            if(a->size < 8)
+                v &= ((uint64_t)1 << (a->size * 8)) - 1;
+            spec += "ll";
+            spec += conv;
+            snprintf(buf, sizeof(buf), spec.c_str(), (unsigned long long)v);
+            break;
+        }
+        case 'c':
+            spec += conv;
+            snprintf(buf, sizeof(buf), spec.c_str(), (int)a->v);
+            break;
+        case 's':
+            spec += conv;
+            snprintf(buf, sizeof(buf), spec.c_str(),
+                     a->tag == 's' ? a->s.c_str() : "(null)");
+            break;
+        case 'p':
+            spec += conv;
+            snprintf(buf, sizeof(buf), spec.c_str(), (void *)(uintptr_t)a->v);
+            break;
+        default: {
+            double d;
+            memcpy(&d, &a->v, 8);
+            spec += conv;
+            snprintf(buf, sizeof(buf), spec.c_str(), d);
+            break;
+        }
+        }
+        out += buf;
+    }
+}
+
+void hexdump(std::string &out, uint8_t const *bytes, size_t size) {
+    char buf[16];
+    for(size_t addr = 0; addr < size; addr += 16) {
+        snprintf(buf, sizeof(buf), "%04zx:", addr);
+        out += buf;
+        for(size_t i = addr; i < addr + 16; i++) {
+            if(i % 8 == 0)
+                out += ' ';
+            if(i < size) {
+                snprintf(buf, sizeof(buf), " %02x", bytes[i]);
+                out += buf;
+            } else {
+                out += "   ";
+            }
+        }
+        out += "  ";
+        for(size_t i = addr; i < addr + 16 && i < size; i++)
+            out += (bytes[i] >= 0x20 && bytes[i] < 0x7f) ? (char)bytes[i] : '.';
+        out += '\n';
+    }
+}
+
+void Tracer::format(RecordHeader const &h, uint8_t const *args, uint8_t const *blob) {
+    char prefix[64];
+    snprintf(prefix, sizeof(prefix), "%10.6f %-5s ", h.time / 1e9,
+             categoryNames[h.category]);
+    text += prefix;
+
+    std::vector<Arg> decoded;
+    uint8_t const *p = args;
+    for(int i = 0; i < h.nargs; i++) {
+        Arg a;
+        a.tag = *p++;
+        a.size = *p++;
+        memcpy(&a.v, p, 8);
+        p += 8;
+        if(a.tag == 's') {
+            a.s.assign((char const *)p, a.v);
+            p += a.v;
+        }
+        decoded.push_back(std::move(a));
+    }
+    formatArgs(text, h.fmt, decoded);
+    if(text.empty() || text.back() != '\n')
+        text += '\n';
+    if(h.blobSize)
+        hexdump(text, blob, h.blobSize);
+}
+
+void Tracer::drain() {
+    std::lock_guard<std::mutex> dl(drainLock);
+    std::vector<Ring *> current;
+    {
+        std::lock_guard<std::mutex> l(ringsLock);
+        for(auto &r : rings)
+            current.push_back(r.get());
+    }
+    std::vector<uint8_t> rec;
+    for(Ring *r : current) {
+        uint32_t head = r->head.load(std::memory_order_relaxed);
+        uint32_t tail = r->tail.load(std::memory_order_acquire);
+        while(head != tail) {
+            RecordHeader h;
+            r->get(head, &h, sizeof(h));
+            rec.resize(h.size - sizeof(h));
+            r->get(head + sizeof(h), rec.data(), rec.size());
+            size_t argSize = rec.size() - h.blobSize;
+            format(h, rec.data(), rec.data() + argSize);
+            head += h.size;
+        }
+        r->head.store(head, std::memory_order_release);
+        if(uint32_t dropped = r->dropped.exchange(0)) {
+            text += "trace: ";
+            text += std::to_string(dropped);
+            text += " records dropped\n";
+        }
+    }
+    if(!text.empty()) {
+        FILE *f = out.load();
+        fwrite(text.data(), 1, text.size(), f);
+        fflush(f);
+        text.clear();
+    }
+}
+
+}
+
+void HX20Trace::arg(Writer &w, char const *s) {
+    if(!s) {
+        putArg(w, 'p', sizeof(s), 0);
+        return;
+    }
+    size_t len = std::min<size_t>(strlen(s), TRACE_STRING_MAX);
+    if((size_t)(w.end - w.p) < 10 + len)
+        return;
+    putArg(w, 's', 0, len);
+    memcpy(w.p, s, len);
+    w.p += len;
+}
+
+void HX20Trace::commit(HX20TraceCategory cat, HX20TraceLevel level,
+                       char const *fmt, uint8_t const *args, size_t size,
+                       uint8_t nargs, uint8_t const *blob, size_t blobSize) {
+    if(!threadRing.ring)
+        threadRing.ring = tracer.acquire();
+    Ring *r = threadRing.ring;
+
+    blobSize = std::min<size_t>(blobSize, TRACE_BLOB_MAX);
+    RecordHeader h;
+    h.size = sizeof(h) + size + blobSize;
+    h.category = (uint8_t)cat;
+    h.level = (uint8_t)level;
+    h.nargs = nargs;
+    h.blobSize = blobSize;
+    h.time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now() - tracer.epoch).count();
+    h.fmt = fmt;
+
+    uint32_t tail = r->tail.load(std::memory_order_relaxed);
+    if(r->buf.size() - (tail - r->head.load(std::memory_order_acquire)) < h.size) {
+        r->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    r->put(tail, &h, sizeof(h));
+    r->put(tail + sizeof(h), args, size);
+    r->put(tail + sizeof(h) + size, blob, blobSize);
+    r->tail.store(tail + h.size, std::memory_order_release);
+}
+
+void HX20Trace::setLevel(HX20TraceCategory cat, HX20TraceLevel level) {
+    levels[(int)cat].store((uint8_t)level, std::memory_order_relaxed);
+}
+
+static bool parseLevel(std::string const &name, HX20TraceLevel &level) {
+    for(unsigned int i = 0; i < sizeof(levelNames) / sizeof(levelNames[0]); i++) {
+        if(strcasecmp(name.c_str(), levelNames[i]) == 0) {
+            level = (HX20TraceLevel)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool HX20Trace::configure(char const *spec) {
+    bool ok = true;
+    std::string s(spec);
+    size_t pos = 0;
+    while(pos <= s.size()) {
+        size_t end = s.find(',', pos);
+        if(end == std::string::npos)
+            end = s.size();
+        std::string item = s.substr(pos, end - pos);
+        pos = end + 1;
+        if(item.empty())
+            continue;
+        size_t eq = item.find('=');
+        HX20TraceLevel level;
+        if(!parseLevel(eq == std::string::npos ? item : item.substr(eq + 1), level)) {
+            ok = false;
+            continue;
+        }
+        if(eq == std::string::npos) {
+            for(int c = 0; c < (int)HX20TraceCategory::Count; c++)
+                setLevel((HX20TraceCategory)c, level);
+            continue;
+        }
+        std::string cat = item.substr(0, eq);
+        int c;
+        for(c = 0; c < (int)HX20TraceCategory::Count; c++) {
+            if(strcasecmp(cat.c_str(), categoryNames[c]) == 0)
+                break;
+        }
+        if(c == (int)HX20TraceCategory::Count) {
+            ok = false;
+            continue;
+        }
+        setLevel((HX20TraceCategory)c, level);
+    }
+    return ok;
+}
+
+void HX20Trace::setOutput(FILE *f) {
+    tracer.out.store(f);
+}
+
+void HX20Trace::flush() {
+    tracer.drain();
+}
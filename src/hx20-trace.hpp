@@ -0,0 +1,141 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <type_traits>
+
+/* Tracing for the protocol and the devices.
+ *
+ *   HX20_TRACE(Disk, Info, "hx20 tries to close fcb at 0x%04x.\n", addr);
+ *
+ * Trace points above HX20_TRACE_LEVEL are compiled out. The others cost
+ * one relaxed load while their category is disabled at runtime. Enabled
+ * ones store the format string pointer and their arguments in binary form
+ * into a ring buffer of the calling thread; a background thread formats
+ * them and writes them out. Format strings must be literals. When a ring
+ * is full, records are dropped and counted instead of waiting.
+ */
+
+#ifndef HX20_TRACE_LEVEL
+#define HX20_TRACE_LEVEL 3 //Debug
+#endif
+
+enum class HX20TraceCategory : uint8_t {
+    Proto,
+    Crt,
+    Disk,
+    Drive,
+    Count
+};
+
+enum class HX20TraceLevel : uint8_t {
+    Error,
+    Warning,
+    Info,
+    Debug,
+    //per byte and similar, compiled out by default
+    Verbose
+};
+
+class HX20Trace {
+private:
+    static std::atomic<uint8_t> levels[(int)HX20TraceCategory::Count];
+public:
+    struct Writer {
+        uint8_t *p;
+        uint8_t *end;
+        uint8_t nargs;
+    };
+
+    static bool enabled(HX20TraceCategory cat, HX20TraceLevel level) {
+        return (uint8_t)level <= levels[(int)cat].load(std::memory_order_relaxed);
+    }
+    static void setLevel(HX20TraceCategory cat, HX20TraceLevel level);
+    /* Comma separated <category>=<level> or just <level> for all
+     * categories, e.g. "info,disk=debug". Categories are proto, crt, disk
+     * and drive, levels error, warning, info, debug and verbose.
+     * Returns false if spec could not be parsed completely.
+     */
+    static bool configure(char const *spec);
+    //where the formatted records go, stdout by default
+    static void setOutput(FILE *f);
+    //writes out everything recorded so far
+    static void flush();
+
+    static void commit(HX20TraceCategory cat, HX20TraceLevel level,
+                       char const *fmt, uint8_t const *args, size_t size,
+                       uint8_t nargs, uint8_t const *blob, size_t blobSize);
+
+    static void putArg(Writer &w, char tag, uint8_t size, uint64_t v) {
+        if(w.end - w.p < 10)
+            return;
+        *w.p++ = tag;
+        *w.p++ = size;
+        memcpy(w.p, &v, 8);
+        w.p += 8;
+        w.nargs++;
+    }
+    template<typename T>
+    static typename std::enable_if<std::is_integral<T>::value>::type
+    arg(Writer &w, T v) {
+        if(std::is_signed<T>::value)
+            putArg(w, 'i', sizeof(T), (uint64_t)(int64_t)v);
+        else
+            putArg(w, 'u', sizeof(T), (uint64_t)v);
+    }
+    template<typename T>
+    static typename std::enable_if<std::is_enum<T>::value>::type
+    arg(Writer &w, T v) {
+        putArg(w, 'i', sizeof(T), (uint64_t)(int64_t)v);
+    }
+    static void arg(Writer &w, double v) {
+        uint64_t bits;
+        memcpy(&bits, &v, 8);
+        putArg(w, 'f', 8, bits);
+    }
+    static void arg(Writer &w, void const *p) {
+        putArg(w, 'p', sizeof(p), (uint64_t)(uintptr_t)p);
+    }
+    static void arg(Writer &w, char const *s);
+
+    template<typename... Args>
+    static void record(HX20TraceCategory cat, HX20TraceLevel level,
+                       char const *fmt, Args... args) {
+        uint8_t buf[512];
+        Writer w = { buf, buf + sizeof(buf), 0 };
+        int expand[] = { 0, (arg(w, args), 0)... };
+        (void)expand;
+        commit(cat, level, fmt, buf, w.p - buf, w.nargs, nullptr, 0);
+    }
+    static void record(HX20TraceCategory cat, HX20TraceLevel level,
+                       char const *fmt) {
+        commit(cat, level, fmt, nullptr, 0, 0, nullptr, 0);
+    }
+    //what, followed by a hexdump of the bytes
+    static void recordHex(HX20TraceCategory cat, HX20TraceLevel level,
+                          char const *what, void const *bytes, size_t size) {
+        commit(cat, level, what, nullptr, 0, 0, (uint8_t const *)bytes, size);
+    }
+};
+
+//never called, lets the compiler check the arguments against the format
+static inline void hx20TraceFormatCheck(char const *fmt, ...)
+__attribute__((format(printf, 1, 2)));
+static inline void hx20TraceFormatCheck(char const *fmt, ...) {}
+
+#define HX20_TRACE(cat, lvl, ...) do { \
+    if((int)HX20TraceLevel::lvl <= HX20_TRACE_LEVEL && \
+            HX20Trace::enabled(HX20TraceCategory::cat, HX20TraceLevel::lvl)) \
+        HX20Trace::record(HX20TraceCategory::cat, HX20TraceLevel::lvl, __VA_ARGS__); \
+    if(false) \
+        hx20TraceFormatCheck(__VA_ARGS__); \
+} while(0)
+
+#define HX20_TRACE_HEX(cat, lvl, what, bytes, size) do { \
+    if((int)HX20TraceLevel::lvl <= HX20_TRACE_LEVEL && \
+            HX20Trace::enabled(HX20TraceCategory::cat, HX20TraceLevel::lvl)) \
+        HX20Trace::recordHex(HX20TraceCategory::cat, HX20TraceLevel::lvl, \
+                             what, bytes, size); \
+} while(0)
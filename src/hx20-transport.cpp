@@ -0,0 +1,320 @@
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <termios.h>
+#include <linux/serial.h>
+#include <libgen.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#include "hx20-transport.hpp"
+#include "hx20-trace.hpp"
+
+HX20Transport::~HX20Transport() {
+    if(fd != -1)
+        close(fd);
+}
+
+ssize_t HX20Transport::readv(struct iovec const *iov, int iovcnt) {
+    return ::readv(fd, iov, iovcnt);
+}
+
+ssize_t HX20Transport::write(uint8_t const *buf, size_t size) {
+    return ::write(fd, buf, size);
+}
+
+static void setNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if(flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+        throw IOError(errno, std::system_category(), "Setting non-blocking mode failed");
+}
+
+static void makeRaw(int fd, bool baudrate) {
+    struct termios termios_d;
+    if(tcgetattr(fd, &termios_d) == -1)
+        throw IOError(errno, std::system_category(), "Get terminal attributes failed");
+    cfmakeraw(&termios_d);
+
+    termios_d.c_cflag &= ~CRTSCTS;
+
+    if(baudrate) {
+        cfsetospeed(&termios_d,B38400);
+        cfsetispeed(&termios_d,B38400);
+    }
+    if(tcsetattr(fd, TCSANOW, &termios_d) == -1)
+        throw IOError(errno, std::system_category(), "Set terminal attributes failed");
+    if(tcflush(fd, TCIOFLUSH) == -1)
+        throw IOError(errno, std::system_category(), "Flush terminal failed");
+}
+
+HX20TtyTransport::HX20TtyTransport(std::string const &path) : path(path) {
+    fd = ::open(path.c_str(), O_RDWR | O_NONBLOCK | O_NOCTTY);
+    if(fd == -1)
+        throw IOError(errno, std::system_category(), "Could not open device");
+
+    makeRaw(fd, true);
+
+    int i = TIOCM_DTR; // Pin DTR wird deaktiviert (-12V)
+    // interessiert aber iirc niemanden?
+    //pseudo terminals have no modem lines
+    if(ioctl(fd, TIOCMBIC, &i) == -1 && errno != ENOTTY && errno != EINVAL)
+        throw IOError(errno, std::system_category(), "Setting DTR failed");
+
+    char real[PATH_MAX];
+    if(realpath(path.c_str(), real)) {
+        std::string timer = std::string("/sys/class/tty/") + basename(real) +
+                            "/device/latency_timer";
+        if(access(timer.c_str(), R_OK) == 0)
+            latencyTimerPath = timer;
+    }
+}
+
+std::string HX20TtyTransport::description() const {
+    return path;
+}
+
+//10 bits per byte at the 38400 baud makeRaw sets
+int64_t HX20TtyTransport::lineUsPerByte() const {
+    return 260;
+}
+
+bool HX20TtyTransport::hasLowLatency() const {
+    struct serial_struct ss;
+    return ioctl(fd, TIOCGSERIAL, &ss) == 0;
+}
+
+HX20TtyTuning HX20TtyTransport::tuning() const {
+    HX20TtyTuning t;
+    struct termios termios_d;
+    if(tcgetattr(fd, &termios_d) == -1)
+        throw IOError(errno, std::system_category(), "Get terminal attributes failed");
+    t.vmin = termios_d.c_cc[VMIN];
+    t.vtime = termios_d.c_cc[VTIME];
+    struct serial_struct ss;
+    if(ioctl(fd, TIOCGSERIAL, &ss) == 0)
+        t.lowLatency = (ss.flags & ASYNC_LOW_LATENCY) != 0;
+    if(!latencyTimerPath.empty()) {
+        FILE *f = fopen(latencyTimerPath.c_str(), "r");
+        if(f) {
+            if(fscanf(f, "%d", &t.latencyTimer) != 1)
+                t.latencyTimer = -1;
+            fclose(f);
+        }
+    }
+    return t;
+}
+
+void HX20TtyTransport::applyTuning(HX20TtyTuning const &tuning) {
+    struct termios termios_d;
+    if(tcgetattr(fd, &termios_d) == -1)
+        throw IOError(errno, std::system_category(), "Get terminal attributes failed");
+    termios_d.c_cc[VMIN] = tuning.vmin;
+    termios_d.c_cc[VTIME] = tuning.vtime;
+    if(tcsetattr(fd, TCSANOW, &termios_d) == -1)
+        throw IOError(errno, std::system_category(), "Set terminal attributes failed");
+
+    struct serial_struct ss;
+    if(ioctl(fd, TIOCGSERIAL, &ss) == 0) {
+        if(tuning.lowLatency)
+            ss.flags |= ASYNC_LOW_LATENCY;
+        else
+            ss.flags &= ~ASYNC_LOW_LATENCY;
+        if(ioctl(fd, TIOCSSERIAL, &ss) == -1)
+            throw IOError(errno, std::system_category(), "Setting low latency mode failed");
+    } else if(tuning.lowLatency) {
+        throw IOError(errno, std::system_category(), "Port has no low latency mode");
+    }
+
+    //after the low latency mode, ftdi_sio sets the timer along with it
+    if(tuning.latencyTimer < 0)
+        return;
+    if(latencyTimerPath.empty())
+        throw IOError(ENOTSUP, std::system_category(), "Port has no latency timer");
+    FILE *f = fopen(latencyTimerPath.c_str(), "w");
+    if(!f)
+        throw IOError(errno, std::system_category(), "Opening the latency timer failed");
+    int res = fprintf(f, "%d\n", tuning.latencyTimer);
+    //the driver rejects values only when the write reaches it
+    if(fclose(f) != 0 || res < 0)
+        throw IOError(errno, std::system_category(), "Setting the latency timer failed");
+}
+
+std::string HX20TtyTuning::toString() const {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "vmin=%d,vtime=%d,lowlatency=%d,timer=%d",
+             vmin, vtime, lowLatency ? 1 : 0, latencyTimer);
+    return buf;
+}
+
+bool HX20TtyTuning::fromString(std::string const &s, HX20TtyTuning &tuning) {
+    int low;
+    HX20TtyTuning t;
+    if(sscanf(s.c_str(), "vmin=%d,vtime=%d,lowlatency=%d,timer=%d",
+              &t.vmin, &t.vtime, &low, &t.latencyTimer) != 4)
+        return false;
+    if(t.vmin < 0 || t.vmin > 255 || t.vtime < 0 || t.vtime > 255)
+        return false;
+    t.lowLatency = low != 0;
+    tuning = t;
+    return true;
+}
+
+HX20PtyTransport::HX20PtyTransport(std::string const &link) :
+    slave_fd(-1), link(link) {
+    fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if(fd == -1)
+        throw IOError(errno, std::system_category(), "Could not open pseudo terminal");
+    if(grantpt(fd) == -1 || unlockpt(fd) == -1)
+        throw IOError(errno, std::system_category(), "Unlocking pseudo terminal failed");
+    char const *name = ptsname(fd);
+    if(!name)
+        throw IOError(errno, std::system_category(), "Getting pseudo terminal name failed");
+    slave_name = name;
+
+    slave_fd = ::open(name, O_RDWR | O_NOCTTY);
+    if(slave_fd == -1)
+        throw IOError(errno, std::system_category(), "Could not open pseudo terminal slave");
+    //our destructor does not run when we throw, only the one closing fd
+    try {
+        //no baudrate here, the pair runs at memory speed
+        makeRaw(slave_fd, false);
+
+        if(!link.empty()) {
+            struct stat st;
+            //only ever replace a stale link, never a real file
+            if(lstat(link.c_str(), &st) == 0 && S_ISLNK(st.st_mode))
+                unlink(link.c_str());
+            if(symlink(name, link.c_str()) == -1)
+                throw IOError(errno, std::system_category(), "Creating pseudo terminal link failed");
+        }
+    } catch(...) {
+        close(slave_fd);
+        throw;
+    }
+    HX20_TRACE(Proto, Info, "pseudo terminal for the HX-20 side: %s\n",
+               link.empty() ? slave_name.c_str() : link.c_str());
+}
+
+HX20PtyTransport::~HX20PtyTransport() {
+    if(!link.empty())
+        unlink(link.c_str());
+    if(slave_fd != -1)
+        close(slave_fd);
+}
+
+std::string HX20PtyTransport::description() const {
+    return "pty://" + (link.empty() ? slave_name : link);
+}
+
+HX20UnixSocketTransport::HX20UnixSocketTransport(std::string const &path) :
+    path(path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(path.size() >= sizeof(addr.sun_path))
+        throw IOError(ENAMETOOLONG, std::system_category(), "Socket path too long");
+    memcpy(addr.sun_path, path.c_str(), path.size());
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd == -1)
+        throw IOError(errno, std::system_category(), "Could not create socket");
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+        throw IOError(errno, std::system_category(), "Could not connect socket");
+    setNonBlocking(fd);
+}
+
+std::string HX20UnixSocketTransport::description() const {
+    return "unix://" + path;
+}
+
+HX20TcpTransport::HX20TcpTransport(std::string const &host,
+                                   std::string const &port) :
+    host(host), port(port) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *res;
+    int err = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+    if(err != 0)
+        throw IOError(EHOSTUNREACH, std::system_category(), gai_strerror(err));
+
+    int last_errno = ECONNREFUSED;
+    for(struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+                    ai->ai_protocol);
+        if(fd == -1) {
+            last_errno = errno;
+            continue;
+        }
+        if(connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        last_errno = errno;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if(fd == -1)
+        throw IOError(last_errno, std::system_category(), "Could not connect socket");
+
+    //every handshake byte is latency critical
+    int one = 1;
+    if(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == -1)
+        throw IOError(errno, std::system_category(), "Setting TCP_NODELAY failed");
+    setNonBlocking(fd);
+}
+
+std::string HX20TcpTransport::description() const {
+    return "tcp://" + host + ":" + port;
+}
+
+ssize_t HX20NullTransport::readv(struct iovec const *iov, int iovcnt) {
+    errno = EAGAIN;
+    return -1;
+}
+
+ssize_t HX20NullTransport::write(uint8_t const *buf, size_t size) {
+    return size;
+}
+
+std::string HX20NullTransport::description() const {
+    return "null";
+}
+
+static bool startsWith(std::string const &s, char const *prefix) {
+    return s.compare(0, strlen(prefix), prefix) == 0;
+}
+
+std::unique_ptr<HX20Transport> HX20Transport::open(std::string const &url) {
+    if(startsWith(url, "tty://"))
+        return std::unique_ptr<HX20Transport>(new HX20TtyTransport(url.substr(6)));
+    if(startsWith(url, "pty://"))
+        return std::unique_ptr<HX20Transport>(new HX20PtyTransport(url.substr(6)));
+    if(startsWith(url, "unix://"))
+        return std::unique_ptr<HX20Transport>(new HX20UnixSocketTransport(url.substr(7)));
+    if(startsWith(url, "tcp://")) {
+        std::string hostport = url.substr(6);
+        size_t colon = hostport.rfind(':');
+        if(colon == std::string::npos)
+            throw IOError(EINVAL, std::system_category(), "tcp:// needs host:port");
+        std::string host = hostport.substr(0, colon);
+        //[::1]:port
+        if(host.size() >= 2 && host.front() == '[' && host.back() == ']')
+            host = host.substr(1, host.size() - 2);
+        return std::unique_ptr<HX20Transport>(
+            new HX20TcpTransport(host, hostport.substr(colon + 1)));
+    }
+    return std::unique_ptr<HX20Transport>(new HX20TtyTransport(url));
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <memory>
+#include <system_error>
+#include <sys/types.h>
+
+struct iovec;
+
+class IOError : public std::system_error {
+public:
+    IOError(std::error_code ec) : system_error(ec) {}
+    IOError(std::error_code ec, const std::string &what_arg) : system_error(ec, what_arg) {}
+    IOError(std::error_code ec, const char *what_arg) : system_error(ec, what_arg) {}
+    IOError(int ev, const std::error_category &ecat) : system_error(ev, ecat) {}
+    IOError(int ev, const std::error_category &ecat, const std::string &what_arg) : system_error(ev, ecat, what_arg) {}
+    IOError(int ev, const std::error_category &ecat, const char *what_arg) : system_error(ev, ecat, what_arg) {}
+};
+
+/* The byte stream to the HX-20 (or an emulator of it). All transports
+ * hand out a non-blocking fd that can be polled for reading and writing.
+ */
+class HX20Transport {
+protected:
+    int fd;
+    HX20Transport() : fd(-1) {}
+public:
+    virtual ~HX20Transport();
+    int getFd() const { return fd; }
+    //same semantics as readv/write on a non-blocking fd
+    virtual ssize_t readv(struct iovec const *iov, int iovcnt);
+    virtual ssize_t write(uint8_t const *buf, size_t size);
+    virtual std::string description() const = 0;
+    //how long a byte takes on the wire in microseconds, 0 where the
+    //bytes are not clocked out at a baud rate
+    virtual int64_t lineUsPerByte() const { return 0; }
+
+    /* Opens the transport described by url:
+     * <path> or tty://<path>: a serial port, set up for 38400 baud
+     * pty://[<link>]: a new pseudo terminal pair, the slave side is for
+     *                 the emulator and optionally symlinked to <link>
+     * unix://<path>: connects to a Unix domain stream socket
+     * tcp://<host>:<port>: connects to a TCP socket
+     */
+    static std::unique_ptr<HX20Transport> open(std::string const &url);
+};
+
+/* The knobs of a serial port that decide how long a byte sits in the
+ * adapter and the kernel before we see it.
+ */
+struct HX20TtyTuning {
+    //termios, cfmakeraw sets 1 and 0
+    int vmin = 1;
+    int vtime = 0;
+    //ASYNC_LOW_LATENCY through TIOCSSERIAL
+    bool lowLatency = false;
+    //the FTDI latency timer in ms, -1 to leave it to the driver
+    int latencyTimer = -1;
+    std::string toString() const;
+    //parses what toString returns
+    static bool fromString(std::string const &s, HX20TtyTuning &tuning);
+};
+
+class HX20TtyTransport : public HX20Transport {
+private:
+    std::string path;
+    //sysfs latency_timer of FTDI adapters, empty if there is none
+    std::string latencyTimerPath;
+public:
+    HX20TtyTransport(std::string const &path);
+    virtual std::string description() const override;
+    virtual int64_t lineUsPerByte() const override;
+    std::string const &devicePath() const { return path; }
+    bool hasLowLatency() const;
+    bool hasLatencyTimer() const { return !latencyTimerPath.empty(); }
+    HX20TtyTuning tuning() const;
+    //throws IOError if the port does not take it
+    void applyTuning(HX20TtyTuning const &tuning);
+};
+
+class HX20PtyTransport : public HX20Transport {
+private:
+    //kept open, so the master does not see a hangup while the emulator
+    //has not opened the slave side (yet).
+    int slave_fd;
+    std::string slave_name;
+    std::string link;
+public:
+    HX20PtyTransport(std::string const &link = std::string());
+    virtual ~HX20PtyTransport() override;
+    std::string const &slaveName() const { return slave_name; }
+    virtual std::string description() const override;
+};
+
+class HX20UnixSocketTransport : public HX20Transport {
+private:
+    std::string path;
+public:
+    HX20UnixSocketTransport(std::string const &path);
+    virtual std::string description() const override;
+};
+
+class HX20TcpTransport : public HX20Transport {
+private:
+    std::string host;
+    std::string port;
+public:
+    HX20TcpTransport(std::string const &host, std::string const &port);
+    virtual std::string description() const override;
+};
+
+//never has input and discards everything written, for driving a
+//connection through HX20SerialConnection::feedBytes.
+class HX20NullTransport : public HX20Transport {
+public:
+    virtual ssize_t readv(struct iovec const *iov, int iovcnt) override;
+    virtual ssize_t write(uint8_t const *buf, size_t size) override;
+    virtual std::string description() const override;
+};
@@ -0,0 +1,170 @@
+#include "link-stats-window.hpp"
+#include "hx20-ser-proto.hpp"
+
+#include <QTreeWidget>
+#include <QVBoxLayout>
+#include <QHBoxLayout>
+#include <QLabel>
+#include <QPushButton>
+#include <QSpinBox>
+#include <QTimer>
+
+enum Column {
+    ColName,
+    ColReceived,
+    ColSent,
+    ColRespP50,
+    ColRespP99,
+    ColRespMax,
+    ColAckP50,
+    ColAckP99,
+    ColNaks,
+    ColWaks,
+    ColRetries,
+    ColTimeouts,
+    ColFailures,
+    ColChecksumErrors,
+    ColCount
+};
+
+//latencies are shown in milliseconds
+static QString formatMicros(uint64_t us, uint64_t count) {
+    if(count == 0)
+        return QString("-");
+    return QString::number(us / 1000.0, 'f', 2);
+}
+
+LinkStatsWindow::LinkStatsWindow(QWidget *parent, Qt::WindowFlags f)
+    : QDockWidget(parent, f), conn(nullptr),
+      tree(new QTreeWidget(this)), budget(new QSpinBox(this)),
+      rto(new QLabel(this)),
+      refreshTimer(new QTimer(this)) {
+    QWidget *w = new QWidget(this);
+    QVBoxLayout *layout = new QVBoxLayout(w);
+    QHBoxLayout *controls = new QHBoxLayout();
+
+    budget->setRange(1, 10000);
+    //the hx-20 retry timer we answer to is in the same range as ours
+    budget->setValue(800);
+    budget->setSuffix(tr(" ms"));
+    QPushButton *reset = new QPushButton(tr("Reset"), this);
+    controls->addWidget(new QLabel(tr("Response budget:"), this));
+    controls->addWidget(budget);
+    controls->addWidget(rto);
+    controls->addStretch();
+    controls->addWidget(reset);
+    layout->addLayout(controls);
+    layout->addWidget(tree);
+    setWidget(w);
+    setWindowTitle(tr("Link statistics"));
+
+    tree->setColumnCount(ColCount);
+    tree->setHeaderLabels({
+        tr("Function/Device"), tr("Received"), tr("Sent"),
+        tr("Resp p50"), tr("Resp p99"), tr("Resp max"),
+        tr("ACK p50"), tr("ACK p99"),
+        tr("NAKs"), tr("WAKs"), tr("Retries"), tr("Timeouts"), tr("Failures"),
+        tr("Checksum errors")
+    });
+
+    refreshTimer->setInterval(1000);
+    connect(refreshTimer, &QTimer::timeout, this, &LinkStatsWindow::refresh);
+    connect(budget, QOverload<int>::of(&QSpinBox::valueChanged),
+            this, &LinkStatsWindow::refresh);
+    connect(reset, &QPushButton::clicked,
+    this, [this]() {
+        if(conn)
+            conn->resetLinkStats();
+        refresh();
+    });
+}
+
+void LinkStatsWindow::showEvent(QShowEvent *event) {
+    refresh();
+    refreshTimer->start();
+}
+
+void LinkStatsWindow::hideEvent(QHideEvent *event) {
+    refreshTimer->stop();
+}
+
+void LinkStatsWindow::setConnection(HX20SerialConnection *conn) {
+    this->conn = conn;
+    if(isVisible())
+        refresh();
+}
+
+void LinkStatsWindow::fillCounters(QTreeWidgetItem *item,
+                                   HX20LinkCounters const &c) {
+    item->setText(ColReceived, QString::number(c.packetsReceived));
+    item->setText(ColSent, QString::number(c.packetsSent));
+    item->setText(ColNaks, QString::number(c.naks));
+    item->setText(ColWaks, QString::number(c.waks));
+    item->setText(ColRetries, QString::number(c.retries));
+    item->setText(ColTimeouts, QString::number(c.timeouts));
+    item->setText(ColFailures, QString::number(c.failures));
+    item->setText(ColChecksumErrors, QString::number(c.checksumErrors));
+}
+
+void LinkStatsWindow::fillFnc(QTreeWidgetItem *item, HX20FncStats const &s) {
+    fillCounters(item, s.counters);
+    HdrHistogram const &r = s.responseLatency;
+    HdrHistogram const &a = s.ackTurnaround;
+    item->setText(ColRespP50, formatMicros(r.percentile(0.5), r.count()));
+    item->setText(ColRespP99, formatMicros(r.percentile(0.99), r.count()));
+    item->setText(ColRespMax, formatMicros(r.max(), r.count()));
+    item->setText(ColAckP50, formatMicros(a.percentile(0.5), a.count()));
+    item->setText(ColAckP99, formatMicros(a.percentile(0.99), a.count()));
+
+    uint64_t budgetUs = budget->value() * 1000;
+    QBrush brush;
+    if(r.count() && r.max() >= budgetUs)
+        brush = QBrush(Qt::red);
+    else if(r.count() && r.percentile(0.99) * 5 >= budgetUs * 4)
+        brush = QBrush(Qt::yellow);
+    for(int c = ColRespP50; c <= ColRespMax; c++)
+        item->setBackground(c, brush);
+}
+
+void LinkStatsWindow::refresh() {
+    tree->clear();
+    rto->clear();
+    if(!conn)
+        return;
+    HX20LinkStats stats = conn->linkStats().snapshot();
+    if(stats.rtoUs)
+        rto->setText(tr("Text ACK timeout: %1 ms (round trip %2 ms)")
+                     .arg(stats.rtoUs / 1000.0, 0, 'f', 1)
+                     .arg(stats.srttUs / 1000.0, 0, 'f', 2));
+
+    QTreeWidgetItem *total = new QTreeWidgetItem(tree);
+    total->setText(ColName, tr("All"));
+    fillFnc(total, stats.total);
+
+    if(stats.relayLatency.count()) {
+        //the time our relaying adds to every byte in bridge mode
+        HdrHistogram const &r = stats.relayLatency;
+        QTreeWidgetItem *relay = new QTreeWidgetItem(tree);
+        relay->setText(ColName, tr("Bridge relay"));
+        relay->setText(ColRespP50, formatMicros(r.percentile(0.5), r.count()));
+        relay->setText(ColRespP99, formatMicros(r.percentile(0.99), r.count()));
+        relay->setText(ColRespMax, formatMicros(r.max(), r.count()));
+    }
+
+    QTreeWidgetItem *fncs = new QTreeWidgetItem(tree);
+    fncs->setText(ColName, tr("Function codes"));
+    for(auto &f : stats.fncs) {
+        QTreeWidgetItem *item = new QTreeWidgetItem(fncs);
+        item->setText(ColName, QString("0x%1").arg(f.first, 2, 16, QChar('0')));
+        fillFnc(item, f.second);
+    }
+
+    QTreeWidgetItem *devices = new QTreeWidgetItem(tree);
+    devices->setText(ColName, tr("Devices"));
+    for(auto &d : stats.devices) {
+        QTreeWidgetItem *item = new QTreeWidgetItem(devices);
+        item->setText(ColName, QString("0x%1").arg(d.first, 2, 16, QChar('0')));
+        fillCounters(item, d.second);
+    }
+    tree->expandAll();
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <QDockWidget>
+
+QT_BEGIN_NAMESPACE
+
+class QTreeWidget;
+class QTreeWidgetItem;
+class QSpinBox;
+class QLabel;
+class QTimer;
+
+QT_END_NAMESPACE
+
+class HX20SerialConnection;
+struct HX20FncStats;
+struct HX20LinkCounters;
+
+/* Shows the HX20LinkStats of the connection, refreshed once a second
+ * while visible. Response latencies getting close to the budget are
+ * highlighted.
+ */
+class LinkStatsWindow : public QDockWidget {
+    Q_OBJECT;
+private:
+    HX20SerialConnection *conn;
+    QTreeWidget *tree;
+    QSpinBox *budget;
+    QLabel *rto;
+    QTimer *refreshTimer;
+
+    void fillCounters(QTreeWidgetItem *item, HX20LinkCounters const &c);
+    void fillFnc(QTreeWidgetItem *item, HX20FncStats const &s);
+    void refresh();
+protected:
+    virtual void hideEvent(QHideEvent *event) override;
+    virtual void showEvent(QShowEvent *event) override;
+public:
+    LinkStatsWindow(QWidget *parent = nullptr, Qt::WindowFlags f = Qt::WindowFlags());
+    void setConnection(HX20SerialConnection *conn);
+};
@@ -1,11 +1,15 @@
 #include "mainwindow.hpp"
 #include "comms-debug.hpp"
+#include "link-stats-window.hpp"
 #include "hx20-devices/crt/hx20-crt-dev.hpp"
 #include "hx20-devices/disk/hx20-disk-dev.hpp"
+#include "hx20-capture.hpp"
+#include "calibrate.hpp"
 
 #include <fstream>
 #include <set>
 
+#include <stdio.h>
 #include <poll.h>
 #include <dirent.h>
 #include <unistd.h>
@@ -19,6 +23,8 @@
 #include <QMenuBar>
 #include <QInputDialog>
 #include <QActionGroup>
+#include <QTimer>
+#include <QFileDialog>
 
 static void findTtysInDev(std::vector<dev_t> const &device_ids,
                           std::string const &base,
@@ -130,8 +136,10 @@ MainWindow::MainWindow(QWidget *parent, Qt::WindowFlags flags) :
     std::make_unique<HX20DiskDevice>(0),
     std::make_unique<HX20DiskDevice>(1)}),
 commsdbg(new CommsDebugWindow()),
+linkstats(new LinkStatsWindow()),
 config_action_group(new QActionGroup(this)) {
     commsdbg->setObjectName("commsdebugdock");
+    linkstats->setObjectName("linkstatsdock");
     currentConfiguration = settingsRoot->value("CurrentConfiguration",0).toInt();
     if(currentConfiguration >= settingsRoot->arraySize("Configuration"))
         currentConfiguration = 0;
@@ -147,6 +155,9 @@ config_action_group(new QActionGroup(this)) {
     auto comms_menu = menuBar()->addMenu(tr("&Communication"));
     auto connect_comms = comms_menu->addAction(tr("&Connect..."));
     auto debug_comms_action = comms_menu->addAction(tr("&Debug"));
+    auto stats_comms_action = comms_menu->addAction(tr("&Statistics"));
+    auto capture_comms_action = comms_menu->addAction(tr("C&apture to file..."));
+    capture_comms_action->setCheckable(true);
 
     QObject::connect(connect_comms, &QAction::triggered,
     [this]() {
@@ -155,7 +166,7 @@ config_action_group(new QActionGroup(this)) {
         QStringList devs = findTtys();
         bool ok;
         QString item = dlg.getItem(this, tr("Select Device"),
-                                   tr("TTY Device for connection"),
+                                   tr("TTY device or transport URL for connection"),
                                    devs, 0, true, &ok);
         if(ok && !item.isEmpty()) {
             try {
@@ -171,6 +182,35 @@ config_action_group(new QActionGroup(this)) {
     [this]() {
         commsdbg->show();
     });
+    QObject::connect(capture_comms_action, &QAction::triggered,
+    [this, capture_comms_action](bool checked) {
+        if(!checked) {
+            capture_file.clear();
+            if(conn)
+                conn->stopCapture();
+            return;
+        }
+        QString file = QFileDialog::getSaveFileName(this, tr("Capture to file"));
+        if(file.isEmpty()) {
+            capture_comms_action->setChecked(false);
+            return;
+        }
+        capture_file = file;
+        if(conn) {
+            try {
+                conn->startCapture(capture_file.toLocal8Bit().data());
+            } catch(std::exception &e) {
+                QMessageBox::warning(this, "Could not start capture", e.what());
+                capture_file.clear();
+                capture_comms_action->setChecked(false);
+            }
+        }
+    });
+    addDockWidget(Qt::BottomDockWidgetArea, linkstats);
+    QObject::connect(stats_comms_action, &QAction::triggered,
+    [this]() {
+        linkstats->show();
+    });
 
     auto config_menu = menuBar()->addMenu(tr("&Configurations"));
     auto new_config = config_menu->addAction(tr("&New Configuration"));
@@ -262,6 +302,7 @@ config_action_group(new QActionGroup(this)) {
 
 MainWindow::~MainWindow() {
     commsdbg->setConnection(nullptr);
+    linkstats->setConnection(nullptr);
 }
 
 bool MainWindow::setConfigFromCommandline(QString const &config) {
@@ -349,8 +390,53 @@ void MainWindow::saveConfiguration() {
     settingsConfigurationRoot->setValue("window_state", saveState());
 }
 
+void MainWindow::registerDevices() {
+    conn->registerDevice(crt_dev.get());
+    if(disk_devs[0])
+        conn->registerDevice(disk_devs[0].get());
+    if(disk_devs[1])
+        conn->registerDevice(disk_devs[1].get());
+}
+
+int MainWindow::replayCapture(QString const &file) {
+    HX20CaptureReader capture(file.toLocal8Bit().data());
+    HX20ReplayTransport *transport = new HX20ReplayTransport();
+    conn = std::make_unique<HX20SerialConnection>(
+           std::unique_ptr<HX20Transport>(transport));
+    registerDevices();
+    commsdbg->setConnection(conn.get());
+    linkstats->setConnection(conn.get());
+
+    HX20ReplayResult res = ::replayCapture(capture, *conn, *transport);
+    printf("replayed %zu records, %llu bytes from the hx-20 in %.3f s\n",
+           capture.records.size(), (unsigned long long)res.inputBytes,
+           res.seconds);
+    printf("responses: %llu bytes expected, %llu bytes sent\n",
+           (unsigned long long)res.expectedBytes,
+           (unsigned long long)res.sentBytes);
+    if(res.ioError)
+        printf("replay stopped by an error\n");
+    if(res.firstMismatch >= 0) {
+        printf("responses differ at byte %lld, input record %lld\n",
+               (long long)res.firstMismatch, (long long)res.mismatchRecord);
+        return 1;
+    }
+    return res.ioError ? 1 : 0;
+}
+
 void MainWindow::connectCommunication(QString const &device) {
-    conn = std::make_unique<HX20SerialConnection>(device.toLocal8Bit().data());
+    conn = std::make_unique<HX20SerialConnection>(
+           openTunedTransport(settingsRoot.get(), device));
+
+    registerDevices();
+    if(!bridge_device.isEmpty())
+        conn->setBridge(HX20Transport::open(bridge_device.toLocal8Bit().data()));
+    if(!capture_file.isEmpty())
+        conn->startCapture(capture_file.toLocal8Bit().data());
+
+    //keep the protocol timing independent of the gui load. The devices
+    //are still called on this thread, whenever the notifiers fire.
+    conn->startThread();
 
     std::vector<struct pollfd> pfds;
     pfds.resize(conn->getNfds());
@@ -368,6 +454,7 @@ void MainWindow::connectCommunication(QString const &device) {
                     QMessageBox::critical(this, "IO error", "IO on filedescriptor failed");
                     in_notifier.release()->deleteLater();
                 }
+                armProtocolTimer();
             });
             in_notifier->setEnabled(true);
         }
@@ -382,6 +469,7 @@ void MainWindow::connectCommunication(QString const &device) {
                     QMessageBox::critical(this, "IO error", "IO on filedescriptor failed");
                     out_notifier.release()->deleteLater();
                 }
+                armProtocolTimer();
             });
             out_notifier->setEnabled(true);
         }
@@ -396,18 +484,33 @@ void MainWindow::connectCommunication(QString const &device) {
                     QMessageBox::critical(this, "IO error", "IO on filedescriptor failed");
                     err_notifier.release()->deleteLater();
                 }
+                armProtocolTimer();
             });
             err_notifier->setEnabled(true);
         }
     }
 
-    conn->registerDevice(crt_dev.get());
-    if(disk_devs[0])
-        conn->registerDevice(disk_devs[0].get());
-    if(disk_devs[1])
-        conn->registerDevice(disk_devs[1].get());
+    //retries of the transmit state machine are driven by this timer when
+    //the connection is not serviced by its own thread
+    protocol_timer = std::make_unique<QTimer>();
+    protocol_timer->setSingleShot(true);
+    QObject::connect(protocol_timer.get(), &QTimer::timeout,
+    [this]() {
+        if(conn->handleTimeout() < 0)
+            QMessageBox::critical(this, "IO error", "IO on filedescriptor failed");
+        armProtocolTimer();
+    });
 
     commsdbg->setConnection(conn.get());
+    linkstats->setConnection(conn.get());
+}
+
+void MainWindow::armProtocolTimer() {
+    int timeout = conn ? conn->getTimeout() : -1;
+    if(timeout < 0)
+        protocol_timer->stop();
+    else
+        protocol_timer->start(timeout);
 }
 
 void MainWindow::closeEvent(QCloseEvent *event) {
@@ -9,10 +9,12 @@ QT_BEGIN_NAMESPACE
 
 class QActionGroup;
 class QSocketNotifier;
+class QTimer;
 
 QT_END_NAMESPACE
 
 class CommsDebugWindow;
+class LinkStatsWindow;
 class HX20CrtDevice;
 class HX20DiskDevice;
 class HX20SerialConnection;
@@ -30,10 +32,16 @@ public:
     std::array<std::unique_ptr<HX20DiskDevice>, 2 > disk_devs;
     std::unique_ptr<HX20SerialConnection> conn;
     CommsDebugWindow *commsdbg;
+    LinkStatsWindow *linkstats;
     QActionGroup *config_action_group;
     std::unique_ptr<QSocketNotifier> in_notifier;
     std::unique_ptr<QSocketNotifier> out_notifier;
     std::unique_ptr<QSocketNotifier> err_notifier;
+    std::unique_ptr<QTimer> protocol_timer;
+    //captures every new connection to this file if set
+    QString capture_file;
+    //transport url of a real device taking the ids we do not emulate
+    QString bridge_device;
 
     MainWindow(QWidget *parent = nullptr, Qt::WindowFlags flags = Qt::WindowFlags());
     virtual ~MainWindow() override;
@@ -42,7 +50,11 @@ public:
     void loadConfiguration(int configuration, bool noConnect = false);
     void saveConfiguration();
     void connectCommunication(QString const &device);
+    //runs the capture through the devices and exits, returns the exit code
+    int replayCapture(QString const &file);
+    void armProtocolTimer();
 
+    void registerDevices();
     static void setupDrive(std::unique_ptr< HX20DiskDevice > const &dev,
                            int drive_code, QString const &disk);
 protected:
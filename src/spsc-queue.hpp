@@ -0,0 +1,45 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <stddef.h>
+
+/* Bounded single-producer/single-consumer queue. push may only be called
+ * from one thread and pop only from one (other) thread. head and tail are
+ * free running, Size must be a power of two.
+ */
+template<typename T, size_t Size>
+class SPSCQueue {
+private:
+    static_assert((Size & (Size - 1)) == 0, "Size must be a power of two");
+    std::array<T, Size> ring;
+    //written by the consumer
+    alignas(64) std::atomic<size_t> head;
+    //written by the producer
+    alignas(64) std::atomic<size_t> tail;
+public:
+    SPSCQueue() : head(0), tail(0) {}
+
+    bool push(T &&v) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if(t - head.load(std::memory_order_acquire) == Size)
+            return false;
+        ring[t % Size] = std::move(v);
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T &v) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if(h == tail.load(std::memory_order_acquire))
+            return false;
+        v = std::move(ring[h % Size]);
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const {
+        return head.load(std::memory_order_acquire) ==
+               tail.load(std::memory_order_acquire);
+    }
+};
@@ -0,0 +1,201 @@
+/* Feeds an EPSP byte stream, as sent by the hx-20, through the receiver
+ * of HX20SerialConnection and through the legacy receiver it replaced,
+ * and reports the throughput of both.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <random>
+#include <vector>
+#include <boost/program_options.hpp>
+
+#include "hx20-ser-proto.hpp"
+#include "hx20-transport.hpp"
+#include "legacy-receiver.hpp"
+
+#define SOH 0x1
+#define STX 0x2
+#define ETX 0x3
+#define EOT 0x4
+#define ENQ 0x5
+#define PS 0x31
+
+#define BENCH_DID 0x30
+#define BENCH_SID 0x20
+
+class BenchDevice : public HX20SerialDevice, public LegacyDevice {
+public:
+    size_t packets;
+    uint32_t sum;
+    BenchDevice() : packets(0), sum(0) {}
+    void count(uint16_t size, uint8_t const *buf) {
+        packets++;
+        for(unsigned int i = 0; i < size; i++)
+            sum += buf[i];
+    }
+protected:
+    virtual int getDeviceID() const override {
+        return BENCH_DID;
+    }
+    virtual int gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
+                          uint16_t size, uint8_t *buf,
+                          HX20SerialConnection *conn) override {
+        count(size, buf);
+        return 0;
+    }
+public:
+    virtual int gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
+                          uint16_t size, uint8_t *buf) override {
+        count(size, buf);
+        return 0;
+    }
+};
+
+static void appendFrame(std::vector<uint8_t> &stream,
+                        std::vector<uint8_t> const &frame) {
+    uint8_t sum = 0;
+    for(auto b : frame) {
+        stream.push_back(b);
+        sum += b;
+    }
+    stream.push_back(-sum);
+}
+
+//what the hx-20 sends for one packet, handshakes of our side left out
+static void appendPacket(std::vector<uint8_t> &stream, uint8_t fnc,
+                         std::vector<uint8_t> const &data, bool wide) {
+    uint16_t siz = data.size()-1;
+    stream.push_back(EOT);
+    stream.push_back(PS);
+    stream.push_back(BENCH_DID);
+    stream.push_back(BENCH_SID);
+    stream.push_back(ENQ);
+
+    std::vector<uint8_t> header;
+    header.push_back(SOH);
+    header.push_back((wide ? 0x04 : 0) | ((siz & 0xff00) ? 0x02 : 0));
+    if(wide) {
+        header.push_back(0);
+        header.push_back(BENCH_DID);
+        header.push_back(0);
+        header.push_back(BENCH_SID);
+    } else {
+        header.push_back(BENCH_DID);
+        header.push_back(BENCH_SID);
+    }
+    header.push_back(fnc);
+    if(siz & 0xff00)
+        header.push_back(siz >> 8);
+    header.push_back(siz & 0xff);
+    appendFrame(stream, header);
+
+    std::vector<uint8_t> text;
+    text.push_back(STX);
+    text.insert(text.end(), data.begin(), data.end());
+    text.push_back(ETX);
+    appendFrame(stream, text);
+    stream.push_back(EOT);
+}
+
+namespace po = boost::program_options;
+
+int main(int argc, char **argv) {
+    po::options_description desc("Options");
+    desc.add_options()
+    ("help", "produce help message")
+    ("input,i", po::value<std::string>(), "Raw byte stream captured from the hx-20, instead of generated packets")
+    ("packets,n", po::value<unsigned int>()->default_value(10000), "Number of generated packets")
+    ("size,s", po::value<unsigned int>()->default_value(64), "Data size of generated packets (1-65536)")
+    ("wide", "Generate headers with 16 bit ids")
+    ("iterations,r", po::value<unsigned int>()->default_value(20), "Passes over the stream")
+    ;
+
+    po::variables_map vm;
+    try {
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+    } catch(boost::program_options::error &e) {
+        std::cout << "ERROR: " << e.what() << "\n";
+        std::cout << desc << "\n";
+        return 1;
+    }
+
+    if(vm.count("help")) {
+        std::cout << desc << "\n";
+        return 1;
+    }
+
+    std::vector<uint8_t> stream;
+    if(vm.count("input")) {
+        std::ifstream f(vm["input"].as<std::string>(), std::ios::binary);
+        if(!f) {
+            std::cout << "Could not open " << vm["input"].as<std::string>() << "\n";
+            return 1;
+        }
+        stream.assign(std::istreambuf_iterator<char>(f),
+                      std::istreambuf_iterator<char>());
+    } else {
+        unsigned int size = vm["size"].as<unsigned int>();
+        if(size < 1 || size > 65536) {
+            std::cout << "size must be between 1 and 65536\n";
+            return 1;
+        }
+        std::mt19937 rng(20);
+        std::vector<uint8_t> data(size);
+        for(unsigned int i = 0; i < vm["packets"].as<unsigned int>(); i++) {
+            for(auto &b : data)
+                b = rng();
+            appendPacket(stream, 0x92, data, vm.count("wide") != 0);
+        }
+    }
+    unsigned int iterations = vm["iterations"].as<unsigned int>();
+
+    BenchDevice legacyDev;
+    LegacyReceiver legacy;
+    legacy.registerDevice(BENCH_DID, &legacyDev);
+
+    BenchDevice dev;
+    std::unique_ptr<HX20SerialConnection> conn(
+        new HX20SerialConnection(std::unique_ptr<HX20Transport>(new HX20NullTransport())));
+    conn->registerDevice(&dev);
+
+    auto t0 = std::chrono::steady_clock::now();
+    for(unsigned int i = 0; i < iterations; i++) {
+        for(auto b : stream) {
+            if(legacy.receiveByte(b) < 0) {
+                printf("legacy receiver failed\n");
+                return 1;
+            }
+        }
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    for(unsigned int i = 0; i < iterations; i++) {
+        if(conn->feedBytes(stream.data(), stream.size()) < 0) {
+            printf("receiver failed\n");
+            return 1;
+        }
+    }
+    auto t2 = std::chrono::steady_clock::now();
+
+    if(legacyDev.packets != dev.packets || legacyDev.sum != dev.sum) {
+        printf("receivers disagree: %zu packets (sum %08x) vs %zu packets (sum %08x)\n",
+               legacyDev.packets, legacyDev.sum, dev.packets, dev.sum);
+        return 1;
+    }
+
+    double bytes = (double)stream.size() * iterations;
+    double tl = std::chrono::duration<double>(t1 - t0).count();
+    double tn = std::chrono::duration<double>(t2 - t1).count();
+    printf("%zu bytes, %zu packets per pass, %u passes\n",
+           stream.size(), dev.packets / (iterations ? iterations : 1), iterations);
+    printf("legacy:       %8.2f ns/byte %10.1f MB/s %12.0f packets/s\n",
+           tl * 1e9 / bytes, bytes / tl / 1e6, dev.packets / tl);
+    printf("table driven: %8.2f ns/byte %10.1f MB/s %12.0f packets/s\n",
+           tn * 1e9 / bytes, bytes / tn / 1e6, dev.packets / tn);
+    printf("speedup:      %8.2fx\n", tl / tn);
+    return 0;
+}
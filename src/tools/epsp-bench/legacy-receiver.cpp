@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <cassert>
+
+#include "legacy-receiver.hpp"
+
+#define EPSP_DEBUG(fmt, ...)
+
+#define SOH 0x1
+#define STX 0x2
+#define ETX 0x3
+#define EOT 0x4
+#define ENQ 0x5
+#define ACK 0x6
+#define NAK 0x15
+#define PS 0x31
+
+#define WRITEb(v) do { written++; } while(0)
+
+LegacyReceiver::LegacyReceiver() : state(NoHeader), written(0) {
+}
+
+void LegacyReceiver::registerDevice(uint16_t id, LegacyDevice *dev) {
+    devices[id] = dev;
+}
+
+void LegacyReceiver::addByteToBuf(uint8_t b) {
+    buf.push_back(b);
+}
+
+uint8_t LegacyReceiver::checkSumBuf() {
+    uint8_t sum = 0;
+    for(unsigned int i = 0; i < buf.size(); i++)
+        sum += buf[i];
+    return sum;
+}
+
+int LegacyReceiver::receiveByte(uint8_t b) {
+    EPSP_DEBUG("Got %02x in ",b);
+    switch(state) {
+    case Select: {
+        EPSP_DEBUG("Select\n");
+        addByteToBuf(b);
+        if(buf.size() < 4) {
+            fflush(stdout);
+            return 0;
+        }
+        selectedSlaveID = buf[1];
+        selectedMasterID = buf[2];
+        buf.clear();
+        LegacyDevice *dev = devices[selectedSlaveID];
+        if(dev) {
+            WRITEb(ACK);
+        }
+        EPSP_DEBUG("\n");
+        state = NoHeader;
+        fflush(stdout);
+        return 0;
+    }
+    case HaveHeader:
+        assert(buf.empty());
+        EPSP_DEBUG("HaveHeader");
+        if(b == STX) {
+            EPSP_DEBUG("\n");
+            addByteToBuf(b);
+            state = Text;
+            fflush(stdout);
+            return 0;
+        }
+        EPSP_DEBUG("->");
+        //fall through
+    case NoHeader:
+        assert(buf.empty());
+        EPSP_DEBUG("NoHeader");
+        state = NoHeader;
+        if(b == SOH) {
+            addByteToBuf(b);
+            state = Header;
+            EPSP_DEBUG("->Header\n");
+        } else if(b == PS) {
+            state = Select;
+            addByteToBuf(b);
+        } else {
+            EPSP_DEBUG("\n");
+        }
+        fflush(stdout);
+        return 0;
+    case Header: {
+        EPSP_DEBUG("Header");
+        addByteToBuf(b);
+        if(buf.size() < 2) {
+            EPSP_DEBUG("\n");
+            fflush(stdout);
+            return 0;
+        }
+        uint8_t fmt = buf[1];
+        unsigned int size = 1+1+1+1+1+1+1;
+        //soh+fmt+did+sid+fnc+siz+hcs
+        if(fmt & 0x2) //Size is 16 bit
+            size++;
+        if(fmt & 0x4) //IDs are 16 bit
+            size += 2;
+        if(buf.size() < size) {
+            EPSP_DEBUG("\n");
+            fflush(stdout);
+            return 0;
+        }
+        if(checkSumBuf() != 0) {
+            WRITEb(NAK);
+            buf.clear();
+            EPSP_DEBUG("->NoHeader\n");
+            state = NoHeader;
+            fflush(stdout);
+            return 0;
+        }
+
+        int pos = 2;//soh+fmt
+        if(fmt & 4) {
+            did = buf[pos++] << 8;
+            did |= buf[pos++];
+            sid = buf[pos++] << 8;
+            sid |= buf[pos++];
+        } else {
+            did = buf[pos++];
+            sid = buf[pos++];
+        }
+        fnc = buf[pos++];
+        if(fmt & 2) {
+            siz = buf[pos++] << 8;
+            siz |= buf[pos++];
+        } else {
+            siz = buf[pos++];
+        }
+
+        WRITEb(ACK);
+        buf.clear();
+        EPSP_DEBUG("->HaveHeader\n");
+        state = HaveHeader;
+        fflush(stdout);
+        return 0;
+    }
+    case Text: {
+        EPSP_DEBUG("Text\n");
+        addByteToBuf(b);
+        if(buf.size() < (unsigned)siz+1+1+1+1) {
+            fflush(stdout);
+            return 0;
+        }
+        if(checkSumBuf() != 0) {
+            WRITEb(NAK);
+            buf.clear();
+            state = HaveHeader;
+            EPSP_DEBUG("->HaveHeader\n");
+            fflush(stdout);
+            return 0;
+        }
+
+        WRITEb(ACK);
+        state = EndOfText;
+        EPSP_DEBUG("->EndOfText\n");
+        fflush(stdout);
+        break;
+    }
+    case EndOfText: {
+        EPSP_DEBUG("EndOfText");
+        if(b == ENQ) {
+            WRITEb(ACK);
+            break;
+        } else if(b != EOT) {
+            break;
+        }
+        EPSP_DEBUG("->HaveHeader\n");
+        fflush(stdout);
+        state = HaveHeader;
+
+        LegacyDevice *dev = devices[did];
+
+        if(dev) {
+            fflush(stdout);
+            int res = dev->gotPacket(did, sid, fnc, siz+1, buf.data()+1);
+            buf.clear();
+            return res;
+        }
+        buf.clear();
+        fflush(stdout);
+        return 0;
+    }
+    default:
+        EPSP_DEBUG("Unknown??\n");
+        fflush(stdout);
+        break;
+    }
+    return 0;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <unordered_map>
+#include <vector>
+
+/* The receive state machine of HX20SerialConnection as it was before the
+ * table driven rewrite, kept for comparison. Monitors are left out, the
+ * handshake bytes go to a counter instead of the fd.
+ */
+class LegacyDevice {
+public:
+    virtual ~LegacyDevice() = default;
+    virtual int gotPacket(uint16_t sid, uint16_t did, uint8_t fnc,
+                          uint16_t size, uint8_t *buf) = 0;
+};
+
+class LegacyReceiver {
+private:
+    enum State {
+        NoHeader,
+        Select,
+        Header,
+        HaveHeader,
+        Text,
+        EndOfText
+    };
+    std::unordered_map<int, LegacyDevice *> devices;
+    enum State state;
+    std::vector<uint8_t> buf;
+    void addByteToBuf(uint8_t b);
+    uint8_t checkSumBuf();
+
+    uint16_t selectedSlaveID, selectedMasterID;
+
+    uint16_t did;
+    uint16_t sid;
+    uint8_t fnc;
+    uint16_t siz;//size-1
+public:
+    size_t written;
+
+    LegacyReceiver();
+    void registerDevice(uint16_t id, LegacyDevice *dev);
+    __attribute__((warn_unused_result))
+    int receiveByte(uint8_t b);
+};
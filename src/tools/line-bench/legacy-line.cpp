@@ -0,0 +1,92 @@
+#include "legacy-line.hpp"
+
+/* draw_line as hx20-crt-dev.cpp had it before HX20CrtRaster, some
+ * bresenham, with clipping. The two early returns are new: without them
+ * lines starting right of or below the image never ended.
+ */
+void legacy_draw_line(uint8_t *image, int width, int height,
+                      int x1, int y1, int x2, int y2, uint8_t color) {
+    int dx = x2 - x1;
+    int dy = y2 - y1;
+    int px = x1;
+    int py = y1;
+    if(dx > dy) {
+        if(dx < 0) {
+            px += dx;
+            dx = -dx;
+            py += dy;
+            dy = -dy;
+        }
+        int end = px + dx + 1;
+        if(end > width)
+            end = width;
+        if(px >= end)
+            return;
+        int frac = dx / 2;
+        while((px < 0 || py >= height || py < 0) &&
+                px != end) {
+            frac += dy;
+            if(frac > dx) {
+                frac -= dx;
+                py++;
+            }
+            if(frac < 0) {
+                frac += dx;
+                py--;
+            }
+            px++;
+        }
+        while(px != end && py >= 0 && py < height) {
+            image[px+py*width] = color;
+            frac += dy;
+            if(frac > dx) {
+                frac -= dx;
+                py++;
+            }
+            if(frac < 0) {
+                frac += dx;
+                py--;
+            }
+            px++;
+        }
+    } else {
+        if(dy < 0) {
+            px += dx;
+            dx = -dx;
+            py += dy;
+            dy = -dy;
+        }
+        int end = py + dy + 1;
+        if(end > height)
+            end = height;
+        if(py >= end)
+            return;
+        int frac = dy / 2;
+        while((py < 0 || px >= width || px < 0) &&
+                py != end) {
+            frac += dx;
+            if(frac > dy) {
+                frac -= dy;
+                px++;
+            }
+            if(frac < 0) {
+                frac += dy;
+                px--;
+            }
+            py++;
+        }
+        while(py != end && px >= 0 && px < width) {
+            image[px+py*width] = color;
+            frac += dx;
+            if(frac > dy) {
+                frac -= dy;
+                px++;
+            }
+            if(frac < 0) {
+                frac += dy;
+                px--;
+            }
+            py++;
+        }
+    }
+}
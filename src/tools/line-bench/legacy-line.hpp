@@ -0,0 +1,7 @@
+#pragma once
+
+#include <stdint.h>
+
+//the line drawing HX20CrtRaster replaced, kept for comparison
+void legacy_draw_line(uint8_t *image, int width, int height,
+                      int x1, int y1, int x2, int y2, uint8_t color);
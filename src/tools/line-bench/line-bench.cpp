@@ -0,0 +1,211 @@
+/* Draws sets of lines, as 0xc8 gets them, into a graphics image with
+ * HX20CrtRaster and with the line drawing it replaced, and reports the
+ * time per line of both. Every line HX20CrtRaster draws is first
+ * checked against the old one, pixels and dirty box.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <chrono>
+#include <iostream>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <string.h>
+#include <vector>
+#include <boost/program_options.hpp>
+
+#include "hx20-devices/crt/hx20-crt-raster.hpp"
+#include "legacy-line.hpp"
+
+struct Line {
+    int x1, y1, x2, y2;
+};
+
+/* What HX20CrtRaster has to draw: the old draw_line's pixels and the box
+ * around them. draw_line only got lines with their longer axis running
+ * left or up right when given their ends the other way round.
+ */
+static void referenceLine(std::vector<uint8_t> &image, int width, int height,
+                          Line l, uint8_t color,
+                          int &left, int &top, int &right, int &bottom) {
+    int adx = std::abs(l.x2 - l.x1);
+    int ady = std::abs(l.y2 - l.y1);
+    if((adx > ady && l.x2 < l.x1) || (ady > adx && l.y2 < l.y1)) {
+        std::swap(l.x1, l.x2);
+        std::swap(l.y1, l.y2);
+    }
+    legacy_draw_line(image.data(), width, height, l.x1, l.y1, l.x2, l.y2, color);
+    left = top = INT32_MAX;
+    right = bottom = INT32_MIN;
+    for(int y = 0; y < height; y++) {
+        for(int x = 0; x < width; x++) {
+            if(image[x + y * width] != color)
+                continue;
+            left = std::min(left, x);
+            top = std::min(top, y);
+            right = std::max(right, x + 1);
+            bottom = std::max(bottom, y + 1);
+        }
+    }
+}
+
+//returns the number of lines HX20CrtRaster got wrong, printing the first
+static size_t checkLines(std::vector<Line> const &lines, int width, int height) {
+    std::vector<uint8_t> expected(width * height);
+    std::vector<uint8_t> image(width * height);
+    HX20CrtRaster raster;
+    raster.setTarget(image.data(), width, height);
+    size_t wrong = 0;
+    for(auto &l : lines) {
+        memset(expected.data(), 0, expected.size());
+        memset(image.data(), 0, image.size());
+        int el, et, er, eb;
+        referenceLine(expected, width, height, l, 1, el, et, er, eb);
+        raster.line(l.x1, l.y1, l.x2, l.y2, 1);
+        int left, top, right, bottom;
+        bool dirty = raster.takeDirty(left, top, right, bottom);
+        bool expectDirty = er > el;
+        if(image == expected && dirty == expectDirty &&
+                (!dirty || (left == el && top == et && right == er && bottom == eb)))
+            continue;
+        if(wrong++ == 0)
+            printf("%d,%d-%d,%d on %dx%d is drawn wrong\n",
+                   l.x1, l.y1, l.x2, l.y2, width, height);
+    }
+    return wrong;
+}
+
+//corner to corner, edge to edge and across, the most pixels there are
+static std::vector<Line> longLines(int width, int height, std::mt19937 &rng) {
+    std::vector<Line> lines;
+    for(int i = 0; i < 256; i++) {
+        int x = rng() % width;
+        int y = rng() % height;
+        lines.push_back(Line { 0, y, width - 1, height - 1 - y });
+        lines.push_back(Line { x, 0, width - 1 - x, height - 1 });
+        lines.push_back(Line { 0, y, width - 1, y });
+        lines.push_back(Line { x, 0, x, height - 1 });
+    }
+    return lines;
+}
+
+//starting or ending far off the image, anywhere 0xc8 can reach
+static std::vector<Line> clippedLines(int width, int height, std::mt19937 &rng) {
+    std::vector<Line> lines;
+    for(int i = 0; i < 1024; i++) {
+        Line l { int(rng() % width), int(rng() % height),
+                 int(rng() % 65536), int(rng() % 65536) };
+        if(i % 4 == 1)
+            l.y2 = l.y1;
+        if(i % 4 == 2)
+            l.x2 = l.x1;
+        lines.push_back(l);
+    }
+    return lines;
+}
+
+//single points, and lines that never touch the image
+static std::vector<Line> degenerateLines(int width, int height, std::mt19937 &rng) {
+    std::vector<Line> lines;
+    for(int i = 0; i < 1024; i++) {
+        int x = rng() % width;
+        int y = rng() % height;
+        if(i % 2)
+            lines.push_back(Line { x, y, x, y });
+        else
+            lines.push_back(Line { width + x, height + y,
+                                   int(rng() % 65536), int(rng() % 65536) });
+    }
+    return lines;
+}
+
+namespace po = boost::program_options;
+
+int main(int argc, char **argv) {
+    po::options_description desc("Options");
+    desc.add_options()
+    ("help", "produce help message")
+    ("width,x", po::value<int>()->default_value(640), "Width of the graphics")
+    ("height,y", po::value<int>()->default_value(480), "Height of the graphics")
+    ("iterations,r", po::value<unsigned int>()->default_value(200), "Passes over each set of lines")
+    ;
+
+    po::variables_map vm;
+    try {
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+    } catch(boost::program_options::error &e) {
+        std::cout << "ERROR: " << e.what() << "\n";
+        std::cout << desc << "\n";
+        return 1;
+    }
+
+    if(vm.count("help")) {
+        std::cout << desc << "\n";
+        return 1;
+    }
+
+    int width = vm["width"].as<int>();
+    int height = vm["height"].as<int>();
+    if(width < 1 || height < 1 || width > 65536 || height > 65536) {
+        std::cout << "width and height must be between 1 and 65536\n";
+        return 1;
+    }
+    unsigned int iterations = vm["iterations"].as<unsigned int>();
+
+    std::mt19937 rng(20);
+    struct {
+        char const *name;
+        std::vector<Line> lines;
+    } sets[] = {
+        { "long", longLines(width, height, rng) },
+        { "clipped", clippedLines(width, height, rng) },
+        { "degenerate", degenerateLines(width, height, rng) },
+    };
+
+    //anything goes on a small image, that one is cheap to compare
+    std::vector<Line> anyLines;
+    for(int i = 0; i < 100000; i++) {
+        auto coord = [&rng](int size) { return int(rng() % (3 * size)) - size; };
+        anyLines.push_back(Line { coord(64), coord(48), coord(64), coord(48) });
+    }
+    size_t wrong = checkLines(anyLines, 64, 48);
+    for(auto &set : sets)
+        wrong += checkLines(set.lines, width, height);
+    if(wrong) {
+        printf("%zu lines drawn wrong\n", wrong);
+        return 1;
+    }
+
+    std::vector<uint8_t> image(width * height);
+    HX20CrtRaster raster;
+    raster.setTarget(image.data(), width, height);
+
+    printf("%dx%d, %u passes, ns per line\n", width, height, iterations);
+    printf("%-12s %12s %12s %10s\n", "", "legacy", "clipped", "speedup");
+    for(auto &set : sets) {
+        auto t0 = std::chrono::steady_clock::now();
+        for(unsigned int i = 0; i < iterations; i++) {
+            uint8_t color = i;
+            for(auto &l : set.lines)
+                legacy_draw_line(image.data(), width, height,
+                                 l.x1, l.y1, l.x2, l.y2, color);
+        }
+        auto t1 = std::chrono::steady_clock::now();
+        for(unsigned int i = 0; i < iterations; i++) {
+            uint8_t color = i;
+            for(auto &l : set.lines)
+                raster.line(l.x1, l.y1, l.x2, l.y2, color);
+        }
+        auto t2 = std::chrono::steady_clock::now();
+        int left, top, right, bottom;
+        raster.takeDirty(left, top, right, bottom);
+
+        double n = (double)set.lines.size() * iterations;
+        double tl = std::chrono::duration<double>(t1 - t0).count();
+        double tn = std::chrono::duration<double>(t2 - t1).count();
+        printf("%-12s %12.1f %12.1f %9.2fx\n", set.name,
+               tl * 1e9 / n, tn * 1e9 / n, tl / tn);
+    }
+    return 0;
+}
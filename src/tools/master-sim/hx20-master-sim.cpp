@@ -0,0 +1,612 @@
+/* Plays the HX-20 side of EPSP against a running emulator and measures
+ * how fast the devices answer. The HX-20 is the bus master: it selects a
+ * device, sends one packet and, where the function has one, waits for
+ * the response. See hx20-ser-proto.cpp for the sequences.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <boost/program_options.hpp>
+
+#include "hx20-transport.hpp"
+#include "hx20-link-stats.hpp"
+
+#define SOH 0x1
+#define STX 0x2
+#define ETX 0x3
+#define EOT 0x4
+#define ENQ 0x5
+#define ACK 0x6
+#define NAK 0x15
+#define PS 0x31
+
+#define MASTER_SID 0x20
+#define CRT_DID 0x30
+#define DISK_DID 0x31
+
+#define BDOS_OK 0x00
+#define BDOS_FILE_NOT_FOUND 0xff
+
+typedef std::chrono::steady_clock Clock;
+
+class HX20Master {
+private:
+    std::unique_ptr<HX20Transport> transport;
+    int timeoutMs;
+    int retries;
+    uint8_t inBuf[4096];
+    size_t inPos, inLen;
+
+    int readByte(int timeout) __attribute__((warn_unused_result));
+    int writeAll(uint8_t const *buf, size_t size) __attribute__((warn_unused_result));
+    int sendFrame(std::vector<uint8_t> const &frame) __attribute__((warn_unused_result));
+    int select(uint8_t did) __attribute__((warn_unused_result));
+    int receiveResponse(std::vector<uint8_t> &response) __attribute__((warn_unused_result));
+public:
+    uint64_t bytesSent;
+    uint64_t bytesReceived;
+    uint64_t naks;
+    uint64_t timeouts;
+    HX20Master(std::unique_ptr<HX20Transport> transport, int timeoutMs, int retries);
+    //waits up to timeoutMs for the device to answer a select and leaves
+    //the bus idle again
+    int connect(uint8_t did, int timeoutMs) __attribute__((warn_unused_result));
+    /* Sends one packet to did. When withResponse is set, waits for the
+     * response packet and stores its data in response.
+     * Returns 0 on success, -1 on I/O errors or when the device did not
+     * answer after all retries.
+     */
+    int request(uint8_t did, uint8_t fnc, std::vector<uint8_t> const &data,
+                bool withResponse, std::vector<uint8_t> &response)
+    __attribute__((warn_unused_result));
+};
+
+HX20Master::HX20Master(std::unique_ptr<HX20Transport> transport, int timeoutMs,
+                       int retries) :
+    transport(std::move(transport)), timeoutMs(timeoutMs), retries(retries),
+    inPos(0), inLen(0),
+    bytesSent(0), bytesReceived(0), naks(0), timeouts(0) {
+}
+
+//returns the byte, -2 on timeout and -1 on errors
+int HX20Master::readByte(int timeout) {
+    while(inPos == inLen) {
+        struct pollfd p;
+        p.fd = transport->getFd();
+        p.events = POLLIN;
+        p.revents = 0;
+        int res = poll(&p, 1, timeout);
+        if(res < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        if(res == 0)
+            return -2;
+        struct iovec iov;
+        iov.iov_base = inBuf;
+        iov.iov_len = sizeof(inBuf);
+        ssize_t len = transport->readv(&iov, 1);
+        if(len < 0) {
+            if(errno == EAGAIN || errno == EINTR)
+                continue;
+            return -1;
+        }
+        if(len == 0)
+            return -1;
+        inPos = 0;
+        inLen = len;
+        bytesReceived += len;
+    }
+    return inBuf[inPos++];
+}
+
+int HX20Master::writeAll(uint8_t const *buf, size_t size) {
+    while(size > 0) {
+        ssize_t res = transport->write(buf, size);
+        if(res < 0) {
+            if(errno == EINTR)
+                continue;
+            if(errno != EAGAIN)
+                return -1;
+            struct pollfd p;
+            p.fd = transport->getFd();
+            p.events = POLLOUT;
+            p.revents = 0;
+            if(poll(&p, 1, timeoutMs) <= 0)
+                return -1;
+            continue;
+        }
+        buf += res;
+        size -= res;
+        bytesSent += res;
+    }
+    return 0;
+}
+
+//appends the checksum and sends the frame, returns the handshake byte
+int HX20Master::sendFrame(std::vector<uint8_t> const &frame) {
+    std::vector<uint8_t> buf(frame);
+    uint8_t sum = 0;
+    for(auto b : frame)
+        sum += b;
+    buf.push_back(-sum);
+    if(writeAll(buf.data(), buf.size()) < 0)
+        return -1;
+    return readByte(timeoutMs);
+}
+
+int HX20Master::select(uint8_t did) {
+    uint8_t seq[5] = { EOT, PS, did, MASTER_SID, ENQ };
+    for(int i = 0; i < retries; i++) {
+        if(writeAll(seq, sizeof(seq)) < 0)
+            return -1;
+        int b = readByte(timeoutMs);
+        if(b == ACK)
+            return 0;
+        if(b == -1)
+            return -1;
+        if(b == -2)
+            timeouts++;
+        else
+            naks++;
+    }
+    return -1;
+}
+
+int HX20Master::connect(uint8_t did, int timeoutMs) {
+    uint8_t seq[5] = { EOT, PS, did, MASTER_SID, ENQ };
+    auto deadline = Clock::now() + std::chrono::milliseconds(timeoutMs);
+    while(true) {
+        if(writeAll(seq, sizeof(seq)) < 0)
+            return -1;
+        int b = readByte(1000);
+        if(b == ACK)
+            break;
+        if(b == -1 || Clock::now() >= deadline)
+            return -1;
+    }
+    //selects sent before the emulator was listening may still get
+    //answered, so wait for the line to go quiet before releasing the bus.
+    while(true) {
+        int b = readByte(200);
+        if(b == -2)
+            break;
+        if(b == -1)
+            return -1;
+    }
+    uint8_t eot = EOT;
+    return writeAll(&eot, 1);
+}
+
+int HX20Master::receiveResponse(std::vector<uint8_t> &response) {
+    for(int attempt = 0; attempt < retries; attempt++) {
+        int b = readByte(timeoutMs);
+        if(b < 0) {
+            if(b == -2)
+                timeouts++;
+            return -1;
+        }
+        if(b != SOH)
+            continue;
+        b = readByte(timeoutMs);
+        if(b < 0)
+            return -1;
+        uint8_t fmt = b;
+        //fmt, did, sid, fnc, siz, hcs, with 16 bit ids and size as flagged
+        unsigned int hlen = 5 + ((fmt & 0x04) ? 2 : 0) + ((fmt & 0x02) ? 1 : 0);
+        uint8_t sum = SOH + fmt;
+        uint8_t header[8];
+        for(unsigned int i = 0; i < hlen; i++) {
+            b = readByte(timeoutMs);
+            if(b < 0)
+                return -1;
+            header[i] = b;
+            sum += b;
+        }
+        uint8_t handshake = sum == 0 ? ACK : NAK;
+        if(writeAll(&handshake, 1) < 0)
+            return -1;
+        if(handshake == NAK)
+            continue;
+        uint32_t size = header[hlen-2] + 1;
+        if(fmt & 0x02)
+            size += header[hlen-3] << 8;
+
+        for(int textAttempt = 0; textAttempt < retries; textAttempt++) {
+            do {
+                b = readByte(timeoutMs);
+            } while(b >= 0 && b != STX);
+            if(b < 0)
+                return -1;
+            sum = STX;
+            response.resize(size);
+            for(uint32_t i = 0; i < size; i++) {
+                b = readByte(timeoutMs);
+                if(b < 0)
+                    return -1;
+                response[i] = b;
+                sum += b;
+            }
+            for(int i = 0; i < 2; i++) {
+                b = readByte(timeoutMs);
+                if(b < 0)
+                    return -1;
+                sum += b;
+            }
+            handshake = sum == 0 ? ACK : NAK;
+            if(writeAll(&handshake, 1) < 0)
+                return -1;
+            if(handshake == ACK) {
+                b = readByte(timeoutMs);
+                return b == EOT ? 0 : -1;
+            }
+        }
+        return -1;
+    }
+    return -1;
+}
+
+int HX20Master::request(uint8_t did, uint8_t fnc, std::vector<uint8_t> const &data,
+                        bool withResponse, std::vector<uint8_t> &response) {
+    if(data.empty() || data.size() > 65536)
+        return -1;
+    if(select(did) < 0)
+        return -1;
+
+    uint16_t siz = data.size() - 1;
+    std::vector<uint8_t> header;
+    header.push_back(SOH);
+    header.push_back((siz & 0xff00) ? 0x02 : 0);
+    header.push_back(did);
+    header.push_back(MASTER_SID);
+    header.push_back(fnc);
+    if(siz & 0xff00)
+        header.push_back(siz >> 8);
+    header.push_back(siz & 0xff);
+
+    std::vector<uint8_t> text;
+    text.push_back(STX);
+    text.insert(text.end(), data.begin(), data.end());
+    text.push_back(ETX);
+
+    int i;
+    for(i = 0; i < retries; i++) {
+        int b = sendFrame(header);
+        if(b == ACK)
+            break;
+        if(b == -1)
+            return -1;
+        if(b == -2)
+            timeouts++;
+        else
+            naks++;
+    }
+    if(i == retries)
+        return -1;
+    for(i = 0; i < retries; i++) {
+        int b = sendFrame(text);
+        if(b == ACK)
+            break;
+        if(b == -1)
+            return -1;
+        if(b == -2)
+            timeouts++;
+        else
+            naks++;
+    }
+    if(i == retries)
+        return -1;
+    uint8_t eot = EOT;
+    if(writeAll(&eot, 1) < 0)
+        return -1;
+
+    response.clear();
+    if(withResponse)
+        return receiveResponse(response);
+    return 0;
+}
+
+struct WorkloadStats {
+    std::map<uint8_t, HdrHistogram> latency;
+    uint64_t requests = 0;
+    uint64_t failures = 0;
+    uint64_t mismatches = 0;
+    double seconds = 0;
+};
+
+class Workload {
+protected:
+    HX20Master &master;
+    WorkloadStats &stats;
+    std::vector<uint8_t> response;
+    //returns the result of the request, its latency goes into stats
+    int timed(uint8_t did, uint8_t fnc, std::vector<uint8_t> const &data,
+              bool withResponse) {
+        auto start = Clock::now();
+        int res = master.request(did, fnc, data, withResponse, response);
+        auto end = Clock::now();
+        stats.requests++;
+        if(res < 0) {
+            stats.failures++;
+            return res;
+        }
+        stats.latency[fnc].record(
+            std::chrono::duration_cast<std::chrono::microseconds>(end - start).count());
+        return res;
+    }
+public:
+    Workload(HX20Master &master, WorkloadStats &stats) :
+        master(master), stats(stats) {}
+    virtual ~Workload() {}
+    virtual int run(unsigned int count) = 0;
+};
+
+//0x92: one character at a time, as BASIC PRINT does on the external display
+class CharsWorkload : public Workload {
+public:
+    using Workload::Workload;
+    virtual int run(unsigned int count) override {
+        static const char text[] = "THE QUICK BROWN FOX JUMPS OVER THE LAZY DOG 0123456789\r\n";
+        std::vector<uint8_t> data(1);
+        for(unsigned int i = 0; i < count; i++) {
+            data[0] = text[i % (sizeof(text)-1)];
+            if(timed(CRT_DID, 0x92, data, true) < 0)
+                return -1;
+            if(response.size() != 2)
+                stats.mismatches++;
+        }
+        return 0;
+    }
+};
+
+//0xc7 pixels and 0xc8 lines, which the display controller does not answer
+class GraphicsWorkload : public Workload {
+private:
+    std::mt19937 rng;
+    void putCoord(std::vector<uint8_t> &data, uint16_t v) {
+        data.push_back(v >> 8);
+        data.push_back(v & 0xff);
+    }
+public:
+    GraphicsWorkload(HX20Master &master, WorkloadStats &stats) :
+        Workload(master, stats), rng(0xc7) {}
+    virtual int run(unsigned int count) override {
+        std::vector<uint8_t> data;
+        for(unsigned int i = 0; i < count; i++) {
+            data.clear();
+            uint8_t fnc = (i & 1) ? 0xc8 : 0xc7;
+            putCoord(data, rng() % 640);
+            putCoord(data, rng() % 480);
+            if(fnc == 0xc8) {
+                putCoord(data, rng() % 640);
+                putCoord(data, rng() % 480);
+            }
+            data.push_back(rng() % 4);
+            if(timed(CRT_DID, fnc, data, false) < 0)
+                return -1;
+        }
+        return 0;
+    }
+};
+
+/* 0x0f open (0x16 create when missing), then count records written with
+ * 0x22 and read back with 0x21, then 0x10 close. The read back data is
+ * compared with what was written.
+ */
+class FileWorkload : public Workload {
+private:
+    uint8_t drive;
+    uint8_t fcbName[12];
+    static const uint16_t fcbAddress = 0x0a40;
+    void putFcb(std::vector<uint8_t> &data) {
+        data.push_back(fcbAddress >> 8);
+        data.push_back(fcbAddress & 0xff);
+    }
+    void putRecord(std::vector<uint8_t> &data, uint32_t record) {
+        data.push_back(record & 0xff);
+        data.push_back((record >> 8) & 0xff);
+        data.push_back((record >> 16) & 0xff);
+    }
+    static uint8_t pattern(uint32_t record, unsigned int i) {
+        return record * 7 + i;
+    }
+public:
+    FileWorkload(HX20Master &master, WorkloadStats &stats,
+                 uint8_t drive, std::string const &name) :
+        Workload(master, stats), drive(drive) {
+        //8.3, upper case and blank padded like the hx-20 fcb
+        memset(fcbName, ' ', sizeof(fcbName));
+        size_t dot = name.find('.');
+        std::string base = name.substr(0, dot);
+        std::string ext = dot == std::string::npos ? "" : name.substr(dot+1);
+        for(size_t i = 0; i < base.size() && i < 8; i++)
+            fcbName[i] = toupper(base[i]);
+        for(size_t i = 0; i < ext.size() && i < 3; i++)
+            fcbName[8+i] = toupper(ext[i]);
+    }
+    virtual int run(unsigned int count) override {
+        std::vector<uint8_t> data;
+        putFcb(data);
+        data.push_back(drive);
+        data.insert(data.end(), fcbName, fcbName + 11);
+        data.push_back(0);//extent
+        if(timed(DISK_DID, 0x0f, data, true) < 0 || response.size() != 1)
+            return -1;
+        if(response[0] == BDOS_FILE_NOT_FOUND) {
+            if(timed(DISK_DID, 0x16, data, true) < 0 || response.size() != 1)
+                return -1;
+        }
+        if(response[0] != BDOS_OK) {
+            printf("could not open or create the file: status %02x\n", response[0]);
+            return -1;
+        }
+
+        for(uint32_t r = 0; r < count; r++) {
+            data.clear();
+            putFcb(data);
+            for(unsigned int i = 0; i < 128; i++)
+                data.push_back(pattern(r, i));
+            putRecord(data, r);
+            if(timed(DISK_DID, 0x22, data, true) < 0)
+                return -1;
+            if(response.size() != 3 || response[2] != BDOS_OK)
+                stats.mismatches++;
+        }
+        for(uint32_t r = 0; r < count; r++) {
+            data.clear();
+            putFcb(data);
+            putRecord(data, r);
+            if(timed(DISK_DID, 0x21, data, true) < 0)
+                return -1;
+            bool ok = response.size() == 0x83 && response[0x82] == BDOS_OK;
+            for(unsigned int i = 0; ok && i < 128; i++)
+                ok = response[2+i] == pattern(r, i);
+            if(!ok)
+                stats.mismatches++;
+        }
+
+        data.clear();
+        putFcb(data);
+        if(timed(DISK_DID, 0x10, data, true) < 0)
+            return -1;
+        return 0;
+    }
+};
+
+static void printStats(char const *name, WorkloadStats const &stats,
+                       uint64_t bytes) {
+    printf("%s: %lu requests in %.3f s, %.1f requests/s, %.1f bytes/s",
+           name, (unsigned long)stats.requests, stats.seconds,
+           stats.seconds > 0 ? stats.requests / stats.seconds : 0,
+           stats.seconds > 0 ? bytes / stats.seconds : 0);
+    if(stats.failures || stats.mismatches)
+        printf(", %lu failed, %lu bad responses",
+               (unsigned long)stats.failures, (unsigned long)stats.mismatches);
+    printf("\n");
+    printf("  fnc    count      p50      p90      p99    p99.9      max  (us)\n");
+    for(auto const &l : stats.latency) {
+        HdrHistogram const &h = l.second;
+        printf("  0x%02x %8lu %8lu %8lu %8lu %8lu %8lu\n",
+               l.first, (unsigned long)h.count(),
+               (unsigned long)h.percentile(0.5), (unsigned long)h.percentile(0.9),
+               (unsigned long)h.percentile(0.99), (unsigned long)h.percentile(0.999),
+               (unsigned long)h.max());
+    }
+}
+
+namespace po = boost::program_options;
+
+int main(int argc, char **argv) {
+    po::options_description desc("Options");
+    desc.add_options()
+    ("help", "produce help message")
+    ("device,d", po::value<std::string>()->default_value("pty://"),
+     "Where the emulator is: pty://[link] creates a pseudo terminal for the emulator to open, "
+     "a path or tty:// opens one the emulator created, unix://<path> and tcp://<host>:<port> connect to it")
+    ("workload,w", po::value<std::vector<std::string>>()->composing(),
+     "chars (0x92), graphics (0xc7/0xc8) or file (0x0f/0x22/0x21); may be given more than once, default all")
+    ("count,n", po::value<unsigned int>()->default_value(1000), "Requests (file: records) per workload")
+    ("drive", po::value<unsigned int>()->default_value(1), "Drive code for the file workload, 1 is A:")
+    ("file", po::value<std::string>()->default_value("MSIMLOAD.DAT"), "File for the file workload, will be overwritten")
+    ("timeout", po::value<int>()->default_value(2000), "Handshake timeout in ms")
+    ("retries", po::value<int>()->default_value(4), "Attempts per frame")
+    ("connect-timeout", po::value<int>()->default_value(60000), "How long to wait for the emulator in ms")
+    ;
+
+    po::variables_map vm;
+    try {
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+    } catch(boost::program_options::error &e) {
+        std::cout << "ERROR: " << e.what() << "\n";
+        std::cout << desc << "\n";
+        return 1;
+    }
+
+    if(vm.count("help")) {
+        std::cout << desc << "\n";
+        return 1;
+    }
+
+    std::vector<std::string> workloads = { "chars", "graphics", "file" };
+    if(vm.count("workload"))
+        workloads = vm["workload"].as<std::vector<std::string>>();
+    for(auto const &w : workloads) {
+        if(w != "chars" && w != "graphics" && w != "file") {
+            std::cout << "unknown workload " << w << "\n";
+            return 1;
+        }
+    }
+
+    std::unique_ptr<HX20Transport> transport;
+    try {
+        transport = HX20Transport::open(vm["device"].as<std::string>());
+    } catch(std::exception const &e) {
+        std::cout << e.what() << "\n";
+        return 1;
+    }
+    printf("waiting for the emulator on %s\n", transport->description().c_str());
+    fflush(stdout);
+
+    HX20Master master(std::move(transport), vm["timeout"].as<int>(),
+                      vm["retries"].as<int>());
+    uint8_t firstDid = workloads[0] == "file" ? DISK_DID : CRT_DID;
+    if(master.connect(firstDid, vm["connect-timeout"].as<int>()) < 0) {
+        printf("no answer from device %02x\n", firstDid);
+        return 1;
+    }
+
+    unsigned int count = vm["count"].as<unsigned int>();
+    WorkloadStats total;
+    uint64_t totalBytes = 0;
+    int result = 0;
+    for(auto const &w : workloads) {
+        WorkloadStats stats;
+        std::unique_ptr<Workload> workload;
+        if(w == "chars")
+            workload.reset(new CharsWorkload(master, stats));
+        else if(w == "graphics")
+            workload.reset(new GraphicsWorkload(master, stats));
+        else
+            workload.reset(new FileWorkload(master, stats, vm["drive"].as<unsigned int>(),
+                                            vm["file"].as<std::string>()));
+
+        uint64_t bytesBefore = master.bytesSent + master.bytesReceived;
+        auto start = Clock::now();
+        if(workload->run(count) < 0) {
+            printf("%s: request failed\n", w.c_str());
+            result = 1;
+        }
+        stats.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        uint64_t bytes = master.bytesSent + master.bytesReceived - bytesBefore;
+        printStats(w.c_str(), stats, bytes);
+        if(stats.mismatches)
+            result = 1;
+
+        for(auto const &l : stats.latency)
+            total.latency[l.first].merge(l.second);
+        total.requests += stats.requests;
+        total.failures += stats.failures;
+        total.mismatches += stats.mismatches;
+        total.seconds += stats.seconds;
+        totalBytes += bytes;
+        if(result)
+            break;
+    }
+    if(workloads.size() > 1)
+        printStats("total", total, totalBytes);
+    printf("naks %lu, timeouts %lu\n",
+           (unsigned long)master.naks, (unsigned long)master.timeouts);
+    return result;
+}